@@ -0,0 +1,296 @@
+// Throughput benchmark for lab1sdsN3245 and its plugin kernels
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "plugin_api.h"
+
+typedef int (*ppf_func_t)(const char*, struct option*, size_t);
+typedef int (*pco_func_t)(struct option*, size_t, void**);
+typedef int (*pcp_func_t)(void*, const char*);
+typedef void (*pfq_func_t)(void*);
+
+// File of the benchmark tree
+typedef struct {
+    char *path;
+    long long size;
+} bench_file;
+
+// Result of one measured run
+typedef struct {
+    const char *name;       // "kernel" or "host"
+    const char *cache;      // "cold" or "warm"
+    double seconds;
+    double files_per_s;
+    double mb_per_s;
+    double p50_us, p99_us;  // Per-file latency, kernel runs only
+    long peak_rss_kb;
+} bench_result;
+
+static bench_file *files = NULL;
+static size_t files_cnt = 0, files_cap = 0;
+static long long total_bytes = 0;
+
+// Function to collect the regular files of the tree
+static int collect_func(const char *fpath, const struct stat *sb,
+                        int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    if (typeflag != FTW_F || !S_ISREG(sb->st_mode)) return 0;
+    if (files_cnt == files_cap) {
+        files_cap = files_cap ? files_cap * 2 : 1024;
+        files = realloc(files, files_cap * sizeof(bench_file));
+        if (!files) {
+            fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    files[files_cnt].path = strdup(fpath);
+    files[files_cnt].size = sb->st_size;
+    total_bytes += sb->st_size;
+    files_cnt++;
+    return 0;
+}
+
+// Function to get the time since an arbitrary point in seconds
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Function to evict the files of the tree from the page cache
+static void drop_cache(void) {
+    // Writing to drop_caches needs root, fadvise works for clean pages of any file
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd >= 0) {
+        sync();
+        if (write(fd, "1", 1) < 0) {
+            // Not allowed, the fadvise below still does the job
+        }
+        close(fd);
+    }
+    for (size_t i = 0; i < files_cnt; i++) {
+        fd = open(files[i].path, O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Function to read the whole tree once so that it is in the page cache
+static void warm_cache(void) {
+    char buf[64 * 1024];
+    for (size_t i = 0; i < files_cnt; i++) {
+        int fd = open(files[i].path, O_RDONLY);
+        if (fd < 0) continue;
+        while (read(fd, buf, sizeof(buf)) > 0);
+        close(fd);
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to run the plugin directly on every file and time each call
+static int run_kernel(const char *plugin, struct option *opts, size_t opts_len,
+                      const char *cache, bench_result *r) {
+    void *lib = dlopen(plugin, RTLD_NOW);
+    if (!lib) {
+        fprintf(stderr, "dlopen() failed for %s: %s\n", plugin, dlerror());
+        return -1;
+    }
+    ppf_func_t ppf = (ppf_func_t)dlsym(lib, "plugin_process_file");
+    pco_func_t pco = (pco_func_t)dlsym(lib, "plugin_compile");
+    pcp_func_t pcp = (pcp_func_t)dlsym(lib, "plugin_process_compiled");
+    pfq_func_t pfq = (pfq_func_t)dlsym(lib, "plugin_free_query");
+    void *query = NULL;
+    if (pco && pcp && pfq && pco(opts, opts_len, &query) < 0) {
+        fprintf(stderr, "plugin_compile() failed: %s\n", strerror(errno));
+        dlclose(lib);
+        return -1;
+    }
+    if (!query && !ppf) {
+        fprintf(stderr, "%s has no plugin_process_file()\n", plugin);
+        dlclose(lib);
+        return -1;
+    }
+
+    double *lat = malloc(files_cnt * sizeof(double));
+    if (!lat) {
+        if (query) pfq(query);
+        dlclose(lib);
+        return -1;
+    }
+    double start = now();
+    for (size_t i = 0; i < files_cnt; i++) {
+        double t0 = now();
+        if (query) pcp(query, files[i].path);
+        else ppf(files[i].path, opts, opts_len);
+        lat[i] = (now() - t0) * 1e6;
+    }
+    r->seconds = now() - start;
+    qsort(lat, files_cnt, sizeof(double), cmp_double);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    r->name = "kernel";
+    r->cache = cache;
+    r->p50_us = files_cnt ? lat[files_cnt / 2] : 0;
+    r->p99_us = files_cnt ? lat[(size_t)(files_cnt * 0.99)] : 0;
+    r->peak_rss_kb = ru.ru_maxrss;
+
+    free(lat);
+    if (query) pfq(query);
+    dlclose(lib);
+    return 0;
+}
+
+// Function to run the program on the tree as a child process
+static int run_host(char *const args[], const char *cache, bench_result *r) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        // Results are not interesting here, only the time they take
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(args[0], args);
+        fprintf(stderr, "execv() failed for %s: %s\n", args[0], strerror(errno));
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        fprintf(stderr, "wait4() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    r->seconds = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) return -1;
+
+    r->name = "host";
+    r->cache = cache;
+    r->p50_us = r->p99_us = -1;     // Per-file times are not visible from outside
+    r->peak_rss_kb = ru.ru_maxrss;
+    return 0;
+}
+
+// Function to print the usage of the benchmark
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <dir> [-- <extra program options>]\n", prog);
+    printf("--bytes <list>     bytes to search for (default 0x00,0xff)\n");
+    printf("--plugin <file>    plugin to run directly (default ./libsdsN3245.so)\n");
+    printf("--host <file>      program to run (default ./lab1sdsN3245)\n");
+    printf("--runs <n>         measured runs of each kind (default 3)\n");
+    printf("--out <file>       write JSON results to the file (default stdout)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *bytes = "0x00,0xff";
+    const char *plugin = "./libsdsN3245.so";
+    const char *host = "./lab1sdsN3245";
+    const char *out_path = NULL;
+    int runs = 3;
+
+    static struct option long_options[] = {
+        {"bytes", required_argument, 0, 'b'},
+        {"plugin", required_argument, 0, 'p'},
+        {"host", required_argument, 0, 'H'},
+        {"runs", required_argument, 0, 'r'},
+        {"out", required_argument, 0, 'o'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int choice;
+    while ((choice = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (choice) {
+            case 'b': bytes = optarg; break;
+            case 'p': plugin = optarg; break;
+            case 'H': host = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'o': out_path = optarg; break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *dir = argv[optind];
+    char **extra = argv + optind + 1;
+    int extra_cnt = argc - optind - 1;
+
+    if (nftw(dir, collect_func, 16, FTW_PHYS) < 0) {
+        fprintf(stderr, "nftw() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    // Options passed to the plugin exactly as lab1sdsN3245 passes them
+    struct option opts[1] = {{"bytes", required_argument, (int *)bytes, 0}};
+
+    // Command line of the program: <host> [extra] --bytes <list> <dir>
+    char **args = calloc(extra_cnt + 5, sizeof(char *));
+    int a = 0;
+    args[a++] = (char *)host;
+    for (int i = 0; i < extra_cnt; i++) args[a++] = extra[i];
+    args[a++] = "--bytes";
+    args[a++] = (char *)bytes;
+    args[a++] = (char *)dir;
+
+    bench_result *res = calloc(4 * runs, sizeof(bench_result));
+    int res_cnt = 0;
+    const char *caches[2] = {"cold", "warm"};
+    for (int c = 0; c < 2; c++) {
+        for (int i = 0; i < runs; i++) {
+            if (c == 0) drop_cache(); else warm_cache();
+            if (run_kernel(plugin, opts, 1, caches[c], &res[res_cnt]) == 0) res_cnt++;
+            if (c == 0) drop_cache(); else warm_cache();
+            if (run_host(args, caches[c], &res[res_cnt]) == 0) res_cnt++;
+        }
+    }
+
+    FILE *out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "fopen() failed for %s: %s\n", out_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\n  \"tree\": \"%s\",\n  \"files\": %zu,\n  \"bytes\": %lld,\n  \"query\": \"%s\",\n  \"runs\": [\n",
+            dir, files_cnt, total_bytes, bytes);
+    for (int i = 0; i < res_cnt; i++) {
+        bench_result *r = &res[i];
+        r->files_per_s = r->seconds > 0 ? files_cnt / r->seconds : 0;
+        r->mb_per_s = r->seconds > 0 ? total_bytes / r->seconds / 1e6 : 0;
+        fprintf(out, "    {\"name\": \"%s\", \"cache\": \"%s\", \"seconds\": %.6f, \"files_per_s\": %.1f, "
+                     "\"mb_per_s\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, \"peak_rss_kb\": %ld}%s\n",
+                r->name, r->cache, r->seconds, r->files_per_s, r->mb_per_s,
+                r->p50_us, r->p99_us, r->peak_rss_kb, i + 1 < res_cnt ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) fclose(out);
+
+    for (size_t i = 0; i < files_cnt; i++) free(files[i].path);
+    free(files);
+    free(args);
+    free(res);
+    return res_cnt == 4 * runs ? EXIT_SUCCESS : EXIT_FAILURE;
+}
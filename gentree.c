@@ -0,0 +1,199 @@
+// Deterministic generator of file trees for benchmarking lab1sdsN3245
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define PATH_LEN 4096
+
+// Distributions of file sizes
+enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOGNORMAL };
+
+// Generator settings
+static long n_files = 1000;         // Number of files to create
+static int fanout = 4;              // Subdirectories per directory
+static int depth = 3;               // Depth of the directory tree
+static int size_dist = SIZE_LOGNORMAL;
+static double size_a = 8.0, size_b = 1.5;   // Parameters of the size distribution
+static long size_max = 64L * 1024 * 1024;   // Upper bound for one file
+static int entropy = 8;             // Bits of entropy per byte, 0..8
+static uint64_t seed = 1;
+
+// State of the splitmix64 generator
+static uint64_t rng_state;
+
+// Function to get the next pseudo-random number
+static uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Function to get a uniform number in (0, 1)
+static double rng_unit(void) {
+    return ((rng_next() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+// Function to draw the size of the next file
+static long next_size(void) {
+    double v;
+    switch (size_dist) {
+        case SIZE_FIXED:
+            v = size_a;
+            break;
+        case SIZE_UNIFORM:
+            v = size_a + rng_unit() * (size_b - size_a);
+            break;
+        default: {
+            // Box-Muller transform gives a normal number for the log of the size
+            double n = sqrt(-2.0 * log(rng_unit())) * cos(2.0 * M_PI * rng_unit());
+            v = exp(size_a + size_b * n);
+            break;
+        }
+    }
+    if (v < 0) v = 0;
+    if (v > size_max) v = size_max;
+    return (long)v;
+}
+
+// Function to write one file of the given size
+static int write_file(const char *path, long size) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        fprintf(stderr, "fopen() failed for %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // Bytes are drawn from an alphabet of 2^entropy symbols spread over 0..255
+    unsigned char buf[64 * 1024];
+    int shift = 8 - entropy;
+    while (size > 0) {
+        size_t n = size < (long)sizeof(buf) ? (size_t)size : sizeof(buf);
+        for (size_t i = 0; i < n; i += 8) {
+            uint64_t r = rng_next();
+            for (size_t j = 0; j < 8 && i + j < n; j++) {
+                unsigned sym = entropy == 0 ? 0 : (unsigned)((r >> (8 * j)) & 0xff) >> shift;
+                buf[i + j] = (unsigned char)(sym << shift);
+            }
+        }
+        if (fwrite(buf, 1, n, f) != n) {
+            fprintf(stderr, "fwrite() failed for %s: %s\n", path, strerror(errno));
+            fclose(f);
+            return -1;
+        }
+        size -= (long)n;
+    }
+    return fclose(f);
+}
+
+// Function to build the path of directory number d in breadth-first order
+static void dir_path(char *out, const char *root, long d) {
+    // Digits of d in base fanout, most significant first, name the path
+    char rel[PATH_LEN] = "";
+    while (d > 0) {
+        char part[PATH_LEN];
+        long parent = (d - 1) / fanout;
+        snprintf(part, sizeof(part), "/d%ld%s", (d - 1) % fanout, rel);
+        strcpy(rel, part);
+        d = parent;
+    }
+    snprintf(out, PATH_LEN, "%s%s", root, rel);
+}
+
+// Function to print the usage of the generator
+static void usage(const char *prog) {
+    printf("Usage: %s [options] <dir>\n", prog);
+    printf("--files <n>        number of files (default %ld)\n", n_files);
+    printf("--fanout <n>       subdirectories per directory (default %d)\n", fanout);
+    printf("--depth <n>        depth of the directory tree (default %d)\n", depth);
+    printf("--size fixed:<s> | uniform:<min>:<max> | lognormal:<mu>:<sigma>\n");
+    printf("                   file size distribution in bytes (default lognormal:8:1.5)\n");
+    printf("--size-max <n>     largest file size (default %ld)\n", size_max);
+    printf("--entropy <bits>   entropy of file contents per byte, 0..8 (default %d)\n", entropy);
+    printf("--seed <n>         seed, equal seeds give equal trees (default 1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    static struct option long_options[] = {
+        {"files", required_argument, 0, 'f'},
+        {"fanout", required_argument, 0, 'o'},
+        {"depth", required_argument, 0, 'd'},
+        {"size", required_argument, 0, 's'},
+        {"size-max", required_argument, 0, 'm'},
+        {"entropy", required_argument, 0, 'e'},
+        {"seed", required_argument, 0, 'r'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    int choice;
+    while ((choice = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (choice) {
+            case 'f': n_files = atol(optarg); break;
+            case 'o': fanout = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'm': size_max = atol(optarg); break;
+            case 'e': entropy = atoi(optarg); break;
+            case 'r': seed = strtoull(optarg, NULL, 10); break;
+            case 's':
+                if (sscanf(optarg, "fixed:%lf", &size_a) == 1) {
+                    size_dist = SIZE_FIXED;
+                } else if (sscanf(optarg, "uniform:%lf:%lf", &size_a, &size_b) == 2) {
+                    size_dist = SIZE_UNIFORM;
+                } else if (sscanf(optarg, "lognormal:%lf:%lf", &size_a, &size_b) == 2) {
+                    size_dist = SIZE_LOGNORMAL;
+                } else {
+                    fprintf(stderr, "Bad size distribution: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1 || n_files < 0 || fanout < 1 || depth < 0 || entropy < 0 || entropy > 8) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *root = argv[optind];
+    rng_state = seed;
+
+    // Create all directories of the tree, breadth-first
+    long n_dirs = 1, level_dirs = 1;
+    for (int i = 0; i < depth; i++) {
+        level_dirs *= fanout;
+        n_dirs += level_dirs;
+    }
+    char path[PATH_LEN];
+    for (long d = 0; d < n_dirs; d++) {
+        dir_path(path, root, d);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir() failed for %s: %s\n", path, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Spread files over the directories
+    long long total = 0;
+    for (long i = 0; i < n_files; i++) {
+        char file[PATH_LEN + 32];
+        dir_path(path, root, (long)(rng_next() % (uint64_t)n_dirs));
+        snprintf(file, sizeof(file), "%s/f%ld", path, i);
+        long size = next_size();
+        if (write_file(file, size) < 0) return EXIT_FAILURE;
+        total += size;
+    }
+
+    printf("Created %ld files (%lld bytes) in %ld directories under %s\n", n_files, total, n_dirs, root);
+    return EXIT_SUCCESS;
+}
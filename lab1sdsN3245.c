@@ -1,5 +1,5 @@
 // Including necessary headers
-#define _XOPEN_SOURCE 500   // for nftw()
+#define _GNU_SOURCE         // for nftw(), d_type and the POSIX thread API
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -8,52 +8,369 @@
 #include <sys/param.h>      // for MIN()
 #include <getopt.h>
 #include <dlfcn.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>  // for the open file limit of --walker getdents
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>         // for PIPE_BUF
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>    // for --watch
+#include <sys/socket.h>
+#include <sys/un.h>         // for --serve and --connect
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>   // for --schedule extent
+#include <linux/io_uring.h>  // for the raw io_uring read-ahead engine
+#include <zlib.h>           // for the z_stream of --decompress, libz is loaded with dlopen()
 
 #include "plugin_api.h"     // Custom plugin API header
 
 #define MAX_INDENT_LEVEL 128 // Maximum indent level for file hierarchy
+#define VIEW_READ_MAX (64 * 1024) // Files up to this size are read() instead of mmap()ed
+
+// Contents of the file being checked, shared by all plugins with a buffer entry point
+struct file_view {
+    int state;              // 0 - not read yet, 1 - ready, -1 - could not be read
+    const void *data;       // File contents
+    size_t len;             // Length of the contents
+    void *map;              // mmap()ed region to unmap, NULL if read into buf
+    unsigned char *buf;     // Buffer from the pool the file was read into, NULL if none
+    int dirfd;              // Directory name is relative to
+    const char *name;       // Name to open instead of the path, NULL if none
+};
+
+// Index record: the set of bytes of one file and the metadata it is valid for
+struct index_record {
+    uint64_t dev;           // st_dev
+    uint64_t ino;           // st_ino
+    int64_t size;           // st_size
+    int64_t mtime_sec;      // st_mtim
+    int64_t mtime_nsec;
+    int64_t ctime_sec;      // st_ctim, changes on every write and metadata change
+    int64_t ctime_nsec;
+    uint64_t presence[4];   // Bit b is set if byte b occurs in the file
+};
+
+#define LAT_BUCKETS 40  // Buckets of the plugin call time histogram (--stats)
+
+// Counters of one plugin
+struct plugin_stats {
+    unsigned long calls;
+    unsigned long matches;
+    unsigned long errors;
+    unsigned long meta_rejects;         // Files rejected by metadata without a call
+    unsigned long ns;                   // Total time spent in the plugin
+    unsigned long hist[LAT_BUCKETS];    // Call time histogram
+};
+
+// Counters of one thread
+struct stats {
+    unsigned long files;        // Files checked
+    unsigned long found;        // Files printed
+    unsigned long dirs;         // Directories read by the parallel walker
+    unsigned long pruned;       // Subtrees skipped by index summaries (--prune)
+    unsigned long duplicates;   // Files that reused the verdicts of an alias (--dedupe)
+    unsigned long walk_ns;      // Time spent reading directories
+    unsigned long read_ns;      // Time the program spent opening and reading files
+    unsigned long bytes_read;   // Bytes read by the program (plugins count their own)
+    unsigned long read_errors;  // Files the program could not read
+    unsigned long pool_waits;   // Times the thread waited for a buffer (--mem-limit)
+    unsigned long dec_files;    // Compressed files checked decompressed (--decompress)
+    unsigned long dec_bytes;    // Bytes they decompressed to
+    struct plugin_stats *pl;    // One entry per plugin
+    struct stats *next;
+};
 
 // Function declarations
 int open_func(const char *fpath,const struct stat *sb, 
         int typeflag, struct FTW *ftwbuf);
 void open_dyn_libs(const char *dir);
+void load_plugins(void);
+static const char *plugin_dir_arg(int argc, char *argv[]);
+static int manifest_load(const char *dir);
+static void manifest_save(const char *dir);
+static void manifest_add_dir(const char *path, const struct stat *sb, int level);
+static void manifest_dirs_free(void);
+static void manifest_free_info(struct plugin_info *pi);
 void optparse(int argc, char *argv[]);
 void walk_dir(const char *dir);
+void walk_dir_parallel(const char *dir);
+static void walk_dir_getdents(const char *dir);
+void compile_queries(void);
+void close_plugins(void);
+void print_entry(int level, int type, const char *path, const struct stat *sb);
+void print_entry_at(int level, int dirfd, const char *name, const char *path, const struct stat *sb);
+void check_entry(int level, const char *path, const struct stat *sb, struct file_view *view);
+int index_run(const char *dir);
+void index_open(void);
+void index_close(void);
+const struct index_record *index_lookup(const struct stat *sb);
+int index_prunes(int dirfd, const char *name, const struct stat *sb);
+void io_start(void);
+void io_push(int level, const char *path, const struct stat *sb);
+void io_finish(void);
+void batch_push(int level, const char *path, const struct stat *sb);
+void batch_flush(void);
+static struct stats *stats_get(void);
+static void stats_report(unsigned long wall_ns);
+static unsigned long ts_diff(struct timespec t0, struct timespec t1);
+struct report_buf;
+void emit_found(int level, const char *path, uint64_t hits, const struct report_buf *rep);
+int merge_run(int argc, char *argv[]);
+void watch_init(const char *dir);
+void watch_run(const char *dir);
+static int watch_found(int level, const char *path, uint64_t hits);
+static const char *connect_arg(int argc, char *argv[]);
+int serve_connect(const char *path, int argc, char *argv[]);
+int serve_run(void);
+static int run_search(int argc, char *argv[]);
+void out_flush(void);
+static void out_init(void);
+static void *scratch_alloc(size_t size);
+static void scratch_reset(void);
+static void host_report(size_t file, const char *text);
+static void report_release(void);
+static void stream_release(void);
+static int dec_codec_path(const char *path);
+enum { CODEC_NONE, CODEC_GZIP, CODEC_ZSTD };   // Compressed formats of --decompress
 
 // Function pointers
 unsigned char *search_bytes;
 typedef int (*ppf_func_t)(const char*, struct option*, size_t);
 typedef int (*pgi_func_t)(struct plugin_info*);
+typedef int (*ppb_func_t)(const void*, size_t, struct option*, size_t);
+typedef int (*pco_func_t)(struct option*, size_t, void**);
+typedef int (*pcp_func_t)(void*, const char*);
+typedef int (*pcb_func_t)(void*, const void*, size_t);
+typedef void (*pfq_func_t)(void*);
+typedef int (*ppr_func_t)(void*, const uint64_t*);
+typedef int (*pbf_func_t)(void*, const char *const*, const int*, size_t, int*);
+typedef int (*pmf_func_t)(void*, struct plugin_meta_filter*);
+typedef void (*psh_func_t)(const struct plugin_host*);
+typedef int (*psb_func_t)(void*, void**);
+typedef int (*psu_func_t)(void*, const void*, size_t);
+typedef int (*pse_func_t)(void*);
 
 // Structure to store dynamic library information
 typedef struct{
     void* lib;                  // Handle to loaded library
+    char *name;                 // File name of the library
+    char *path;                 // Path of the library, it is opened when first needed
+    off_t size;                 // Size and times of the library file for the manifest
+    struct timespec mtime, ctime;
+    int cached;                 // Plugin information was read from the manifest
     struct plugin_info pi;      // Plugin information
     ppf_func_t ppf;             // Pointer to plugin process file function
+    ppb_func_t ppb;             // Pointer to plugin process buffer function (optional)
+    pco_func_t pco;             // Pointer to plugin compile function (optional)
+    pcp_func_t pcp;             // Pointer to plugin process compiled function (optional)
+    pcb_func_t pcb;             // Pointer to plugin process compiled buffer function (optional)
+    pfq_func_t pfq;             // Pointer to plugin free query function (optional)
+    ppr_func_t ppr;             // Pointer to plugin process presence function (optional)
+    pbf_func_t pbf;             // Pointer to plugin process files function (optional)
+    pmf_func_t pmf;             // Pointer to plugin get meta filter function (optional)
+    psb_func_t psb;             // Pointers to the plugin stream functions (optional, all or none)
+    psu_func_t psu;
+    pse_func_t pse;
+    struct plugin_meta_filter meta;  // Metadata every matching file has
+    int has_meta;               // meta was filled by the plugin
     struct option* in_opts;     // Options provided to the plugin
     size_t in_opts_len;         // Number of options provided
+    size_t in_opts_cap;         // Number of options in_opts has room for
+    void *query;                // Options compiled by the plugin, NULL if not compiled
 } dynamic_lib; 
 
 // Global variables for dynamic libraries
 dynamic_lib *plugins = NULL;    // Array of loaded plugins
 int plug_cnt = 0;               // Count of loaded plugins
+int plug_cap = 0;               // Number of plugins the array has room for
 int or = 0, not = 0;             // Flags for logical operations
 int found_opts = 0, got_opts = 0;// Count of found options and received options
+int n_jobs = 1;                  // Number of walker threads (-j)
+enum { WALKER_NFTW, WALKER_GETDENTS };
+int walker = WALKER_NFTW;        // Directory reader of the serial walk (--walker)
+int meta_in_use = 0;             // Some plugin in use checks metadata before reads
+int plugins_flat = 0;            // Look for plugins only in the top of the plugin directory
+static struct manifest_dir *man_dirs = NULL;    // Directories walked to find the plugins
+static size_t man_dirs_cnt = 0, man_dirs_cap = 0;
+static const char *man_root = NULL;              // Plugin directory being walked
+
+// I/O engines that read files ahead of plugin evaluation (--io)
+enum { IO_SYNC, IO_URING, IO_POOL };
+int io_engine = IO_SYNC;        // Files are read by the plugins or by print_entry()
+int io_depth = 32;              // Files read ahead by the engine (--io-depth)
+int batch_size = 1;             // Files checked together by batch plugins (--batch)
+enum { SCHED_WALK, SCHED_INODE, SCHED_EXTENT };
+int schedule = SCHED_WALK;      // Order the files of a window are read in (--schedule)
+int sched_window = 256;         // Files buffered for --schedule (--window)
+static long sched_fd_max = 0;   // Files of a window kept open at once
+enum { DEDUPE_NONE, DEDUPE_INODE, DEDUPE_CONTENT };
+int dedupe = DEDUPE_NONE;       // Reuse the verdicts of hard links or equal files (--dedupe)
+int decompress = 0;             // Check gzip and zstd files decompressed (--decompress)
+size_t mem_limit = 0;           // Bytes of buffers the pool may hold, 0 - no limit (--mem-limit)
+static const struct plugin_host host_services = {sizeof(struct plugin_host), scratch_alloc, host_report};
+int debug = 0;                  // LAB1DEBUG is set, read once at startup
+
+// Output of found files (--format, --first)
+enum { FORMAT_TREE, FORMAT_NUL, FORMAT_JSONL };
+int out_format = FORMAT_TREE;
+long first_n = 0;               // Stop after this many found files, 0 - no limit
+int out_stop = 0;               // --first limit reached, the walk winds down
+long out_found = 0;             // Files printed so far when --first is set
+#define OUT_BUF_SIZE (64*1024)
+size_t out_limit = OUT_BUF_SIZE;    // Bytes a thread gathers before writing them
+static __thread char tl_out[OUT_BUF_SIZE];
+static __thread size_t tl_out_len;
+static const char out_spaces[MAX_INDENT_LEVEL] =
+    "                                                                "
+    "                                                               ";
+
+// Sharding of the walk between processes (--shard, --merge, --merge-stats)
+enum { MERGE_NONE, MERGE_OUTPUT, MERGE_STATS };
+int shard_i = 0, shard_n = 1;   // This process walks shard shard_i of shard_n
+int shard_depth = 1;            // Subtrees at this depth are dealt out to the shards
+size_t shard_root_len = 0;      // Length of the walk root without trailing slashes
+int merge_mode = MERGE_NONE;    // Files to merge are given instead of a directory
+
+// Watch mode (--watch)
+int watch_mode = 0;             // Keep checking changed files after the walk
+int watch_queue = 4096;         // Changed paths waiting to be checked before a full rescan
+
+// Server mode (--serve, --connect)
+const char *serve_path = NULL;  // Socket the server listens on
+int serve_max = 0;              // Queries run at once, 0 - one per CPU
+
+// Statistics report (--stats)
+enum { STATS_NONE, STATS_TABLE, STATS_JSON };
+int stats_format = STATS_NONE;
+
+// Content index (--index and the commands that maintain it)
+enum { INDEX_NONE, INDEX_BUILD, INDEX_UPDATE, INDEX_VERIFY };
+const char *index_path = NULL;  // Index file
+int index_cmd = INDEX_NONE;     // Maintenance command to run instead of a search
+int index_complete = 0;         // Every plugin in use can be answered from the index
+int prune = 0;                  // Skip subtrees the index summaries rule out (--prune)
+int prune_active = 0;           // --prune with summaries that can be used for this query
+
+// Program options without a short form, their values follow the ASCII range
+enum { OPT_IO = 256, OPT_IO_DEPTH, OPT_INDEX, OPT_INDEX_BUILD, OPT_INDEX_UPDATE, OPT_INDEX_VERIFY,
+       OPT_BATCH, OPT_STATS, OPT_FORMAT, OPT_FIRST, OPT_PLUGINS_FLAT, OPT_SHARD, OPT_SHARD_DEPTH,
+       OPT_MERGE, OPT_MERGE_STATS, OPT_WATCH, OPT_WATCH_QUEUE, OPT_MEM_LIMIT, OPT_WALKER,
+       OPT_SERVE, OPT_SERVE_MAX, OPT_CONNECT, OPT_PRUNE, OPT_SCHEDULE, OPT_WINDOW,
+       OPT_DEDUPE, OPT_DECOMPRESS };
+static const struct option host_options[] = {
+    {"io", required_argument, 0, OPT_IO},
+    {"io-depth", required_argument, 0, OPT_IO_DEPTH},
+    {"index", required_argument, 0, OPT_INDEX},
+    {"index-build", required_argument, 0, OPT_INDEX_BUILD},
+    {"index-update", required_argument, 0, OPT_INDEX_UPDATE},
+    {"index-verify", required_argument, 0, OPT_INDEX_VERIFY},
+    {"batch", required_argument, 0, OPT_BATCH},
+    {"stats", optional_argument, 0, OPT_STATS},
+    {"format", required_argument, 0, OPT_FORMAT},
+    {"first", required_argument, 0, OPT_FIRST},
+    {"plugins-flat", no_argument, 0, OPT_PLUGINS_FLAT},
+    {"shard", required_argument, 0, OPT_SHARD},
+    {"shard-depth", required_argument, 0, OPT_SHARD_DEPTH},
+    {"merge", no_argument, 0, OPT_MERGE},
+    {"merge-stats", no_argument, 0, OPT_MERGE_STATS},
+    {"watch", no_argument, 0, OPT_WATCH},
+    {"watch-queue", required_argument, 0, OPT_WATCH_QUEUE},
+    {"mem-limit", required_argument, 0, OPT_MEM_LIMIT},
+    {"walker", required_argument, 0, OPT_WALKER},
+    {"serve", required_argument, 0, OPT_SERVE},
+    {"serve-max", required_argument, 0, OPT_SERVE_MAX},
+    {"connect", required_argument, 0, OPT_CONNECT},
+    {"prune", no_argument, 0, OPT_PRUNE},
+    {"schedule", required_argument, 0, OPT_SCHEDULE},
+    {"window", required_argument, 0, OPT_WINDOW},
+    {"dedupe", required_argument, 0, OPT_DEDUPE},
+    {"decompress", no_argument, 0, OPT_DECOMPRESS},
+};
+#define HOST_OPTS_LEN (sizeof(host_options) / sizeof(host_options[0]))
+
+// Function to look up the entry points of a loaded plugin
+static int plugin_bind(dynamic_lib *d, void *library) {
+    void* pf_f = dlsym(library, "plugin_process_file");
+    if (!pf_f) {
+        // If plugin_process_file function not found, print error
+        fprintf(stderr, "dlsym() failed for plugin_process_file: %s\n", dlerror());
+        return -1;
+    }
+    d->ppf = (ppf_func_t)pf_f;
+    // The buffer entry point is optional, plugins without it get the path
+    d->ppb = (ppb_func_t)dlsym(library, "plugin_process_buffer");
+    // Compiled queries are used only if the whole lifecycle is exported
+    d->pco = (pco_func_t)dlsym(library, "plugin_compile");
+    d->pcp = (pcp_func_t)dlsym(library, "plugin_process_compiled");
+    d->pcb = (pcb_func_t)dlsym(library, "plugin_process_compiled_buffer");
+    d->pfq = (pfq_func_t)dlsym(library, "plugin_free_query");
+    if (!d->pcp || !d->pfq)
+        d->pco = NULL;
+    d->ppr = (ppr_func_t)dlsym(library, "plugin_process_presence");
+    d->pbf = (pbf_func_t)dlsym(library, "plugin_process_files");
+    d->pmf = (pmf_func_t)dlsym(library, "plugin_get_meta_filter");
+    d->psb = (psb_func_t)dlsym(library, "plugin_stream_begin");
+    d->psu = (psu_func_t)dlsym(library, "plugin_stream_update");
+    d->pse = (pse_func_t)dlsym(library, "plugin_stream_end");
+    if (!d->psu || !d->pse)
+        d->psb = NULL;
+    d->lib = library;
+    psh_func_t psh = (psh_func_t)dlsym(library, "plugin_set_host");
+    if (psh) psh(&host_services);
+    return 0;
+}
+
+// Function to add an entry to the plugins array, the library may be opened later
+static dynamic_lib *plugin_add(const char *path, const struct stat *sb) {
+    if (plug_cnt == plug_cap) {
+        int cap = plug_cap ? plug_cap * 2 : 8;
+        dynamic_lib *tmp = realloc(plugins, sizeof(dynamic_lib) * cap);
+        if (!tmp) {
+            fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+            return NULL;
+        }
+        plugins = tmp;
+        plug_cap = cap;
+    }
+    dynamic_lib *d = &plugins[plug_cnt];
+    memset(d, 0, sizeof(*d));
+    d->path = strdup(path);
+    const char *base = strrchr(path, '/');
+    d->name = strdup(base ? base + 1 : path);
+    if (sb) {
+        d->size = sb->st_size;
+        d->mtime = sb->st_mtim;
+        d->ctime = sb->st_ctim;
+    }
+    plug_cnt++;
+    return d;
+}
 
 // Implementation of open_func
 int open_func(const char *fpath, const struct stat *sb, 
               int typeflag, struct FTW *ftwbuf) {
-    // Check if all parameters are used to avoid compiler warnings
-    (void) sb;
-    (void) typeflag;
-    (void) ftwbuf;
-
     // Check if file path is valid
     if (!fpath) {
         fprintf(stderr, "Invalid file path\n");
         return 0;
     }
 
+    // Directories are remembered in the manifest, a new plugin changes their mtime
+    if (typeflag == FTW_D || typeflag == FTW_DNR) {
+        if (plugins_flat && ftwbuf->level > 0) return FTW_SKIP_SUBTREE;
+        manifest_add_dir(fpath, sb, ftwbuf->level);
+        return 0;
+    }
+
     // Check if the file is a shared library
     if (typeflag == FTW_F && strstr(fpath, ".so") != NULL) {
         // Open the shared library
@@ -72,14 +389,6 @@ int open_func(const char *fpath, const struct stat *sb,
                 return 0;
             } 
             
-            void* pf_f = dlsym(library, "plugin_process_file");
-            if (!pf_f) {
-                // If plugin_process_file function not found, print error
-                fprintf(stderr, "dlsym() failed for plugin_process_file: %s\n", dlerror());
-                dlclose(library);
-                return 0;
-            }
-
             // Call plugin_get_info function to get plugin information
             struct plugin_info pi = {0};
             pgi_func_t pgi = (pgi_func_t)pi_f;
@@ -91,14 +400,20 @@ int open_func(const char *fpath, const struct stat *sb,
                 return 0;
             }
 
-            // Allocate memory for plugins array and add plugin information
-            plugins = realloc(plugins, sizeof(dynamic_lib) * (plug_cnt + 1));
-            plugins[plug_cnt].pi = pi;
-            plugins[plug_cnt].ppf = (ppf_func_t)pf_f;
-            plugins[plug_cnt].lib = library;
-            plugins[plug_cnt].in_opts = NULL;
-            plugins[plug_cnt].in_opts_len = 0;
-            plug_cnt++;
+            // Add plugin information to the plugins array, the entry is dropped if binding fails
+            dynamic_lib *d = plugin_add(fpath, sb);
+            if (!d) {
+                dlclose(library);
+                return 0;
+            }
+            if (plugin_bind(d, library) < 0) {
+                free(d->path);
+                free(d->name);
+                plug_cnt--;
+                dlclose(library);
+                return 0;
+            }
+            d->pi = pi;
             found_opts += pi.sup_opts_len;
         }
     }
@@ -108,54 +423,392 @@ int open_func(const char *fpath, const struct stat *sb,
 
 // Main function
 int main(int argc, char *argv[]) {
-    open_dyn_libs("./"); // Open dynamic libraries in the current directory
+    debug = getenv("LAB1DEBUG") != NULL;
+    // A client only passes its arguments to the server, it loads no plugins
+    const char *sock = connect_arg(argc, argv);
+    if (sock)
+        return serve_connect(sock, argc, argv);
+
+    // Open dynamic libraries in the current directory unless -P names another one
+    if (!plugin_dir_arg(argc, argv))
+        open_dyn_libs("./");
     optparse(argc, argv); // Parse command line options
 
+    // The server runs the queries of its clients instead of one of its own
+    if (serve_path) {
+        int res = serve_run();
+        close_plugins();
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    return run_search(argc, argv);
+}
+
+// Function to run the search given by the parsed options
+static int run_search(int argc, char *argv[]) {
+    // Merging shard results reads files instead of walking a directory
+    if (merge_mode != MERGE_NONE) {
+        int res = merge_run(argc - optind, argv + optind);
+        close_plugins();
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Index maintenance commands do not need plugin options
+    if (index_cmd != INDEX_NONE) {
+        int res = index_run(argv[argc-1]);
+        close_plugins();
+        return res < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     // Check if any options were found. If not, print a message and exit
     if (got_opts == 0) {
         printf("No options found. Use -h for help\n");
 
         // Free allocated memory and close open libraries
-        if (plugins) {
-            for (int i = 0; i < plug_cnt; i++) {
-                if (plugins[i].in_opts) free(plugins[i].in_opts);
-                dlclose(plugins[i].lib);
-            }
-            free(plugins);
-        }
+        close_plugins();
         exit(EXIT_FAILURE);
     }
 
     // Traverse the directory specified in the last command line argument
+    index_open();
+    out_init();
+    struct timespec w0, w1;
+    clock_gettime(CLOCK_MONOTONIC, &w0);
+    if (watch_mode) watch_init(argv[argc-1]);
     walk_dir(argv[argc-1]);
+    out_flush();
+    if (watch_mode) watch_run(argv[argc-1]);
+    clock_gettime(CLOCK_MONOTONIC, &w1);
+    index_close();
+    stats_report(ts_diff(w0, w1));
 
     // Free allocated memory and close open libraries
+    close_plugins();
+
+    return EXIT_SUCCESS; // Return success exit code
+}
+
+// Function to free plugin options and queries and close the libraries
+void close_plugins(void) {
     if (plugins) {
         for (int i = 0; i < plug_cnt; i++) {
+            if (plugins[i].query) plugins[i].pfq(plugins[i].query);
             if (plugins[i].in_opts) free(plugins[i].in_opts);
-            dlclose(plugins[i].lib);
+            if (plugins[i].cached) manifest_free_info(&plugins[i].pi);
+            free(plugins[i].name);
+            free(plugins[i].path);
+            if (plugins[i].lib) dlclose(plugins[i].lib);
         }
         free(plugins);
-    }   
-
-    return EXIT_SUCCESS; // Return success exit code
+    }
+    plugins = NULL;
+    plug_cnt = plug_cap = 0;
+    found_opts = 0;
 }
 
 // Function to open dynamic libraries
 void open_dyn_libs(const char *dir){
-    int res = nftw(dir, open_func, 10, FTW_PHYS); // Open plugins
+    // A valid manifest gives the option tables without opening any library
+    if (manifest_load(dir) == 0) {
+        if(debug) fprintf(stderr, "Plugins of %s are taken from the manifest\n", dir);
+        return;
+    }
+    manifest_dirs_free();
+    man_root = dir;
+    int res = nftw(dir, open_func, 10, FTW_PHYS | FTW_ACTIONRETVAL); // Open plugins
     if (res < 0) {
         fprintf(stderr, "ntfw() failed: %s\n", strerror(errno));
+        return;
     }
+    manifest_save(dir);
+    manifest_dirs_free();
 }
 
+// Function to open the libraries of the plugins that got options
+void load_plugins(void) {
+    for (int i = 0; i < plug_cnt; i++) {
+        // The server opens every library once, its queries may use any of them
+        if (plugins[i].lib || (plugins[i].in_opts_len == 0 && !serve_path)) continue;
+        void *library = dlopen(plugins[i].path, RTLD_LAZY);
+        if (!library) {
+            fprintf(stderr, "dlopen() failed for %s: %s\n", plugins[i].path, dlerror());
+            close_plugins();
+            exit(EXIT_FAILURE);
+        }
+        // plugin_get_info() is still the first call a plugin gets
+        struct plugin_info pi = {0};
+        pgi_func_t pgi = (pgi_func_t)dlsym(library, "plugin_get_info");
+        if (!pgi || pgi(&pi) == -1 || plugin_bind(&plugins[i], library) < 0) {
+            fprintf(stderr, "Error in plugin_get_info\n");
+            dlclose(library);
+            close_plugins();
+            exit(EXIT_FAILURE);
+        }
+    }
+}
 
-// Function for parsing command line options
-void optparse(int argc, char *argv[]){
+// Function to find the plugin directory and --plugins-flat before options are parsed
+static const char *plugin_dir_arg(int argc, char *argv[]) {
+    const char *dir = NULL;
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        const char *a = argv[i];
+        if (!strcmp(a, "--plugins-flat")) {
+            plugins_flat = 1;
+        } else if (a[0] == '-' && a[1] != '-') {
+            // Short options may be grouped, -j and -P take the rest or the next argument
+            for (const char *c = a + 1; *c; c++) {
+                if (*c != 'P' && *c != 'j') continue;
+                const char *val = c[1] ? c + 1 : (i + 1 < argc ? argv[++i] : NULL);
+                if (*c == 'P' && !dir) dir = val;
+                break;
+            }
+        }
+    }
+    return dir;
+}
+
+/*
+    Plugin manifest.
+
+    Looking for plugins means walking the plugin directory and opening every
+    library in it, which is most of the run time of a short search. The list
+    of plugins and their option tables is kept in a manifest in the user's
+    cache directory, one per plugin directory. It is trusted while the
+    libraries and the walked directories keep their size and times, so a new,
+    removed or rebuilt plugin makes it stale. With a valid manifest only the
+    libraries whose options are given are opened, after the options are
+    parsed. Option flag pointers cannot be cached, plugins get their options
+    as if the flag were NULL, which is what getopt_long() users here expect.
+*/
+#define MANIFEST_MAGIC "L1SDSMAN 1"
+struct manifest_dir {
+    char *rel;                  // Path relative to the plugin directory
+    struct timespec mtime;
+};
+
+// Function to remember a directory seen while looking for plugins
+static void manifest_add_dir(const char *path, const struct stat *sb, int level) {
+    // nftw() may drop a trailing slash of the root, paths below it keep the prefix
+    size_t skip = level == 0 ? strlen(path) : strlen(man_root);
+    if (level > 0 && strncmp(path, man_root, skip) != 0) return;
+    if (man_dirs_cnt == man_dirs_cap) {
+        size_t cap = man_dirs_cap ? man_dirs_cap * 2 : 16;
+        struct manifest_dir *tmp = realloc(man_dirs, cap * sizeof(struct manifest_dir));
+        if (!tmp) return;
+        man_dirs = tmp;
+        man_dirs_cap = cap;
+    }
+    man_dirs[man_dirs_cnt].rel = strdup(path + skip);
+    man_dirs[man_dirs_cnt].mtime = sb->st_mtim;
+    man_dirs_cnt++;
+}
+
+// Function to forget the directories of the last walk
+static void manifest_dirs_free(void) {
+    for (size_t i = 0; i < man_dirs_cnt; i++) free(man_dirs[i].rel);
+    free(man_dirs);
+    man_dirs = NULL;
+    man_dirs_cnt = man_dirs_cap = 0;
+}
+
+// Function to free plugin information read from the manifest
+static void manifest_free_info(struct plugin_info *pi) {
+    free((char *)pi->plugin_purpose);
+    free((char *)pi->plugin_author);
+    for (size_t j = 0; j < pi->sup_opts_len; j++) {
+        free((char *)pi->sup_opts[j].opt.name);
+        free((char *)pi->sup_opts[j].opt_descr);
+    }
+    free(pi->sup_opts);
+}
+
+// Function to get the manifest file of a plugin directory, NULL if there is no cache directory
+static char *manifest_path(const char *dir, char real[PATH_MAX]) {
+    if (!realpath(dir, real)) return NULL;
+
+    char base[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) snprintf(base, sizeof(base), "%s/lab1sdsN3245", xdg);
+    else if (home && *home) snprintf(base, sizeof(base), "%s/.cache/lab1sdsN3245", home);
+    else return NULL;
+
+    // FNV-1a of the directory names the file, the directory itself is stored inside
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *c = real; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    h = (h ^ (unsigned)plugins_flat) * 1099511628211ULL;
+
+    size_t len = strlen(base) + 32;
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s/%016llx", base, (unsigned long long)h);
+    return path;
+}
+
+// Function to write a string of the manifest
+static void manifest_put_str(FILE *f, const char *s) {
+    if (!s) s = "";
+    fprintf(f, " %zu:%s", strlen(s), s);
+}
+
+// Function to read a string of the manifest
+static char *manifest_get_str(FILE *f) {
+    size_t len;
+    if (fscanf(f, " %zu:", &len) != 1 || len > PATH_MAX) return NULL;
+    char *s = malloc(len + 1);
+    if (!s) return NULL;
+    if (fread(s, 1, len, f) != len) {
+        free(s);
+        return NULL;
+    }
+    s[len] = '\0';
+    return s;
+}
+
+// Function to join the plugin directory and a path relative to it
+static char *manifest_join(const char *dir, const char *rel) {
+    size_t len = strlen(dir) + strlen(rel) + 1;
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s%s", dir, rel);
+    return path;
+}
+
+// Function to take the plugins from the manifest, returns -1 if it is missing or stale
+static int manifest_load(const char *dir) {
+    char real[PATH_MAX];
+    char *mpath = manifest_path(dir, real);
+    if (!mpath) return -1;
+    FILE *f = fopen(mpath, "r");
+    free(mpath);
+    if (!f) return -1;
+
+    char magic[16] = {0};
+    int flat = -1, ok = fgets(magic, sizeof(magic), f) && !strcmp(magic, MANIFEST_MAGIC "\n");
+    char *root = ok && fscanf(f, " R %d", &flat) == 1 ? manifest_get_str(f) : NULL;
+    ok = root && flat == plugins_flat && !strcmp(root, real);
+    free(root);
+
+    char tag;
+    while (ok && fscanf(f, " %c", &tag) == 1 && tag != 'E') {
+        long long sec, csec, size;
+        long nsec, cnsec;
+        size_t n_opts;
+        struct stat sb;
+        char *rel, *path;
+        if (tag == 'D') {
+            // A directory with a new mtime may have new plugins in it
+            ok = fscanf(f, " %lld %ld", &sec, &nsec) == 2 && (rel = manifest_get_str(f)) != NULL;
+            if (!ok) break;
+            path = manifest_join(dir, rel);
+            ok = path && stat(path, &sb) == 0 && sb.st_mtim.tv_sec == sec && sb.st_mtim.tv_nsec == nsec;
+            free(path);
+            free(rel);
+        } else if (tag == 'P') {
+            ok = fscanf(f, " %lld %lld %ld %lld %ld %zu", &size, &sec, &nsec, &csec, &cnsec, &n_opts) == 6 &&
+                 n_opts < 4096 && (rel = manifest_get_str(f)) != NULL;
+            if (!ok) break;
+            path = manifest_join(dir, rel);
+            free(rel);
+            ok = path && stat(path, &sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size == size &&
+                 sb.st_mtim.tv_sec == sec && sb.st_mtim.tv_nsec == nsec &&
+                 sb.st_ctim.tv_sec == csec && sb.st_ctim.tv_nsec == cnsec;
+            dynamic_lib *d = ok ? plugin_add(path, &sb) : NULL;
+            free(path);
+            if (!d) {
+                ok = 0;
+                break;
+            }
+            d->cached = 1;
+            d->pi.plugin_purpose = manifest_get_str(f);
+            d->pi.plugin_author = manifest_get_str(f);
+            d->pi.sup_opts = calloc(n_opts ? n_opts : 1, sizeof(struct plugin_option));
+            ok = d->pi.plugin_purpose && d->pi.plugin_author && d->pi.sup_opts;
+            for (size_t j = 0; ok && j < n_opts; j++) {
+                struct plugin_option *o = &d->pi.sup_opts[j];
+                ok = fscanf(f, " O %d %d", &o->opt.has_arg, &o->opt.val) == 2 &&
+                     (o->opt.name = manifest_get_str(f)) != NULL &&
+                     (o->opt_descr = manifest_get_str(f)) != NULL;
+                d->pi.sup_opts_len = j + 1;
+            }
+            found_opts += d->pi.sup_opts_len;
+        } else {
+            ok = 0;
+        }
+    }
+    if (ok && tag != 'E') ok = 0;
+    fclose(f);
+    if (!ok) close_plugins();
+    return ok ? 0 : -1;
+}
+
+// Function to write the manifest of the plugins found by the walk
+static void manifest_save(const char *dir) {
+    char real[PATH_MAX];
+    char *mpath = manifest_path(dir, real);
+    if (!mpath) return;
+    // Paths are stored relative to the plugin directory
+    for (int i = 0; i < plug_cnt; i++) {
+        if (strncmp(plugins[i].path, dir, strlen(dir)) != 0) {
+            free(mpath);
+            return;
+        }
+    }
+
+    // The cache directory is created on first use
+    char *slash = strrchr(mpath, '/');
+    *slash = '\0';
+    char *parent = strrchr(mpath, '/');
+    *parent = '\0';
+    mkdir(mpath, 0755);
+    *parent = '/';
+    mkdir(mpath, 0755);
+    *slash = '/';
+
+    size_t tlen = strlen(mpath) + 5;
+    char *tmp = malloc(tlen);
+    FILE *f = tmp ? (snprintf(tmp, tlen, "%s.tmp", mpath), fopen(tmp, "w")) : NULL;
+    if (!f) {
+        // Without a manifest the next run walks the directory again, nothing else breaks
+        if(debug) fprintf(stderr, "Cannot write plugin manifest %s\n", mpath);
+        free(tmp);
+        free(mpath);
+        return;
+    }
+
+    size_t root_len = strlen(dir);
+    fprintf(f, "%s\nR %d", MANIFEST_MAGIC, plugins_flat);
+    manifest_put_str(f, real);
+    fprintf(f, "\n");
+    for (size_t i = 0; i < man_dirs_cnt; i++) {
+        fprintf(f, "D %lld %ld", (long long)man_dirs[i].mtime.tv_sec, man_dirs[i].mtime.tv_nsec);
+        manifest_put_str(f, man_dirs[i].rel);
+        fprintf(f, "\n");
+    }
+    for (int i = 0; i < plug_cnt; i++) {
+        const dynamic_lib *d = &plugins[i];
+        fprintf(f, "P %lld %lld %ld %lld %ld %zu", (long long)d->size,
+                (long long)d->mtime.tv_sec, d->mtime.tv_nsec,
+                (long long)d->ctime.tv_sec, d->ctime.tv_nsec, d->pi.sup_opts_len);
+        manifest_put_str(f, d->path + root_len);
+        manifest_put_str(f, d->pi.plugin_purpose);
+        manifest_put_str(f, d->pi.plugin_author);
+        fprintf(f, "\n");
+        for (size_t j = 0; j < d->pi.sup_opts_len; j++) {
+            fprintf(f, "O %d %d", d->pi.sup_opts[j].opt.has_arg, d->pi.sup_opts[j].opt.val);
+            manifest_put_str(f, d->pi.sup_opts[j].opt.name);
+            manifest_put_str(f, d->pi.sup_opts[j].opt_descr);
+            fprintf(f, "\n");
+        }
+    }
+    fprintf(f, "E\n");
+    if (fclose(f) != 0 || rename(tmp, mpath) < 0) unlink(tmp);
+    free(tmp);
+    free(mpath);
+}
+
+// Function to build the list of long options of the plugins and the program
+static struct option *build_long_options(void) {
     // Allocate memory for option structures
-    struct option *long_options = calloc(found_opts+1, sizeof(struct option));
+    struct option *long_options = calloc(found_opts + HOST_OPTS_LEN + 1, sizeof(struct option));
     int copied = 0;
-    
+
     // Copy options from all plugins into a common options list
     for(int i = 0; i < plug_cnt; i++) {
         for(size_t j = 0; j < plugins[i].pi.sup_opts_len; j++){
@@ -163,12 +816,20 @@ void optparse(int argc, char *argv[]){
             copied++;
         }
     }
+    for(size_t j = 0; j < HOST_OPTS_LEN; j++)
+        long_options[copied++] = host_options[j];
+    return long_options;
+}
+
+// Function for parsing command line options
+void optparse(int argc, char *argv[]){
+    struct option *long_options = build_long_options();
     
     int option_index = 0;
     int choice;
     
     // Parse options
-    while ((choice = getopt_long(argc, argv, "vhP:OAN", long_options, &option_index)) != -1) {
+    while ((choice = getopt_long(argc, argv, "vhP:OANj:", long_options, &option_index)) != -1) {
         switch (choice) {
             case 0:
                 // Process user-set options
@@ -176,7 +837,10 @@ void optparse(int argc, char *argv[]){
                     for(size_t j = 0; j < plugins[i].pi.sup_opts_len; j++){
                         if(strcmp(long_options[option_index].name, plugins[i].pi.sup_opts[j].opt.name) == 0){
                             // Expand options array to store the option
-                            plugins[i].in_opts =  realloc(plugins[i].in_opts, (plugins[i].in_opts_len+1) * sizeof(struct option));
+                            if (plugins[i].in_opts_len == plugins[i].in_opts_cap) {
+                                plugins[i].in_opts_cap = plugins[i].in_opts_cap ? plugins[i].in_opts_cap * 2 : 4;
+                                plugins[i].in_opts = realloc(plugins[i].in_opts, plugins[i].in_opts_cap * sizeof(struct option));
+                            }
                             plugins[i].in_opts[plugins[i].in_opts_len] = long_options[option_index];
                             
                             // Set flag if the option has an argument
@@ -194,6 +858,25 @@ void optparse(int argc, char *argv[]){
                 printf("Usage: %s <options> <dir>\n", argv[0]);
                 printf("<dir> - directory to search\n");
                 printf("Available options: -P <dir> to change plugin, -h for help, -A for 'and', -O for 'or', -N for 'not'\n");
+                printf("-j <n> to walk with n threads (found files are printed in unspecified order)\n");
+                printf("--walker <nftw|getdents> to read directories with nftw() or with getdents64(), opening entries relative to their directory (serial walk only)\n");
+                printf("--io <uring|pool|sync> to read files ahead of the plugins, --io-depth <n> files in flight (serial walk only)\n");
+                printf("--mem-limit <size>[K|M|G] to bound the read buffers of all threads, readers wait for a free buffer\n");
+                printf("--batch <n> to pass files to plugins in batches of n (serial walk only, replaces --io)\n");
+                printf("--schedule <walk|inode|extent> to read the files of a window in inode order or in the order of their first extent on disk, found files are still printed in walk order; --window <n> files (default 256) are buffered and replace --batch (serial walk only)\n");
+                printf("--dedupe <inode|content> to check every hard-linked inode, or every distinct content (size and sampled hash, confirmed by a hash of the whole file), once and reuse the plugin verdicts for each path of it; content assumes the plugins look only at the contents\n");
+                printf("--decompress to pass the contents of gzip and zstd files decompressed to plugins with the stream functions, in chunks decoded by another thread\n");
+                printf("--format <tree|nul|jsonl> to print found files as an indented tree, NUL-terminated paths or JSON lines\n");
+                printf("--first <n> to stop after n found files, each one is written out as soon as it is found\n");
+                printf("--plugins-flat to look for plugins only in the plugin directory itself, not in its subdirectories\n");
+                printf("--shard <i/N> to walk only shard i (0 <= i < N) of the tree, subtrees at --shard-depth <n> (default 1) are dealt out by name\n");
+                printf("--watch to keep checking created and changed files after the walk until interrupted, --watch-queue <n> changes (default 4096) before a full rescan\n");
+                printf("--merge <files> to print the found files of all shards sorted by path, --merge-stats <files> to sum their --stats=json reports\n");
+                printf("--serve <socket> to keep the plugins and the --index loaded and run the queries of clients, --serve-max <n> of them at once (default: one per CPU)\n");
+                printf("--connect <socket> to run the query on a --serve server, the results are written here\n");
+                printf("--stats[=table|json] to print counters of the walk, reads and plugins to stderr at exit\n");
+                printf("--index <file> to answer plugins from a content index, --index-build/--index-update/--index-verify <file> <dir> to maintain it\n");
+                printf("--prune to skip directories whose --index summary rules out every file below them (a subtree with a change the index does not describe yet is walked as usual, checking that costs one fstatat() per entry; does nothing with -N or --decompress, as summaries hold the compressed bytes of .gz and .zst files)\n");
                 
                 // Display plugin information
                 for(int i = 0; i < plug_cnt; i++){
@@ -204,13 +887,7 @@ void optparse(int argc, char *argv[]){
                 }
                 
                 // Free memory and exit
-                if(plugins){
-                    for(int i = 0; i < plug_cnt; i++) {
-                        if(plugins[i].in_opts) free(plugins[i].in_opts);
-                        dlclose(plugins[i].lib);
-                    }
-                    free(plugins);
-                }   
+                close_plugins();
                 free(long_options);
                 exit(EXIT_SUCCESS);
             case 'v':
@@ -218,13 +895,7 @@ void optparse(int argc, char *argv[]){
                 printf("Shurygin Danil N3245 Version 1.0\n");
                 
                 // Free memory and exit
-                if(plugins){
-                    for(int i = 0; i < plug_cnt; i++) {
-                        if(plugins[i].in_opts) free(plugins[i].in_opts);
-                        dlclose(plugins[i].lib);
-                    }
-                    free(plugins);
-                }   
+                close_plugins();
                 free(long_options);
                 exit(EXIT_SUCCESS);
             case 'P':
@@ -237,26 +908,14 @@ void optparse(int argc, char *argv[]){
                 }
                 
                 // Close current libraries and free memory
-                for(int i = 0; i < plug_cnt; i++) {
-                    dlclose(plugins[i].lib);
-                }
-                free(plugins);
-                plugins = NULL;
-                plug_cnt = 0;
+                close_plugins();
                 found_opts = 0;
                 
                 // Output debug information and open new plugins
-                if(getenv("LAB1DEBUG") != NULL) fprintf(stderr, "New lib path: %s\n", optarg);
+                if(debug) fprintf(stderr, "New lib path: %s\n", optarg);
                 free(long_options);
                 open_dyn_libs(optarg);
-                long_options = calloc(found_opts+1, sizeof(struct option));
-                copied = 0;
-                for(int i = 0; i < plug_cnt; i++) {
-                    for(size_t j = 0; j < plugins[i].pi.sup_opts_len; j++){
-                        long_options[copied] = plugins[i].pi.sup_opts[j].opt;
-                        copied++;
-                    }
-                }
+                long_options = build_long_options();
                 break;
             case 'O':
                 or = 1;
@@ -267,69 +926,4322 @@ void optparse(int argc, char *argv[]){
             case 'N':
                 not = 1;
                 break;
+            case 'j':
+                n_jobs = atoi(optarg);
+                if(n_jobs < 1){
+                    fprintf(stderr, "-j expects a positive number of threads\n");
+                    n_jobs = 1;
+                }
+                break;
+            case OPT_IO:
+                if (!strcmp(optarg, "uring")) io_engine = IO_URING;
+                else if (!strcmp(optarg, "pool")) io_engine = IO_POOL;
+                else if (!strcmp(optarg, "sync")) io_engine = IO_SYNC;
+                else fprintf(stderr, "--io expects uring, pool or sync\n");
+                break;
+            case OPT_WALKER:
+                if (!strcmp(optarg, "nftw")) walker = WALKER_NFTW;
+                else if (!strcmp(optarg, "getdents")) walker = WALKER_GETDENTS;
+                else fprintf(stderr, "--walker expects nftw or getdents\n");
+                break;
+            case OPT_IO_DEPTH:
+                io_depth = atoi(optarg);
+                if(io_depth < 1){
+                    fprintf(stderr, "--io-depth expects a positive number\n");
+                    io_depth = 32;
+                }
+                break;
+            case OPT_INDEX:
+                index_path = optarg;
+                break;
+            case OPT_PRUNE:
+                prune = 1;
+                break;
+            case OPT_INDEX_BUILD:
+            case OPT_INDEX_UPDATE:
+            case OPT_INDEX_VERIFY:
+                index_path = optarg;
+                index_cmd = choice == OPT_INDEX_BUILD ? INDEX_BUILD :
+                            (choice == OPT_INDEX_UPDATE ? INDEX_UPDATE : INDEX_VERIFY);
+                break;
+            case OPT_STATS:
+                if (!optarg || !strcmp(optarg, "table")) stats_format = STATS_TABLE;
+                else if (!strcmp(optarg, "json")) stats_format = STATS_JSON;
+                else fprintf(stderr, "--stats expects table or json\n");
+                break;
+            case OPT_FORMAT:
+                if (!strcmp(optarg, "tree")) out_format = FORMAT_TREE;
+                else if (!strcmp(optarg, "nul")) out_format = FORMAT_NUL;
+                else if (!strcmp(optarg, "jsonl")) out_format = FORMAT_JSONL;
+                else fprintf(stderr, "--format expects tree, nul or jsonl\n");
+                break;
+            case OPT_FIRST:
+                first_n = atol(optarg);
+                if (first_n < 0) {
+                    fprintf(stderr, "--first expects a positive number\n");
+                    first_n = 0;
+                }
+                break;
+            case OPT_PLUGINS_FLAT:
+                // Already applied by plugin_dir_arg() before the plugins were opened
+                break;
+            case OPT_SHARD:
+                if (sscanf(optarg, "%d/%d", &shard_i, &shard_n) != 2 || shard_n < 1 ||
+                    shard_i < 0 || shard_i >= shard_n) {
+                    fprintf(stderr, "--shard expects i/N with 0 <= i < N\n");
+                    close_plugins();
+                    free(long_options);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OPT_SHARD_DEPTH:
+                shard_depth = atoi(optarg);
+                if (shard_depth < 1) {
+                    fprintf(stderr, "--shard-depth expects a positive number\n");
+                    shard_depth = 1;
+                }
+                break;
+            case OPT_WATCH:
+                watch_mode = 1;
+                break;
+            case OPT_MEM_LIMIT: {
+                // strtoull() would take a sign and wrap it, so the size must start with a digit
+                char *end;
+                errno = 0;
+                unsigned long long v = strtoull(optarg, &end, 10);
+                int shift = *end == 'K' ? 10 : (*end == 'M' ? 20 : (*end == 'G' ? 30 : 0));
+                if (optarg[0] < '0' || optarg[0] > '9' || errno == ERANGE ||
+                    (shift ? end[1] : *end) != '\0' || v > (SIZE_MAX >> shift)) {
+                    fprintf(stderr, "--mem-limit expects a size like 64M\n");
+                    break;
+                }
+                mem_limit = (size_t)(v << shift);
+                break;
+            }
+            case OPT_SERVE:
+                serve_path = optarg;
+                break;
+            case OPT_SERVE_MAX:
+                serve_max = atoi(optarg);
+                if (serve_max < 1) {
+                    fprintf(stderr, "--serve-max expects a positive number\n");
+                    serve_max = 0;
+                }
+                break;
+            case OPT_CONNECT:
+                // Handled by main() before the plugins are opened
+                break;
+            case OPT_WATCH_QUEUE:
+                watch_queue = atoi(optarg);
+                if (watch_queue < 1) {
+                    fprintf(stderr, "--watch-queue expects a positive number\n");
+                    watch_queue = 4096;
+                }
+                break;
+            case OPT_MERGE:
+                merge_mode = MERGE_OUTPUT;
+                break;
+            case OPT_MERGE_STATS:
+                merge_mode = MERGE_STATS;
+                break;
+            case OPT_BATCH:
+                batch_size = atoi(optarg);
+                if(batch_size < 1){
+                    fprintf(stderr, "--batch expects a positive number\n");
+                    batch_size = 1;
+                }
+                break;
+            case OPT_SCHEDULE:
+                if (!strcmp(optarg, "walk")) schedule = SCHED_WALK;
+                else if (!strcmp(optarg, "inode")) schedule = SCHED_INODE;
+                else if (!strcmp(optarg, "extent")) schedule = SCHED_EXTENT;
+                else {
+                    fprintf(stderr, "Unknown --schedule order %s, using walk\n", optarg);
+                    schedule = SCHED_WALK;
+                }
+                break;
+            case OPT_DECOMPRESS:
+                decompress = 1;
+                break;
+            case OPT_DEDUPE:
+                if (!strcmp(optarg, "inode")) dedupe = DEDUPE_INODE;
+                else if (!strcmp(optarg, "content")) dedupe = DEDUPE_CONTENT;
+                else {
+                    fprintf(stderr, "Unknown --dedupe key %s, files are not deduplicated\n", optarg);
+                    dedupe = DEDUPE_NONE;
+                }
+                break;
+            case OPT_WINDOW:
+                sched_window = atoi(optarg);
+                if (sched_window < 1) {
+                    fprintf(stderr, "--window expects a positive number\n");
+                    sched_window = 256;
+                }
+                break;
             case '?':
                 break;
         }
     }
     free(long_options);
+    // A changed file keeps its inode, its old verdict would be reused
+    if (dedupe != DEDUPE_NONE && watch_mode) {
+        fprintf(stderr, "--dedupe does nothing with --watch, changed files are checked again\n");
+        dedupe = DEDUPE_NONE;
+    }
+    load_plugins();
+    compile_queries();
+}
+
+// Function to let plugins compile their options once before the walk
+void compile_queries(void) {
+    for (int i = 0; i < plug_cnt; i++) {
+        if (plugins[i].in_opts_len == 0 || !plugins[i].pco)
+            continue;
+        if (plugins[i].pco(plugins[i].in_opts, plugins[i].in_opts_len, &plugins[i].query) < 0) {
+            fprintf(stderr, "Error in plugin_compile: %s\n", strerror(errno));
+            plugins[i].query = NULL;
+            close_plugins();
+            exit(EXIT_FAILURE);
+        }
+
+        // Metadata predicates start out letting every file through
+        if (plugins[i].pmf) {
+            struct plugin_meta_filter *m = &plugins[i].meta;
+            m->min_size = m->max_size = m->min_mtime = m->max_mtime = -1;
+            m->uid = m->gid = -1;
+            m->mode_mask = m->mode_value = 0;
+            m->ext = NULL;
+            plugins[i].has_meta = plugins[i].pmf(plugins[i].query, m) == 0;
+            meta_in_use |= plugins[i].has_meta;
+        }
+    }
+}
+
+/*
+    Buffer pool (--mem-limit) and scratch arenas.
+
+    Files read by the program (views and read-ahead slots) and the scratch
+    memory of plugins live in page-aligned buffers of 64K, 128K or 256K
+    that are kept for reuse, so a long walk does not go back to malloc()
+    for every file and its memory stays at what the busiest moment needed.
+    With --mem-limit the pool holds at most that many bytes. A thread that
+    holds no buffer waits for one; a thread that already holds some gets
+    NULL instead, because waiting could deadlock, and reads the file some
+    other way: the read-ahead window checks its oldest files first, views
+    leave the reading to the plugins. A limit smaller than one buffer still
+    lets one buffer out at a time.
+
+    The scratch arena of a thread is a list of pool buffers that plugins
+    allocate from with plugin_host.scratch_alloc(); it is given back after
+    every file.
+*/
+#define POOL_MIN_SIZE (64 * 1024)
+#define POOL_CLASSES 3          // 64K, 128K and 256K buffers are kept for reuse
+
+struct pool_buf {
+    struct pool_buf *next;
+};
+
+static struct pool_buf *pool_free[POOL_CLASSES];
+static size_t pool_bytes = 0;       // Allocated bytes, in use and free
+static size_t pool_used = 0;        // Bytes in use
+static size_t pool_peak = 0;        // Most bytes allocated at once
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static __thread int tl_pool_held = 0;   // Buffers the thread holds
+
+// Function to get the size class of a buffer, POOL_CLASSES if it is not kept
+static int pool_class(size_t size) {
+    int c = 0;
+    while (c < POOL_CLASSES && ((size_t)POOL_MIN_SIZE << c) < size) c++;
+    return c;
+}
+
+static size_t pool_class_size(int c, size_t size) {
+    return c < POOL_CLASSES ? (size_t)POOL_MIN_SIZE << c : (size + 4095) & ~(size_t)4095;
+}
+
+// Function to give a free buffer of another class back to the system, pool_lock is held
+static int pool_trim(int keep) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (c == keep || !pool_free[c]) continue;
+        struct pool_buf *b = pool_free[c];
+        pool_free[c] = b->next;
+        free(b);
+        pool_bytes -= pool_class_size(c, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// Function to get a buffer of at least size bytes, NULL if the limit does not allow it
+static void *pool_get(size_t size) {
+    int c = pool_class(size);
+    size_t bytes = pool_class_size(c, size);
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        if (c < POOL_CLASSES && pool_free[c]) {
+            buf = pool_free[c];
+            pool_free[c] = pool_free[c]->next;
+            break;
+        }
+        if (!mem_limit || pool_bytes + bytes <= mem_limit || pool_used == 0) {
+            if (mem_limit && pool_bytes + bytes > mem_limit && pool_trim(c)) continue;
+            if (posix_memalign(&buf, 4096, bytes) != 0) buf = NULL;
+            if (buf) pool_bytes += bytes;
+            if (pool_bytes > pool_peak) pool_peak = pool_bytes;
+            break;
+        }
+        if (pool_trim(c)) continue;
+        if (tl_pool_held > 0) break;        // Waiting while holding buffers could deadlock
+        stats_get()->pool_waits++;
+        pthread_cond_wait(&pool_cond, &pool_lock);
+    }
+    if (buf) {
+        pool_used += bytes;
+        tl_pool_held++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+// Function to give a buffer back to the pool
+static void pool_put(void *buf, size_t size) {
+    if (!buf) return;
+    int c = pool_class(size);
+    size_t bytes = pool_class_size(c, size);
+
+    pthread_mutex_lock(&pool_lock);
+    if (c < POOL_CLASSES) {
+        struct pool_buf *b = buf;
+        b->next = pool_free[c];
+        pool_free[c] = b;
+    } else {
+        free(buf);
+        pool_bytes -= bytes;
+    }
+    pool_used -= bytes;
+    tl_pool_held--;
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Chunk of a scratch arena, the header is at the start of a pool buffer
+struct scratch_chunk {
+    struct scratch_chunk *next;
+    size_t size;                // Size of the buffer
+    size_t used;                // Bytes given out, the header included
+};
+
+static __thread struct scratch_chunk *tl_scratch = NULL;    // Newest chunk first
+
+// Function to allocate scratch memory for a plugin, valid until the file is done
+static void *scratch_alloc(size_t size) {
+    const size_t head = (sizeof(struct scratch_chunk) + 15) & ~(size_t)15;
+    if (size > SIZE_MAX / 2) return NULL;
+    size = (size + 15) & ~(size_t)15;
+
+    struct scratch_chunk *c = tl_scratch;
+    if (!c || c->used + size > c->size) {
+        size_t need = MAX(head + size, (size_t)POOL_MIN_SIZE);
+        c = pool_get(need);
+        if (!c) return NULL;
+        c->size = pool_class_size(pool_class(need), need);
+        c->used = head;
+        c->next = tl_scratch;
+        tl_scratch = c;
+    }
+    void *p = (char *)c + c->used;
+    c->used += size;
+    return p;
+}
+
+// Function to give the scratch memory of the thread back after a file
+static void scratch_reset(void) {
+    while (tl_scratch) {
+        struct scratch_chunk *c = tl_scratch;
+        tl_scratch = c->next;
+        pool_put(c, c->size);
+    }
+}
+
+static int view_read(struct file_view *v, const char *path);
+
+// Function to read or map a file once for all plugins
+static int view_load(struct file_view *v, const char *path) {
+    if (v->state != 0) return v->state;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int res = view_read(v, path);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    struct stats *st = stats_get();
+    st->read_ns += ts_diff(t0, t1);
+    if (res > 0) st->bytes_read += v->len;
+    else if (res < 0) st->read_errors++;
+    return res;
+}
+
+// Function to read or map a file
+static int view_read(struct file_view *v, const char *path) {
+    v->state = -1;
+
+    int fd = v->name ? openat(v->dirfd, v->name, O_RDONLY) : open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    if (sb.st_size <= VIEW_READ_MAX) {
+        // Small files are cheaper to read than to map
+        if (!(v->buf = pool_get(VIEW_READ_MAX))) {
+            close(fd);
+            return 0;       // Out of buffers, the plugins read the file themselves
+        }
+        size_t got = 0;
+        while (got < VIEW_READ_MAX) {
+            ssize_t t = read(fd, v->buf + got, VIEW_READ_MAX - got);
+            if (t < 0 && errno == EINTR) continue;
+            if (t < 0) {
+                close(fd);
+                return -1;
+            }
+            if (t == 0) break;
+            got += (size_t)t;
+        }
+        v->data = v->buf;
+        v->len = got;
+    } else {
+        void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+        v->map = map;
+        v->data = map;
+        v->len = (size_t)sb.st_size;
+    }
+    close(fd);
+    v->state = 1;
+    return 1;
+}
+
+// Function to release the file contents
+static void view_release(struct file_view *v) {
+    if (v->map) munmap(v->map, v->len);
+    pool_put(v->buf, VIEW_READ_MAX);
+    v->map = NULL;
+    v->buf = NULL;
+    v->state = 0;
 }
 
 // Function for printing information about found files
-void print_entry(int level, int type, const char *path) {
+void print_entry(int level, int type, const char *path, const struct stat *sb) {
     // Skip directory entries and non-regular files
     if (!strcmp(path, ".") || !strcmp(path, "..") || type != FTW_F)
         return;
+    print_entry_at(level, AT_FDCWD, NULL, path, sb);
+}
 
-    // Create indentation based on the depth of the file in the directory structure
-    char indent[MAX_INDENT_LEVEL] = {0};
-    memset(indent, ' ', MIN((size_t)level, MAX_INDENT_LEVEL));
+// Function to check a file opened relative to the directory dirfd and print it if it matches
+void print_entry_at(int level, int dirfd, const char *name, const char *path, const struct stat *sb) {
+    struct file_view view;
+    view.state = 0;
+    view.map = NULL;
+    view.buf = NULL;
+    view.dirfd = dirfd;
+    view.name = name;
+    check_entry(level, path, sb, &view);
+    view_release(&view);
+}
 
-    int cnt = 0;
-    int cnt_success = 0;
-    
-    // Iterate over all plugins to process the file with the appropriate options
-    for(int i = 0; i < plug_cnt; i++){
-        // Skip plugins with no options set
-        if(plugins[i].in_opts_len > 0){
-            // Call plugin's processing function with the specified options
-            int tmp = plugins[i].ppf(path, plugins[i].in_opts, plugins[i].in_opts_len);
-            
-            // Handle errors if any
-            if(tmp == -1){
-                fprintf(stderr, "Error in plugin! %s", strerror(errno));
-                // Reset options if an error occurs
-                if(errno == EINVAL || errno == ERANGE) 
-                    plugins[i].in_opts_len = 0;
-            } else if (tmp == 0) 
-                cnt++;
-            cnt_success++;
+/*
+    Counters (--stats).
+
+    Every thread counts into its own struct stats, so updating a counter is
+    a plain increment. The structures are kept in a list and summed once the
+    walk is over. Plugin call times go into a histogram with power-of-two
+    buckets: bucket b counts calls that took [2^b, 2^(b+1)) nanoseconds.
+*/
+
+static __thread struct stats *tl_stats = NULL;
+static struct stats *all_stats = NULL;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to get the time between two points in nanoseconds
+static unsigned long ts_diff(struct timespec t0, struct timespec t1) {
+    return (unsigned long)((t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec));
+}
+
+// Function to get the histogram bucket of a duration
+static int stats_bucket(unsigned long ns) {
+    int b = ns ? 63 - __builtin_clzl(ns) : 0;
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// Function to get the counters of the calling thread
+static struct stats *stats_get(void) {
+    if (!tl_stats) {
+        struct stats *st = calloc(1, sizeof(struct stats));
+        if (st) st->pl = calloc(plug_cnt ? plug_cnt : 1, sizeof(struct plugin_stats));
+        if (!st || !st->pl) {
+            fprintf(stderr, "calloc() failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
         }
+        pthread_mutex_lock(&stats_lock);
+        st->next = all_stats;
+        all_stats = st;
+        pthread_mutex_unlock(&stats_lock);
+        tl_stats = st;
     }
-    
-    // Check if the conditions for 'or' and 'not' are met
-    if((not && or && (cnt == 0)) || (not && !or && (cnt != cnt_success))){
-        // Print the path of the found file with appropriate indentation
-        printf("%sFound file: %s\n", indent, path);
-    } else if((!not && or && (cnt > 0)) || (!not && !or && (cnt == cnt_success))){
-        // Print the path of the found file with appropriate indentation
-        printf("%sFound file: %s\n", indent, path);
+    return tl_stats;
+}
+
+// Function to pass a string to put() as a JSON string literal
+static void json_quote(const char *s, void (*put)(const char *, size_t)) {
+    put("\"", 1);
+    for (const char *p = s; *p; p++) {
+        unsigned char c = *p;
+        char esc[8];
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            put(esc, 2);
+        } else if (c < 0x20) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            put(esc, 6);
+        } else {
+            put(p, 1);
+        }
     }
-    return;
-} 
+    put("\"", 1);
+}
 
-// Function for directory traversal
-int walk_func(const char *fpath,const struct stat *sb, 
-        int typeflag, struct FTW *ftwbuf) {
-    if(!sb) return -1;
-    print_entry(ftwbuf->level, typeflag, fpath); 
-   
-    return 0;
+// Function to write bytes to stderr, for json_quote()
+static void err_put(const char *s, size_t len) {
+    fwrite(s, 1, len, stderr);
 }
 
-// Function to traverse directories
-void walk_dir(const char *dir) {
-    int res = nftw(dir, walk_func, 10, FTW_PHYS);   
-    if (res < 0) {
-        fprintf(stderr, "ntfw() failed: %s\n", strerror(errno));
+// Function to sum the counters of all threads and print them
+static void stats_report(unsigned long wall_ns) {
+    struct stats sum;
+    memset(&sum, 0, sizeof(sum));
+    struct plugin_stats *pl = calloc(plug_cnt ? plug_cnt : 1, sizeof(struct plugin_stats));
+    int threads = 0;
+
+    for (struct stats *st = all_stats, *next; st; st = next) {
+        next = st->next;
+        sum.files += st->files;
+        sum.found += st->found;
+        sum.dirs += st->dirs;
+        sum.pruned += st->pruned;
+        sum.duplicates += st->duplicates;
+        sum.walk_ns += st->walk_ns;
+        sum.read_ns += st->read_ns;
+        sum.bytes_read += st->bytes_read;
+        sum.read_errors += st->read_errors;
+        sum.pool_waits += st->pool_waits;
+        sum.dec_files += st->dec_files;
+        sum.dec_bytes += st->dec_bytes;
+        for (int i = 0; pl && i < plug_cnt; i++) {
+            pl[i].calls += st->pl[i].calls;
+            pl[i].matches += st->pl[i].matches;
+            pl[i].errors += st->pl[i].errors;
+            pl[i].meta_rejects += st->pl[i].meta_rejects;
+            pl[i].ns += st->pl[i].ns;
+            for (int b = 0; b < LAT_BUCKETS; b++) pl[i].hist[b] += st->pl[i].hist[b];
+        }
+        free(st->pl);
+        free(st);
+        threads++;
+    }
+    all_stats = NULL;
+    tl_stats = NULL;
+
+    if (stats_format == STATS_NONE || !pl) {
+        free(pl);
+        return;
+    }
+
+    // The serial walk does not time nftw() itself: it is what is left of the wall time
+    unsigned long plugin_ns = 0;
+    for (int i = 0; i < plug_cnt; i++) plugin_ns += pl[i].ns;
+    if (n_jobs == 1) {
+        unsigned long busy = plugin_ns + sum.read_ns;
+        sum.walk_ns = wall_ns > busy ? wall_ns - busy : 0;
+    }
+
+    if (stats_format == STATS_JSON) {
+        fprintf(stderr, "{\"wall_ns\": %lu, \"threads\": %d, \"walk_ns\": %lu, \"dirs\": %lu, \"pruned\": %lu, "
+                        "\"files\": %lu, \"found\": %lu, \"duplicates\": %lu, \"read_ns\": %lu, \"bytes_read\": %lu, "
+                        "\"read_errors\": %lu, \"pool_peak\": %zu, \"pool_waits\": %lu, "
+                        "\"decompressed_files\": %lu, \"decompressed_bytes\": %lu, \"plugins\": [",
+                wall_ns, threads, sum.walk_ns, sum.dirs, sum.pruned, sum.files, sum.found, sum.duplicates,
+                sum.read_ns, sum.bytes_read, sum.read_errors, pool_peak, sum.pool_waits,
+                sum.dec_files, sum.dec_bytes);
+        for (int i = 0; i < plug_cnt; i++) {
+            fprintf(stderr, "%s{\"purpose\": ", i ? ", " : "");
+            json_quote(plugins[i].pi.plugin_purpose ? plugins[i].pi.plugin_purpose : "", err_put);
+            fprintf(stderr, ", \"calls\": %lu, \"matches\": %lu, \"errors\": %lu, "
+                            "\"meta_rejects\": %lu, \"ns\": %lu, \"latency_log2_ns\": [",
+                    pl[i].calls, pl[i].matches, pl[i].errors, pl[i].meta_rejects, pl[i].ns);
+            for (int b = 0; b < LAT_BUCKETS; b++)
+                fprintf(stderr, "%s%lu", b ? ", " : "", pl[i].hist[b]);
+            fprintf(stderr, "]}");
+        }
+        fprintf(stderr, "]}\n");
+    } else {
+        fprintf(stderr, "%-22s %12.3f ms (%d threads)\n", "Wall time", wall_ns / 1e6, threads);
+        fprintf(stderr, "%-22s %12.3f ms (%lu directories, %lu subtrees pruned)\n", "Traversal",
+                sum.walk_ns / 1e6, sum.dirs, sum.pruned);
+        fprintf(stderr, "%-22s %12.3f ms (%lu bytes, %lu errors)\n", "Open/read by program",
+                sum.read_ns / 1e6, sum.bytes_read, sum.read_errors);
+        fprintf(stderr, "%-22s %12zu bytes (%lu waits)\n", "Buffer pool peak", pool_peak, sum.pool_waits);
+        if (sum.dec_files)
+            fprintf(stderr, "%-22s %12lu bytes (%lu files)\n", "Decompressed", sum.dec_bytes, sum.dec_files);
+        fprintf(stderr, "%-22s %12lu (%lu found, %lu duplicates)\n", "Files checked",
+                sum.files, sum.found, sum.duplicates);
+        for (int i = 0; i < plug_cnt; i++) {
+            if (pl[i].calls == 0 && pl[i].meta_rejects == 0) continue;
+            fprintf(stderr, "Plugin: %s\n", plugins[i].pi.plugin_purpose);
+            fprintf(stderr, "  %-20s %12lu (%lu matches, %lu errors)\n", "Calls",
+                    pl[i].calls, pl[i].matches, pl[i].errors);
+            if (pl[i].meta_rejects)
+                fprintf(stderr, "  %-20s %12lu\n", "Rejected by metadata", pl[i].meta_rejects);
+            fprintf(stderr, "  %-20s %12.3f ms (%.2f us per call)\n", "Time",
+                    pl[i].ns / 1e6, pl[i].calls ? pl[i].ns / 1e3 / pl[i].calls : 0.0);
+            for (int b = 0; b < LAT_BUCKETS; b++) {
+                if (pl[i].hist[b] == 0) continue;
+                fprintf(stderr, "  %9.3f - %9.3f us %12lu\n", (1UL << b) / 1e3, (2UL << b) / 1e3, pl[i].hist[b]);
+            }
+        }
+    }
+    free(pl);
+}
+
+/*
+    Plugin evaluation order.
+
+    Every plugin call is timed and its result counted. Each thread reorders
+    the plugins every REORDER_INTERVAL files by the expected cost of reaching
+    a decision: the mean call time divided by the probability that the plugin
+    decides the expression alone (fails for 'and', matches for 'or'). Cheap
+    and selective plugins run first, and check_entry() stops at the first
+    deciding result, so the set of found files does not depend on the order.
+*/
+
+#define REORDER_INTERVAL 256
+#define MAX_ORDERED_PLUGINS 64      // More plugins are called in load order
+
+static __thread int tl_order[MAX_ORDERED_PLUGINS];
+static __thread int tl_order_len = 0;
+static __thread unsigned tl_checked = 0;
+
+// Function to record the time and results of plugin calls
+static void eval_account_ns(int i, unsigned long calls, unsigned long matches, unsigned long ns) {
+    struct plugin_stats *ps = &stats_get()->pl[i];
+    ps->calls += calls;
+    ps->matches += matches;
+    ps->ns += ns;
+    ps->hist[stats_bucket(ns / calls)] += calls;
+}
+
+static void eval_account(int i, unsigned long calls, unsigned long matches,
+                         struct timespec t0, struct timespec t1) {
+    eval_account_ns(i, calls, matches, ts_diff(t0, t1));
+}
+
+// Function to estimate the cost of reaching a decision with plugin i
+static double eval_rank(int i) {
+    // Each thread ranks by its own measurements, no shared counters on the hot path
+    const struct plugin_stats *ps = &stats_get()->pl[i];
+    // A metadata rejection is a decision that costs nothing
+    unsigned long calls = ps->calls + ps->meta_rejects, ns = ps->ns, matches = ps->matches;
+    if (calls == 0) return 0.0;     // Not measured yet, try it early
+
+    // Laplace smoothing keeps a plugin that never decided from ranking infinite
+    double p_match = (matches + 1.0) / (calls + 2.0);
+    double p_decide = or ? p_match : 1.0 - p_match;
+    return ((double)ns / calls) / p_decide;
+}
+
+// Function to get this thread's plugin order, NULL means load order
+static const int *eval_order(void) {
+    if (plug_cnt > MAX_ORDERED_PLUGINS || plug_cnt < 2) return NULL;
+    if (tl_order_len != plug_cnt || tl_checked++ % REORDER_INTERVAL == 0) {
+        double rank[MAX_ORDERED_PLUGINS];
+        for (int i = 0; i < plug_cnt; i++) rank[i] = eval_rank(i);
+
+        // Insertion sort, there are only a few plugins
+        for (int i = 0; i < plug_cnt; i++) {
+            int j = i;
+            while (j > 0 && rank[tl_order[j - 1]] > rank[i]) {
+                tl_order[j] = tl_order[j - 1];
+                j--;
+            }
+            tl_order[j] = i;
+        }
+        tl_order_len = plug_cnt;
+    }
+    return tl_order;
+}
+
+// Function to write the output buffer of the calling thread to stdout
+void out_flush(void) {
+    size_t done = 0;
+    while (done < tl_out_len) {
+        ssize_t n = write(STDOUT_FILENO, tl_out + done, tl_out_len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;              // Nowhere to write, the results are lost anyway
+        }
+        done += n;
+    }
+    tl_out_len = 0;
+}
+
+// Function to append bytes to the output buffer of the calling thread
+static void out_put(const char *s, size_t len) {
+    while (len > 0) {
+        if (tl_out_len == OUT_BUF_SIZE) out_flush();
+        size_t n = MIN(len, OUT_BUF_SIZE - tl_out_len);
+        memcpy(tl_out + tl_out_len, s, n);
+        tl_out_len += n;
+        s += n;
+        len -= n;
+    }
+}
+
+// Function to append a string as a JSON string literal
+static void out_put_json(const char *s) {
+    json_quote(s, out_put);
+}
+
+/*
+    Plugin reports (plugin_host.report).
+
+    A plugin may describe the file it checks with a one-line JSON object,
+    for example how often the bytes it looks for occur. Reports are kept
+    per file until the file is decided and printed after it: jsonl puts
+    them into the "reports" object under the plugin names, the tree format
+    appends them to the line of the file, -0 has no room for them.
+*/
+
+// Reports about one file: records of a plugin number and a NUL-terminated text
+struct report_buf {
+    char *data;
+    size_t len, cap;
+};
+
+static __thread struct report_buf tl_report;                // Reports of the file check_entry() checks
+static __thread struct report_buf *tl_report_dst = NULL;    // Reports of a per-file call go here
+static __thread struct report_buf **tl_report_files = NULL; // Or by file number in a batch call
+static __thread size_t tl_report_cnt = 0;
+static __thread int tl_report_plugin = -1;                  // Plugin being called
+
+// Function to make room for len more bytes of reports
+static int report_reserve(struct report_buf *b, size_t len) {
+    size_t need = b->len + len;
+    if (need <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < need) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if (!data) return -1;       // The report is lost, the result is not
+    b->data = data;
+    b->cap = cap;
+    return 0;
+}
+
+// Function to keep the report of a plugin about the file it checks
+static void host_report(size_t file, const char *text) {
+    struct report_buf *b = tl_report_dst;
+    if (tl_report_files) b = file < tl_report_cnt ? tl_report_files[file] : NULL;
+    if (!b || !text || tl_report_plugin < 0) return;
+
+    size_t len = strlen(text) + 1;
+    if (report_reserve(b, sizeof(int) + len) < 0) return;
+    memcpy(b->data + b->len, &tl_report_plugin, sizeof(int));
+    memcpy(b->data + b->len + sizeof(int), text, len);
+    b->len += sizeof(int) + len;
+}
+
+// Function to free the report buffer of a thread that is about to exit
+static void report_release(void) {
+    free(tl_report.data);
+    tl_report.data = NULL;
+    tl_report.len = tl_report.cap = 0;
+    stream_release();
+}
+
+// Function to add the reports about a found file to its record
+static void out_put_reports(const struct report_buf *rep) {
+    if (!rep || rep->len == 0 || out_format == FORMAT_NUL) return;
+    if (out_format == FORMAT_JSONL) out_put(", \"reports\": {", 14);
+    for (size_t off = 0; off < rep->len;) {
+        int i;
+        memcpy(&i, rep->data + off, sizeof(int));
+        const char *text = rep->data + off + sizeof(int);
+        size_t len = strlen(text);
+        if (out_format == FORMAT_JSONL) {
+            if (off > 0) out_put(", ", 2);
+            out_put_json(plugins[i].name);
+        } else {
+            out_put("\t", 1);
+            out_put(plugins[i].name, strlen(plugins[i].name));
+        }
+        out_put(": ", 2);
+        out_put(text, len);
+        off += sizeof(int) + len + 1;
+    }
+    if (out_format == FORMAT_JSONL) out_put("}", 1);
+}
+
+// Function to add the names of the matched plugins to a JSON record
+static void out_put_plugins(uint64_t hits) {
+    out_put(", \"plugins\": [", 14);
+    int first = 1;
+    for (int i = 0; i < plug_cnt && i < 64; i++) {
+        if (!(hits >> i & 1)) continue;
+        if (!first) out_put(", ", 2);
+        out_put_json(plugins[i].name);
+        first = 0;
+    }
+    out_put("]", 1);
+}
+
+// Function to print a found file in the selected format
+void emit_found(int level, const char *path, uint64_t hits, const struct report_buf *rep) {
+    // Watch mode keeps the set of found files, changes are printed as events
+    if (watch_mode && watch_found(level, path, hits))
+        return;
+    if (first_n > 0) {
+        long k = __atomic_add_fetch(&out_found, 1, __ATOMIC_SEQ_CST);
+        if (k > first_n) return;
+        if (k == first_n) out_stop = 1;
+    }
+    stats_get()->found++;
+
+    // A record goes out in one write() when several threads share a pipe
+    size_t start = tl_out_len;
+    switch (out_format) {
+        case FORMAT_NUL:
+            out_put(path, strlen(path) + 1);
+            break;
+        case FORMAT_JSONL: {
+            char num[32];
+            out_put("{\"path\": ", 9);
+            out_put_json(path);
+            out_put(", \"depth\": ", 11);
+            out_put(num, snprintf(num, sizeof(num), "%d", level));
+            out_put_plugins(hits);
+            out_put_reports(rep);
+            out_put("}\n", 2);
+            break;
+        }
+        default:
+            // Indentation shows the depth of the file in the directory structure
+            out_put(out_spaces, MIN(level, MAX_INDENT_LEVEL - 1));
+            out_put("Found file: ", 12);
+            out_put(path, strlen(path));
+            out_put_reports(rep);
+            out_put("\n", 1);
+            break;
+    }
+
+    // The pipe limit is checked after the record is complete, a record is
+    // never split unless it is longer than the limit by itself
+    if (first_n > 0 || tl_out_len > out_limit) {
+        if (tl_out_len > out_limit && start > 0) {
+            size_t len = tl_out_len - start;
+            char rec[PIPE_BUF];
+            if (len <= sizeof(rec)) {
+                memcpy(rec, tl_out + start, len);
+                tl_out_len = start;
+                out_flush();
+                memcpy(tl_out, rec, len);
+                tl_out_len = len;
+            }
+        }
+        out_flush();
+    }
+}
+
+// Function to choose how much output a thread may gather before writing it
+static void out_init(void) {
+    // Lines printed with stdio before the walk go first
+    fflush(stdout);
+    struct stat sb;
+    out_limit = OUT_BUF_SIZE;
+    if (n_jobs > 1 && fstat(STDOUT_FILENO, &sb) == 0 && S_ISFIFO(sb.st_mode))
+        out_limit = PIPE_BUF;
+}
+
+// Function to report a plugin error
+static void plugin_error(int i, int err) {
+    stats_get()->pl[i].errors++;
+    fprintf(stderr, "Error in plugin! %s", strerror(err));
+    // Reset options if an error occurs
+    if(err == EINVAL || err == ERANGE) 
+        plugins[i].in_opts_len = 0;
+}
+
+// Function to check a file against the metadata predicates of a plugin
+static int meta_match(const struct plugin_meta_filter *m, const char *path, const struct stat *sb) {
+    if (m->min_size >= 0 && sb->st_size < m->min_size) return 0;
+    if (m->max_size >= 0 && sb->st_size > m->max_size) return 0;
+    if (m->min_mtime >= 0 && sb->st_mtime < m->min_mtime) return 0;
+    if (m->max_mtime >= 0 && sb->st_mtime > m->max_mtime) return 0;
+    if (m->uid >= 0 && (int64_t)sb->st_uid != m->uid) return 0;
+    if (m->gid >= 0 && (int64_t)sb->st_gid != m->gid) return 0;
+    if ((sb->st_mode & m->mode_mask) != m->mode_value) return 0;
+    if (m->ext) {
+        size_t pl = strlen(path), el = strlen(m->ext);
+        if (pl < el || strcmp(path + pl - el, m->ext) != 0) return 0;
+    }
+    return 1;
+}
+
+// Function to check a file against the metadata predicates of plugin i
+static int meta_passes(int i, const char *path, const struct stat *sb) {
+    const struct plugin_meta_filter *m = &plugins[i].meta;
+    if (meta_match(m, path, sb)) return 1;
+
+    // Size bounds describe the contents, for a compressed file those are the decoded ones
+    if (!decompress || !plugins[i].psb || !plugins[i].query) return 0;
+    struct plugin_meta_filter any_size = *m;
+    any_size.min_size = any_size.max_size = -1;
+    return meta_match(&any_size, path, sb) && dec_codec_path(path) != CODEC_NONE;
+}
+
+// Function to check whether plugin i rejects a file by its metadata
+static int meta_rejects(int i, const char *path, const struct stat *sb) {
+    if (!sb || !plugins[i].has_meta || meta_passes(i, path, sb))
+        return 0;
+    stats_get()->pl[i].meta_rejects++;
+    return 1;
+}
+
+// Function to check whether metadata alone decides the expression for a file
+static int meta_decided(const char *path, const struct stat *sb) {
+    if (!meta_in_use || !sb) return 0;
+    int used = 0, rejected = 0;
+    for (int i = 0; i < plug_cnt; i++) {
+        if (plugins[i].in_opts_len == 0) continue;
+        used++;
+        if (plugins[i].has_meta && !meta_passes(i, path, sb)) {
+            if (!or) return 1;  // With 'and' one mismatch is enough
+            rejected++;
+        }
+    }
+    return used > 0 && rejected == used;
+}
+
+/*
+    Duplicate files (--dedupe).
+
+    Every hard link of an inode, and with "content" every copy of the same
+    contents, gets the verdicts of the first path of it that was checked.
+    The first path of an inode creates an entry keyed by st_dev and st_ino.
+    With "content" the file is hashed only when a plugin is about to read
+    it, after the metadata filters and the index failed to decide it. Then
+    the entry looks for a file of the same size whose start, middle and end
+    hash the same, confirms such candidates by a 128-bit hash of both whole
+    files and, if one matches, takes its verdicts from then on. Files a
+    buffer plugin reads are hashed from the view it reads, with the whole
+    contents hashed at once; other files are sampled with pread() and read
+    in full only when a second file with their sample turns up. An entry
+    holds the result and the reports of every plugin that was called for
+    it. Metadata filters are still applied to every path, and plugins that
+    were not called for the first path are called for the alias and fill
+    the entry. Errors are not kept. Content dedupe assumes the plugins look
+    only at the contents, not at the path or the stat data.
+*/
+#define DEDUPE_SAMPLE 4096          // Bytes hashed at the start, middle and end of a file
+#define DEDUPE_CANDIDATES 16        // Most files with an equal sample compared in full
+#define DEDUPE_UNKNOWN INT_MIN      // Plugin not called for the entry yet
+
+// Verdict of one plugin for an entry
+struct dedupe_result {
+    int value;                  // Result of the plugin, DEDUPE_UNKNOWN if not called
+    char *report;               // Its reports in the report_buf format
+    size_t report_len;
+};
+
+// Verdicts of a file, shared by all its aliases
+struct dedupe_entry {
+    char *path;                 // First path, read again to confirm a candidate
+    off_t size;
+    int full_state;             // 1 - full[] is the hash of the contents, -1 - unreadable, 0 - not yet
+    uint64_t full[2];
+    struct dedupe_result *res;  // One per plugin
+    unsigned long batch_call;   // Batch call that checks the entry, the serial walk only
+    int hashed;                 // The contents were looked up (--dedupe content)
+    struct dedupe_entry *same;  // Entry of an earlier file with the same contents, NULL if none
+};
+
+// Chained hash table from a pair of keys to an entry
+struct dedupe_node {
+    struct dedupe_node *next;
+    uint64_t a, b;
+    struct dedupe_entry *e;
+};
+struct dedupe_table {
+    struct dedupe_node **slots;
+    size_t cap, cnt;
+};
+
+static pthread_mutex_t dedupe_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dedupe_table dedupe_inodes;       // st_dev and st_ino
+static struct dedupe_table dedupe_contents;     // Size and hash of the samples
+static __thread struct dedupe_entry *tl_dedupe = NULL;  // Entry of the file being checked
+
+static inline size_t dedupe_slot(const struct dedupe_table *t, uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b * 0x9e3779b97f4a7c15ULL)) * 0xbf58476d1ce4e5b9ULL;
+    return (size_t)(h ^ (h >> 31)) & (t->cap - 1);
+}
+
+// Function to find the first entry of a key, the lock is held
+static struct dedupe_entry *dedupe_lookup(const struct dedupe_table *t, uint64_t a, uint64_t b) {
+    if (t->cap == 0) return NULL;
+    for (struct dedupe_node *n = t->slots[dedupe_slot(t, a, b)]; n; n = n->next)
+        if (n->a == a && n->b == b) return n->e;
+    return NULL;
+}
+
+// Function to add an entry under a key, the lock is held
+static int dedupe_insert(struct dedupe_table *t, uint64_t a, uint64_t b, struct dedupe_entry *e) {
+    if (t->cnt >= t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 1024;
+        struct dedupe_node **slots = calloc(cap, sizeof(struct dedupe_node *));
+        if (!slots) return -1;
+        struct dedupe_table grown = {slots, cap, t->cnt};
+        for (size_t s = 0; s < t->cap; s++) {
+            for (struct dedupe_node *n = t->slots[s], *next; n; n = next) {
+                next = n->next;
+                size_t k = dedupe_slot(&grown, n->a, n->b);
+                n->next = slots[k];
+                slots[k] = n;
+            }
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    struct dedupe_node *n = malloc(sizeof(struct dedupe_node));
+    if (!n) return -1;
+    size_t k = dedupe_slot(t, a, b);
+    n->a = a;
+    n->b = b;
+    n->e = e;
+    n->next = t->slots[k];
+    t->slots[k] = n;
+    t->cnt++;
+    return 0;
+}
+
+// Function to create the entry of a file checked for the first time
+static struct dedupe_entry *dedupe_new(const char *path, off_t size) {
+    struct dedupe_entry *e = calloc(1, sizeof(struct dedupe_entry));
+    if (!e) return NULL;
+    e->path = strdup(path);
+    e->res = calloc(plug_cnt ? plug_cnt : 1, sizeof(struct dedupe_result));
+    if (!e->path || !e->res) {
+        free(e->path);
+        free(e->res);
+        free(e);
+        return NULL;
+    }
+    e->size = size;
+    for (int i = 0; i < plug_cnt; i++) e->res[i].value = DEDUPE_UNKNOWN;
+    return e;
+}
+
+// Function to mix a block into the two lanes of a content hash
+static void dedupe_hash_block(uint64_t h[2], const unsigned char *p, size_t n) {
+    size_t i = 0;
+    uint64_t w;
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, p + i, 8);
+        h[0] = (h[0] ^ w) * 0x9e3779b97f4a7c15ULL;
+        h[0] ^= h[0] >> 32;
+        h[1] = (h[1] + w) * 0xbf58476d1ce4e5b9ULL;
+        h[1] ^= h[1] >> 29;
+    }
+    if (i < n) {
+        w = (uint64_t)(n - i) << 56;
+        memcpy(&w, p + i, n - i);
+        h[0] = (h[0] ^ w) * 0x9e3779b97f4a7c15ULL;
+        h[1] = (h[1] + w) * 0xbf58476d1ce4e5b9ULL;
+    }
+}
+
+// Function to read len bytes at off unless the file ends first
+static ssize_t dedupe_pread(int fd, unsigned char *buf, size_t len, off_t off) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    return (ssize_t)done;
+}
+
+// Function to hash the samples or the whole of a file of the given size,
+// from its contents if they are already in memory
+static int dedupe_hash_file(const char *path, const unsigned char *data, off_t size, int full, uint64_t out[2]) {
+    out[0] = 0x243f6a8885a308d3ULL ^ (uint64_t)size;
+    out[1] = 0x13198a2e03707344ULL;
+    off_t offs[3] = {0, size / 2 - DEDUPE_SAMPLE / 2, size - DEDUPE_SAMPLE};
+    int parts = size <= 3 * DEDUPE_SAMPLE || full ? 1 : 3;
+    if (data) {
+        // Blocks of the reads below are multiples of 8 bytes, so the hash is the same
+        for (int k = 0; k < parts; k++) {
+            off_t off = parts == 1 ? 0 : offs[k];
+            dedupe_hash_block(out, data + off, parts == 1 ? (size_t)size : DEDUPE_SAMPLE);
+        }
+        return 0;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    unsigned char buf[64 * 1024];
+    int ret = 0;
+    unsigned long bytes = 0;
+    for (int k = 0; k < parts && ret == 0; k++) {
+        off_t off = parts == 1 ? 0 : offs[k];
+        off_t end = parts == 1 ? size : off + DEDUPE_SAMPLE;
+        while (off < end) {
+            size_t len = (size_t)MIN((off_t)sizeof(buf), end - off);
+            ssize_t n = dedupe_pread(fd, buf, len, off);
+            // A file that is shorter than its stat data says changed meanwhile
+            if (n != (ssize_t)len) {
+                ret = -1;
+                break;
+            }
+            dedupe_hash_block(out, buf, len);
+            off += (off_t)len;
+            bytes += len;
+        }
+    }
+    close(fd);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    struct stats *st = stats_get();
+    st->bytes_read += bytes;
+    st->read_ns += ts_diff(t0, t1);
+    return ret;
+}
+
+// Function to get the full hash of an entry, computing it the first time
+static int dedupe_entry_full(struct dedupe_entry *e) {
+    int state = __atomic_load_n(&e->full_state, __ATOMIC_ACQUIRE);
+    if (state != 0) return state;
+    uint64_t full[2];
+    int r = dedupe_hash_file(e->path, NULL, e->size, 1, full);
+    pthread_mutex_lock(&dedupe_lock);
+    if (e->full_state == 0) {
+        memcpy(e->full, full, sizeof(full));
+        __atomic_store_n(&e->full_state, r < 0 ? -1 : 1, __ATOMIC_RELEASE);
+    }
+    state = e->full_state;
+    pthread_mutex_unlock(&dedupe_lock);
+    return state;
+}
+
+// Function to find the entry of the inode of a file, or create it
+static struct dedupe_entry *dedupe_find(const char *path, const struct stat *sb) {
+    if (dedupe == DEDUPE_NONE || !sb || !S_ISREG(sb->st_mode)) return NULL;
+
+    pthread_mutex_lock(&dedupe_lock);
+    struct dedupe_entry *e = dedupe_lookup(&dedupe_inodes, sb->st_dev, sb->st_ino);
+    if (e) {
+        stats_get()->duplicates++;
+    } else if ((e = dedupe_new(path, sb->st_size)) != NULL &&
+               dedupe_insert(&dedupe_inodes, sb->st_dev, sb->st_ino, e) < 0) {
+        e = NULL;               // Out of memory, the file is checked as usual
+    }
+    pthread_mutex_unlock(&dedupe_lock);
+    return e;
+}
+
+// Function to get the entry that holds the verdicts of an inode
+static inline struct dedupe_entry *dedupe_canon(struct dedupe_entry *e) {
+    struct dedupe_entry *same = __atomic_load_n(&e->same, __ATOMIC_ACQUIRE);
+    return same ? same : e;
+}
+
+// Function to look up the contents of an inode entry before a plugin reads the file
+static void dedupe_resolve(struct dedupe_entry *e, const char *path, struct file_view *view) {
+    if (dedupe != DEDUPE_CONTENT || __atomic_load_n(&e->hashed, __ATOMIC_ACQUIRE)) return;
+
+    // Files are hashed without the lock, candidates are taken out first
+    const unsigned char *data = view && view_load(view, path) > 0 && (off_t)view->len == e->size ? view->data : NULL;
+    uint64_t sample[2];
+    int ok = dedupe_hash_file(path, data, e->size, 0, sample) == 0;
+    struct dedupe_entry *cand[DEDUPE_CANDIDATES];
+    int nc = 0;
+    pthread_mutex_lock(&dedupe_lock);
+    if (ok && dedupe_contents.cap) {
+        size_t k = dedupe_slot(&dedupe_contents, (uint64_t)e->size, sample[0] ^ sample[1]);
+        for (struct dedupe_node *n = dedupe_contents.slots[k]; n && nc < DEDUPE_CANDIDATES; n = n->next)
+            if (n->a == (uint64_t)e->size && n->b == (sample[0] ^ sample[1]) && n->e != e) cand[nc++] = n->e;
+    }
+    pthread_mutex_unlock(&dedupe_lock);
+
+    uint64_t full[2];
+    int full_state = 0;
+    struct dedupe_entry *match = NULL;
+    for (int c = 0; c < nc && !match; c++) {
+        if (full_state == 0) full_state = dedupe_hash_file(path, data, e->size, 1, full) < 0 ? -1 : 1;
+        if (full_state < 0) break;
+        if (dedupe_entry_full(cand[c]) == 1 && memcmp(cand[c]->full, full, sizeof(full)) == 0)
+            match = cand[c];
+    }
+    // Contents in memory are hashed now, a later copy need not read them again
+    if (ok && !match && full_state == 0 && data)
+        full_state = dedupe_hash_file(path, data, e->size, 1, full) < 0 ? -1 : 1;
+
+    pthread_mutex_lock(&dedupe_lock);
+    if (!e->hashed && match) {
+        // Verdicts already taken for the inode go to the entry it shares from now on
+        for (int i = 0; i < plug_cnt; i++) {
+            if (match->res[i].value != DEDUPE_UNKNOWN || e->res[i].value == DEDUPE_UNKNOWN) continue;
+            match->res[i].report = e->res[i].report;
+            match->res[i].report_len = e->res[i].report_len;
+            e->res[i].report = NULL;
+            __atomic_store_n(&match->res[i].value, e->res[i].value, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&e->same, match, __ATOMIC_RELEASE);
+        stats_get()->duplicates++;
+    } else if (!e->hashed && ok) {
+        if (full_state == 1) {
+            memcpy(e->full, full, sizeof(full));
+            e->full_state = 1;
+        }
+        dedupe_insert(&dedupe_contents, (uint64_t)e->size, sample[0] ^ sample[1], e);
+    }
+    __atomic_store_n(&e->hashed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&dedupe_lock);
+}
+
+// Function to take the verdict of plugin i from an alias checked before
+static int dedupe_get(struct dedupe_entry *e, int i, struct report_buf *rep, int *res) {
+    const struct dedupe_result *r = &dedupe_canon(e)->res[i];
+    int v = __atomic_load_n(&r->value, __ATOMIC_ACQUIRE);
+    if (v == DEDUPE_UNKNOWN) return 0;
+    if (rep && r->report_len && report_reserve(rep, r->report_len) == 0) {
+        memcpy(rep->data + rep->len, r->report, r->report_len);
+        rep->len += r->report_len;
+    }
+    *res = v;
+    return 1;
+}
+
+// Function to keep the verdict of plugin i and the reports it added after start
+static void dedupe_put(struct dedupe_entry *e, int i, int res, const struct report_buf *rep, size_t start) {
+    if (res < 0) return;        // The next alias tries again
+    pthread_mutex_lock(&dedupe_lock);
+    struct dedupe_result *r = &dedupe_canon(e)->res[i];
+    if (r->value == DEDUPE_UNKNOWN) {
+        if (rep && rep->len > start && (r->report = malloc(rep->len - start)) != NULL) {
+            memcpy(r->report, rep->data + start, rep->len - start);
+            r->report_len = rep->len - start;
+        }
+        __atomic_store_n(&r->value, res, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&dedupe_lock);
+}
+
+/*
+    Decompression (--decompress).
+
+    Files that start with the gzip or zstd magic number are decompressed,
+    and the contents are passed in chunks to the plugins that export the
+    stream functions. Their verdicts are taken from that pass. Other plugins,
+    and all plugins when a decoder is missing, see the compressed bytes.
+    The decoders are loaded with dlopen() the first time a compressed file
+    turns up (libz.so.1, libzstd.so.1), so nothing is needed to build the
+    program and nothing is loaded without the option.
+
+    A decoder thread fills a ring of DEC_RING pool buffers of DEC_CHUNK
+    bytes while the calling thread passes the filled ones to the plugins,
+    so decoding and matching run on different cores and a file of any size
+    takes that much memory. Decoding stops as soon as every plugin knows
+    its result. Files smaller than DEC_THREAD_MIN, and files checked when
+    the pool gives out only one buffer, are decoded by the calling thread;
+    when the pool has nothing left for it one buffer is allocated apart.
+    Corrupt or truncated data is reported, and the verdicts are those for
+    the data decoded before the error, as with zcat. Metadata filters see
+    the compressed file, except for the size bounds of stream plugins:
+    those describe the contents, so they are not applied to it.
+*/
+#define DEC_CHUNK (256 * 1024)          // Decompressed bytes passed at a time
+#define DEC_RING 4                      // Chunks the decoder thread may be ahead
+#define DEC_THREAD_MIN (64 * 1024)      // Smaller files are decoded without a thread
+#define STREAM_NONE INT_MIN             // Plugin was not in the stream pass
+
+
+// Buffers of the zstd streaming API, the layout is stable since zstd 1.3
+struct zstd_in {
+    const void *src;
+    size_t size, pos;
+};
+struct zstd_out {
+    void *dst;
+    size_t size, pos;
+};
+
+// Decoder functions resolved with dlsym(), NULL if the library is missing
+static struct {
+    int (*inflate_init)(z_streamp, int, const char *, int);
+    int (*inflate)(z_streamp, int);
+    int (*inflate_reset)(z_streamp);
+    int (*inflate_end)(z_streamp);
+    void *(*zstd_create)(void);
+    size_t (*zstd_init)(void *);
+    size_t (*zstd_decompress)(void *, struct zstd_out *, struct zstd_in *);
+    size_t (*zstd_free)(void *);
+    unsigned (*zstd_is_error)(size_t);
+} dec;
+static pthread_once_t dec_once = PTHREAD_ONCE_INIT;
+
+// Function to load the decoder libraries once
+static void dec_load(void) {
+    void *z = dlopen("libz.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (z) {
+        dec.inflate_init = (int (*)(z_streamp, int, const char *, int))dlsym(z, "inflateInit2_");
+        dec.inflate = (int (*)(z_streamp, int))dlsym(z, "inflate");
+        dec.inflate_reset = (int (*)(z_streamp))dlsym(z, "inflateReset");
+        dec.inflate_end = (int (*)(z_streamp))dlsym(z, "inflateEnd");
+        if (!dec.inflate || !dec.inflate_reset || !dec.inflate_end)
+            dec.inflate_init = NULL;
+    }
+    void *zs = dlopen("libzstd.so.1", RTLD_NOW | RTLD_LOCAL);
+    if (zs) {
+        dec.zstd_create = (void *(*)(void))dlsym(zs, "ZSTD_createDStream");
+        dec.zstd_init = (size_t (*)(void *))dlsym(zs, "ZSTD_initDStream");
+        dec.zstd_decompress = (size_t (*)(void *, struct zstd_out *, struct zstd_in *))dlsym(zs, "ZSTD_decompressStream");
+        dec.zstd_free = (size_t (*)(void *))dlsym(zs, "ZSTD_freeDStream");
+        dec.zstd_is_error = (unsigned (*)(size_t))dlsym(zs, "ZSTD_isError");
+        if (!dec.zstd_init || !dec.zstd_decompress || !dec.zstd_free || !dec.zstd_is_error)
+            dec.zstd_create = NULL;
+    }
+    if (debug)
+        fprintf(stderr, "Decoders: gzip %s, zstd %s\n", dec.inflate_init ? "loaded" : "missing",
+                dec.zstd_create ? "loaded" : "missing");
+}
+
+// Function to recognize compressed contents by their magic number
+static int dec_codec(const unsigned char *p, size_t len) {
+    if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) return CODEC_GZIP;
+    if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f && p[3] == 0xfd) return CODEC_ZSTD;
+    return CODEC_NONE;
+}
+
+// Function to check whether a file is compressed, for files no view was read for
+static int dec_codec_path(const char *path) {
+    unsigned char magic[4];
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) return CODEC_NONE;
+    ssize_t n = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+    return n > 0 ? dec_codec(magic, (size_t)n) : CODEC_NONE;
+}
+
+// Decompression of one file
+struct dec_job {
+    int codec;
+    const unsigned char *in;    // Compressed contents
+    size_t in_len, in_pos;
+    z_stream zs;
+    void *zstd;
+    int finished;               // Input used up or undecodable, written by the decoder
+    int err;                    // The data is corrupt or truncated
+    unsigned char *buf[DEC_RING];
+    size_t len[DEC_RING];
+    int nbuf;                   // Buffers in the ring
+    int own;                    // The only buffer is not from the pool
+    unsigned long head, tail;   // Chunks decoded and chunks passed on
+    int stop, done;             // The plugins need no more data / the decoder has ended
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+// Function to decode up to cap bytes, less only at the end of the data
+static size_t dec_fill(struct dec_job *j, unsigned char *out, size_t cap) {
+    size_t got = 0;
+    while (got < cap && !j->finished) {
+        if (j->codec == CODEC_GZIP) {
+            z_stream *zs = &j->zs;
+            zs->next_in = (Bytef *)(j->in + j->in_pos);
+            zs->avail_in = (uInt)MIN(j->in_len - j->in_pos, (size_t)1 << 30);
+            zs->next_out = out + got;
+            zs->avail_out = (uInt)(cap - got);
+            int r = dec.inflate(zs, Z_NO_FLUSH);
+            j->in_pos = (size_t)(zs->next_in - j->in);
+            got = (size_t)(zs->next_out - out);
+            if (r == Z_STREAM_END) {
+                // Concatenated members make one file, as with gunzip, anything else is ignored
+                if (dec_codec(j->in + j->in_pos, j->in_len - j->in_pos) == CODEC_GZIP)
+                    dec.inflate_reset(zs);
+                else
+                    j->finished = 1;
+            } else if ((r != Z_OK && r != Z_BUF_ERROR) || (j->in_pos == j->in_len && got < cap)) {
+                j->err = 1;
+                j->finished = 1;
+            }
+        } else {
+            struct zstd_in zin = {j->in, j->in_len, j->in_pos};
+            struct zstd_out zout = {out, cap, got};
+            size_t r = dec.zstd_decompress(j->zstd, &zout, &zin);
+            j->in_pos = zin.pos;
+            got = zout.pos;
+            if (dec.zstd_is_error(r)) {
+                j->err = 1;
+                j->finished = 1;
+            } else if (j->in_pos == j->in_len && got < cap) {
+                // 0 means the last frame is complete, anything else that it was cut off
+                j->err = r != 0;
+                j->finished = 1;
+            }
+        }
+    }
+    return got;
+}
+
+// Thread that decodes chunks ahead of the plugins
+static void *dec_thread(void *arg) {
+    struct dec_job *j = arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop && !j->finished) {
+        while (!j->stop && j->head - j->tail == (unsigned long)j->nbuf)
+            pthread_cond_wait(&j->cond, &j->lock);
+        if (j->stop) break;
+        int k = (int)(j->head % (unsigned long)j->nbuf);
+        pthread_mutex_unlock(&j->lock);
+        size_t n = dec_fill(j, j->buf[k], DEC_CHUNK);
+        pthread_mutex_lock(&j->lock);
+        j->len[k] = n;
+        j->head++;
+        pthread_cond_broadcast(&j->cond);
+    }
+    j->done = 1;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// Function to wait for the next decoded chunk, NULL after the last one
+static const unsigned char *dec_next(struct dec_job *j, int threaded, size_t *len) {
+    if (!threaded) {
+        *len = j->finished ? 0 : dec_fill(j, j->buf[0], DEC_CHUNK);
+        return *len ? j->buf[0] : NULL;
+    }
+    pthread_mutex_lock(&j->lock);
+    for (;;) {
+        while (j->head == j->tail && !j->done)
+            pthread_cond_wait(&j->cond, &j->lock);
+        if (j->head == j->tail) {
+            pthread_mutex_unlock(&j->lock);
+            return NULL;
+        }
+        int k = (int)(j->tail % (unsigned long)j->nbuf);
+        if (j->len[k] > 0) {
+            *len = j->len[k];
+            pthread_mutex_unlock(&j->lock);
+            return j->buf[k];
+        }
+        j->tail++;              // The empty chunk at the end of the data
+    }
+}
+
+// Function to give a passed chunk back to the decoder
+static void dec_done(struct dec_job *j, int threaded) {
+    if (!threaded) return;
+    pthread_mutex_lock(&j->lock);
+    j->tail++;
+    pthread_cond_broadcast(&j->cond);
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Verdicts of the stream plugins for one file
+struct stream_verdicts {
+    int state;                  // 0 - not tried, 1 - not compressed or not decodable, 2 - res is set
+    int *res;                   // Per plugin: verdict, -errno, or STREAM_NONE
+};
+
+static __thread struct stream_verdicts tl_stream_own;           // For check_entry()
+static __thread struct stream_verdicts *tl_stream = NULL;       // Of the file being checked
+
+// Function to free the verdicts of a thread that is about to exit
+static void stream_release(void) {
+    free(tl_stream_own.res);
+    tl_stream_own.res = NULL;
+}
+
+// Function to set up the decoder of a file, -1 if it cannot be decoded here
+static int dec_init(struct dec_job *j, int codec, const void *data, size_t len) {
+    pthread_once(&dec_once, dec_load);
+    memset(j, 0, sizeof(*j));
+    j->codec = codec;
+    j->in = data;
+    j->in_len = len;
+    if (codec == CODEC_GZIP) {
+        if (!dec.inflate_init || dec.inflate_init(&j->zs, 15 + 16, ZLIB_VERSION, (int)sizeof(z_stream)) != Z_OK)
+            return -1;
+    } else if (!dec.zstd_create || !(j->zstd = dec.zstd_create()) || dec.zstd_is_error(dec.zstd_init(j->zstd))) {
+        if (j->zstd) dec.zstd_free(j->zstd);
+        return -1;
+    }
+
+    // The ring comes from the pool, a thread that holds buffers is not made to wait
+    while (j->nbuf < DEC_RING && (j->buf[j->nbuf] = pool_get(DEC_CHUNK)) != NULL) j->nbuf++;
+    if (j->nbuf == 0) {
+        // The pool is used up by this thread, the file is still decoded in one buffer
+        if (!(j->buf[0] = malloc(DEC_CHUNK))) {
+            if (codec == CODEC_GZIP) dec.inflate_end(&j->zs);
+            else dec.zstd_free(j->zstd);
+            return -1;
+        }
+        j->nbuf = j->own = 1;
+    }
+    return 0;
+}
+
+static void dec_free(struct dec_job *j) {
+    if (j->codec == CODEC_GZIP) dec.inflate_end(&j->zs);
+    else dec.zstd_free(j->zstd);
+    if (j->own) free(j->buf[0]);
+    else for (int k = 0; k < j->nbuf; k++) pool_put(j->buf[k], DEC_CHUNK);
+}
+
+// Function to check a compressed file with every stream plugin in one pass
+static void stream_check(const char *path, struct file_view *view, struct stream_verdicts *sv) {
+    sv->state = 1;
+    if (view_load(view, path) <= 0) return;
+    int codec = dec_codec(view->data, view->len);
+    if (codec == CODEC_NONE) return;
+    if (!sv->res && !(sv->res = malloc(plug_cnt * sizeof(int)))) return;
+    struct dec_job j;
+    if (dec_init(&j, codec, view->data, view->len) < 0) return;
+
+    // Plugins that are done drop out, the pass ends with the last one
+    void *states[plug_cnt];
+    unsigned long ns[plug_cnt];
+    int active = 0;
+    struct timespec t0, t1;
+    for (int i = 0; i < plug_cnt; i++) {
+        sv->res[i] = STREAM_NONE;
+        states[i] = NULL;
+        ns[i] = 0;
+        if (plugins[i].in_opts_len == 0 || !plugins[i].query || !plugins[i].psb) continue;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (plugins[i].psb(plugins[i].query, &states[i]) < 0) {
+            sv->res[i] = -errno;
+            states[i] = NULL;
+        } else {
+            active++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[i] += ts_diff(t0, t1);
+    }
+
+    pthread_t thread;
+    int threaded = view->len >= DEC_THREAD_MIN && j.nbuf > 1;
+    if (threaded) {
+        pthread_mutex_init(&j.lock, NULL);
+        pthread_cond_init(&j.cond, NULL);
+        if (pthread_create(&thread, NULL, dec_thread, &j) != 0) {
+            pthread_mutex_destroy(&j.lock);
+            pthread_cond_destroy(&j.cond);
+            threaded = 0;
+        }
+    }
+    unsigned long bytes = 0;
+    const unsigned char *chunk;
+    size_t len;
+    while (active > 0 && (chunk = dec_next(&j, threaded, &len)) != NULL) {
+        bytes += len;
+        for (int i = 0; i < plug_cnt; i++) {
+            if (!states[i] || sv->res[i] != STREAM_NONE) continue;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            int r = plugins[i].psu(states[i], chunk, len);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ns[i] += ts_diff(t0, t1);
+            if (r > 0) continue;
+            // Done or failed, the result comes from plugin_stream_end()
+            sv->res[i] = r < 0 ? -errno : 0;
+            active--;
+        }
+        dec_done(&j, threaded);
+    }
+    if (threaded) {
+        pthread_mutex_lock(&j.lock);
+        j.stop = 1;
+        pthread_cond_broadcast(&j.cond);
+        pthread_mutex_unlock(&j.lock);
+        pthread_join(thread, NULL);
+        pthread_mutex_destroy(&j.lock);
+        pthread_cond_destroy(&j.cond);
+    }
+    if (j.err && active > 0) {
+        fprintf(stderr, "Cannot decompress %s: the data is corrupt or truncated\n", path);
+        stats_get()->read_errors++;
+    }
+    dec_free(&j);
+
+    for (int i = 0; i < plug_cnt; i++) {
+        if (!states[i]) continue;
+        int failed = sv->res[i] < 0 && sv->res[i] != STREAM_NONE ? sv->res[i] : 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        tl_report_plugin = i;
+        int r = plugins[i].pse(states[i]);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        ns[i] += ts_diff(t0, t1);
+        sv->res[i] = failed ? failed : (r < 0 ? -errno : r);
+        eval_account_ns(i, 1, sv->res[i] == 0, ns[i]);
+    }
+    struct stats *st = stats_get();
+    st->dec_files++;
+    st->dec_bytes += bytes;
+    sv->state = 2;
+}
+
+// Function to take the verdict of plugin i from the stream pass of a compressed file
+static int stream_take(int i, const char *path, struct file_view *view, int *res) {
+    struct stream_verdicts *sv = tl_stream;
+    if (!decompress || !sv || !view || !plugins[i].psb || !plugins[i].query) return 0;
+    if (sv->state == 0) stream_check(path, view, sv);
+    if (sv->state != 2 || sv->res[i] == STREAM_NONE) return 0;
+    *res = sv->res[i];
+    return 1;
+}
+
+// Function to call plugin i on one file, returns its verdict
+static int plugin_call(int i, const char *path, const struct stat *sb,
+                       const struct index_record *rec, struct file_view *view) {
+    // Files that fail the metadata predicates are not opened at all
+    if (meta_rejects(i, path, sb))
+        return 1;
+
+    // An alias of a file checked before takes its verdict
+    int cached;
+    if (tl_dedupe && dedupe_get(tl_dedupe, i, tl_report_dst, &cached))
+        return cached;
+    size_t rep_start = tl_report_dst ? tl_report_dst->len : 0;
+
+    // Content dedupe hashes the file only when the plugin is about to read it,
+    // from the view when the plugin reads one
+    int from_index = rec && plugins[i].query && plugins[i].ppr;
+    int streams = decompress && plugins[i].psb && plugins[i].query && tl_stream;
+    if (tl_dedupe && (streams || !from_index)) {
+        int by_view = streams || (plugins[i].query ? plugins[i].pcb != NULL : plugins[i].ppb != NULL);
+        dedupe_resolve(tl_dedupe, path, by_view ? view : NULL);
+        if (dedupe_get(tl_dedupe, i, tl_report_dst, &cached))
+            return cached;
+    }
+
+    // A compressed file was checked decompressed by the stream plugins
+    int tmp = -1;
+    if (stream_take(i, path, view, &tmp)) {
+        if (tmp < 0) {
+            errno = -tmp;
+            tmp = -1;
+        }
+        if (tmp == -1)
+            plugin_error(i, errno);
+        if (tl_dedupe)
+            dedupe_put(tl_dedupe, i, tmp, tl_report_dst, rep_start);
+        return tmp;
+    }
+
+    // Read the file before starting the clock, reads are counted separately
+    if (!from_index && (plugins[i].query ? plugins[i].pcb != NULL : plugins[i].ppb != NULL))
+        view_load(view, path);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    tl_report_plugin = i;
+
+    // Call plugin's processing function with the specified options,
+    // plugins that accept a buffer share one read of the file
+    if (from_index)
+        tmp = plugins[i].ppr(plugins[i].query, rec->presence);
+    if (tmp >= 0) {
+        // Answered from the index without reading the file
+    } else if (plugins[i].query) {
+        if (plugins[i].pcb && view_load(view, path) > 0)
+            tmp = plugins[i].pcb(plugins[i].query, view->data, view->len);
+        else
+            tmp = plugins[i].pcp(plugins[i].query, path);
+    } else if (plugins[i].ppb && view_load(view, path) > 0)
+        tmp = plugins[i].ppb(view->data, view->len, plugins[i].in_opts, plugins[i].in_opts_len);
+    else
+        tmp = plugins[i].ppf(path, plugins[i].in_opts, plugins[i].in_opts_len);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    eval_account(i, 1, tmp == 0, t0, t1);
+
+    // Handle errors if any
+    if(tmp == -1)
+        plugin_error(i, errno);
+    if (tl_dedupe)
+        dedupe_put(tl_dedupe, i, tmp, tl_report_dst, rep_start);
+    return tmp;
+}
+
+// Function to run the plugins on a file and print it if it matches
+void check_entry(int level, const char *path, const struct stat *sb, struct file_view *view) {
+    const struct index_record *rec = sb ? index_lookup(sb) : NULL;
+    tl_report.len = 0;
+    tl_report_dst = &tl_report;
+    tl_dedupe = dedupe_find(path, sb);
+    tl_stream_own.state = 0;
+    tl_stream = &tl_stream_own;
+
+    // With 'and' the first failed plugin decides, with 'or' the first match
+    int matched = !or;
+    uint64_t hits = 0;          // Plugins that matched, for --format jsonl
+    const int *order = eval_order();
+    for(int k = 0; k < plug_cnt; k++){
+        int i = order ? order[k] : k;
+        // Skip plugins with no options set
+        if(plugins[i].in_opts_len > 0){
+            int tmp = plugin_call(i, path, sb, rec, view);
+            if (tmp == 0 && i < 64) hits |= 1ULL << i;
+            // An error counts as a mismatch
+            if ((tmp == 0) == or) {
+                matched = or;
+                break;
+            }
+        }
+    }
+    
+    // Check if the conditions for 'or' and 'not' are met
+    stats_get()->files++;
+    if(matched != not)
+        emit_found(level, path, hits, &tl_report);
+    tl_report_dst = NULL;
+    tl_dedupe = NULL;
+    tl_stream = NULL;
+    scratch_reset();
+    return;
+} 
+
+// Function to check whether an entry of the walk belongs to another shard
+static int shard_skip(const char *path, int level, int is_dir) {
+    if (shard_n == 1) return 0;
+    if (level == 0) return !is_dir && shard_i != 0;     // A file given as the root
+    if (level > shard_depth || (is_dir && level < shard_depth)) return 0;
+
+    // The path below the root names the entry the same way on every host
+    const char *rel = path + shard_root_len;
+    while (*rel == '/') rel++;
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *c = rel; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    return h % (uint64_t)shard_n != (uint64_t)shard_i;
+}
+
+// Function for directory traversal
+int walk_func(const char *fpath,const struct stat *sb, 
+        int typeflag, struct FTW *ftwbuf) {
+    if(!sb) return -1;
+    if (out_stop) return FTW_STOP;     // Enough files found, stop nftw()
+    if (shard_skip(fpath, ftwbuf->level, typeflag == FTW_D))
+        return typeflag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    if (typeflag == FTW_D && index_prunes(AT_FDCWD, fpath, sb))
+        return FTW_SKIP_SUBTREE;
+    if (batch_size > 1 && typeflag == FTW_F)
+        batch_push(ftwbuf->level, fpath, sb);
+    else if (io_engine != IO_SYNC && typeflag == FTW_F)
+        io_push(ftwbuf->level, fpath, sb);
+    else
+        print_entry(ftwbuf->level, typeflag, fpath, sb); 
+   
+    return 0;
+}
+
+// Function to traverse directories
+void walk_dir(const char *dir) {
+    shard_root_len = strlen(dir);
+    while (shard_root_len > 1 && dir[shard_root_len - 1] == '/') shard_root_len--;
+    if (n_jobs > 1) {
+        if (schedule != SCHED_WALK)
+            fprintf(stderr, "--schedule needs the serial walk, files are read in walk order\n");
+        walk_dir_parallel(dir);
+        return;
+    }
+    // The window of the scheduler is a batch that is checked in disk order,
+    // half of the descriptors are left to the walker and the plugins
+    if (schedule != SCHED_WALK) {
+        batch_size = sched_window;
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
+        sched_fd_max = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY ?
+                       (long)MIN(rl.rlim_cur / 2, (rlim_t)LONG_MAX) : LONG_MAX;
+    }
+    if (batch_size > 1 && io_engine != IO_SYNC) {
+        fprintf(stderr, "%s replaces --io, files are read by the plugins\n",
+                schedule != SCHED_WALK ? "--schedule" : "--batch");
+        io_engine = IO_SYNC;
+    }
+    io_start();
+    if (walker == WALKER_GETDENTS) {
+        walk_dir_getdents(dir);
+    } else if (nftw(dir, walk_func, 10, FTW_PHYS | FTW_ACTIONRETVAL) < 0) {
+        fprintf(stderr, "ntfw() failed: %s\n", strerror(errno));
+    }
+    io_finish();
+    batch_flush();
+}
+
+
+/*
+    Directory reader walker (--walker getdents).
+
+    Reads directories with getdents64() in large batches instead of going
+    through nftw(). The type of an entry comes from d_type, so entries are
+    stat()ed only when the type is unknown or stat data is needed by the
+    index, the metadata predicates or the --batch and --io windows. Every
+    directory on the way down stays open and its entries are stat()ed and
+    opened relative to it, so the kernel does not resolve the whole path for
+    each of them. The path lives in one buffer: the directory part is written
+    once per directory and only the name is copied in for each entry, for the
+    plugins that open files by path and for printing. Entries are visited in
+    the order nftw() visits them, so the output is the same.
+*/
+
+#define GD_BUF_SIZE (64 * 1024)     // Bytes of directory entries read at once
+
+static char *gd_path = NULL;        // Path of the entry being visited
+static size_t gd_path_cap = 0;
+static char **gd_bufs = NULL;       // getdents64() buffer of every open directory level
+static int gd_bufs_cap = 0;
+
+static void gd_walk(int fd, int level, size_t len);
+
+// Function to make room for a path of len bytes
+static int gd_path_reserve(size_t len) {
+    if (len <= gd_path_cap) return 0;
+    size_t cap = gd_path_cap ? gd_path_cap : 256;
+    while (cap < len) cap *= 2;
+    char *p = realloc(gd_path, cap);
+    if (!p) return -1;
+    gd_path = p;
+    gd_path_cap = cap;
+    return 0;
+}
+
+// Function to visit an entry named name in the directory dirfd, gd_path holds its path of length len
+static void gd_visit(int dirfd, int level, size_t len, const char *name, int type) {
+    struct stat sb;
+    int have_sb = 0;
+    if (type == DT_UNKNOWN) {
+        // Resolve the entry type the same way nftw() with FTW_PHYS does
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) return;
+        have_sb = 1;
+        type = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG);
+    }
+    if (type == DT_LNK || shard_skip(gd_path, level, type == DT_DIR))
+        return;     // Symbolic links are never followed nor checked, other shards are not ours
+
+    if (type == DT_DIR) {
+        if (prune_active && (have_sb || fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == 0) &&
+            index_prunes(dirfd, name, &sb))
+            return;
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "openat() failed for %s: %s\n", gd_path, strerror(errno));
+            return;
+        }
+        gd_walk(fd, level, len);
+        close(fd);
+        return;
+    }
+
+    if (!have_sb && (index_path || meta_in_use || dedupe != DEDUPE_NONE || batch_size > 1 ||
+                     io_engine != IO_SYNC)) {
+        if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) < 0) return;
+        have_sb = 1;
+    }
+    if (batch_size > 1)
+        batch_push(level, gd_path, &sb);
+    else if (io_engine != IO_SYNC)
+        io_push(level, gd_path, &sb);
+    else
+        print_entry_at(level, dirfd, name, gd_path, have_sb ? &sb : NULL);
+}
+
+// Function to visit the entries of the open directory fd, gd_path holds its path of length len
+static void gd_walk(int fd, int level, size_t len) {
+    // Entries of a directory are visited while the ones above are still being read
+    if (level >= gd_bufs_cap) {
+        int cap = gd_bufs_cap ? gd_bufs_cap * 2 : 16;
+        while (cap <= level) cap *= 2;
+        char **bufs = realloc(gd_bufs, cap * sizeof(char *));
+        if (!bufs) return;
+        memset(bufs + gd_bufs_cap, 0, (cap - gd_bufs_cap) * sizeof(char *));
+        gd_bufs = bufs;
+        gd_bufs_cap = cap;
+    }
+    if (!gd_bufs[level] && !(gd_bufs[level] = malloc(GD_BUF_SIZE))) return;
+    char *buf = gd_bufs[level];
+    stats_get()->dirs++;
+
+    size_t base = len > 0 && gd_path[len - 1] == '/' ? len : len + 1;
+    while (!out_stop) {
+        long n = syscall(SYS_getdents64, fd, buf, GD_BUF_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            gd_path[len] = '\0';
+            fprintf(stderr, "getdents64() failed for %s: %s\n", gd_path, strerror(errno));
+            break;
+        }
+        if (n == 0) break;
+
+        for (long off = 0; off < n && !out_stop; ) {
+            struct dirent64 *de = (struct dirent64 *)(buf + off);
+            off += de->d_reclen;
+            const char *name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            size_t nlen = strlen(name);
+            if (gd_path_reserve(base + nlen + 1) < 0) continue;
+            gd_path[base - 1] = '/';
+            memcpy(gd_path + base, name, nlen + 1);
+            gd_visit(fd, level + 1, base + nlen, name, de->d_type);
+        }
+    }
+    gd_path[len] = '\0';
+}
+
+// Function to traverse directories with getdents64()
+static void walk_dir_getdents(const char *dir) {
+    // Every level of the tree holds a descriptor, allow as many as the system does
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct stat sb;
+    if (lstat(dir, &sb) < 0) {
+        fprintf(stderr, "lstat() failed for %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    // Strip trailing slashes like nftw() does so printed paths are the same
+    if (gd_path_reserve(shard_root_len + 2) < 0) return;
+    memcpy(gd_path, dir, shard_root_len);
+    gd_path[shard_root_len] = '\0';
+    int type = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG);
+    gd_visit(AT_FDCWD, 0, shard_root_len, dir, type);
+
+    for (int i = 0; i < gd_bufs_cap; i++) free(gd_bufs[i]);
+    free(gd_bufs);
+    free(gd_path);
+    gd_bufs = NULL;
+    gd_bufs_cap = 0;
+    gd_path = NULL;
+    gd_path_cap = 0;
+}
+
+
+/*
+    Parallel walker (-j N).
+
+    Every worker owns a deque of tasks (directories to read and files to check).
+    The owner pushes and pops at the tail, so it goes depth-first through its own
+    subtree; idle workers steal from the head of other deques, which hands out
+    the oldest and usually largest subtrees. Plugins are called from the worker
+    that took the file task, so plugin_process_file() must be reentrant.
+    Found files are printed as soon as they are checked, so the order of lines
+    differs from the serial nftw() walk, but the set of lines is the same.
+*/
+
+// Task for the parallel walker
+typedef struct {
+    char *path;     // Path of the entry (owned by the task)
+    int level;      // Depth relative to the root, as nftw() reports it
+    int is_dir;     // Directory to read or file to check
+} walk_task;
+
+// Per-worker task deque
+typedef struct {
+    pthread_mutex_t lock;
+    walk_task *tasks;
+    size_t head, tail, cap;     // Live tasks are tasks[head..tail)
+} task_deque;
+
+static task_deque *deques = NULL;
+static size_t pending_tasks = 0;    // Tasks pushed but not yet finished
+static int idle_workers = 0;
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+// Function to add a task to the tail of a worker's deque
+static void deque_push(int worker, char *path, int level, int is_dir) {
+    task_deque *d = &deques[worker];
+    __atomic_add_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        // Compact the deque first, grow it only if it is really full
+        if (d->head > 0) {
+            memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof(walk_task));
+            d->tail -= d->head;
+            d->head = 0;
+        }
+        if (d->tail == d->cap) {
+            d->cap = d->cap ? d->cap * 2 : 64;
+            d->tasks = realloc(d->tasks, d->cap * sizeof(walk_task));
+        }
+    }
+    d->tasks[d->tail].path = path;
+    d->tasks[d->tail].level = level;
+    d->tasks[d->tail].is_dir = is_dir;
+    d->tail++;
+    pthread_mutex_unlock(&d->lock);
+
+    // Wake up idle workers so they can steal the new task
+    if (__atomic_load_n(&idle_workers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&idle_lock);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_lock);
+    }
+}
+
+// Function to take a task: from the own tail first, then from the heads of others
+static int deque_take(int worker, walk_task *out) {
+    task_deque *d = &deques[worker];
+    pthread_mutex_lock(&d->lock);
+    if (d->tail > d->head) {
+        *out = d->tasks[--d->tail];
+        pthread_mutex_unlock(&d->lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    for (int i = 1; i < n_jobs; i++) {
+        task_deque *v = &deques[(worker + i) % n_jobs];
+        pthread_mutex_lock(&v->lock);
+        if (v->tail > v->head) {
+            *out = v->tasks[v->head++];
+            pthread_mutex_unlock(&v->lock);
+            return 1;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return 0;
+}
+
+// Function to join a directory path and an entry name
+static char *join_path(const char *dir, const char *name) {
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *res = malloc(dlen + nlen + 2);
+    if (!res) return NULL;
+    memcpy(res, dir, dlen);
+    if (dlen == 0 || dir[dlen - 1] != '/') res[dlen++] = '/';
+    memcpy(res + dlen, name, nlen + 1);
+    return res;
+}
+
+// Function to read a directory and push its entries to the worker's deque
+static void walk_read_dir(int worker, const walk_task *t) {
+    DIR *dp = opendir(t->path);
+    if (!dp) {
+        fprintf(stderr, "opendir() failed for %s: %s\n", t->path, strerror(errno));
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+
+        char *path = join_path(t->path, de->d_name);
+        if (!path) continue;
+
+        // Resolve the entry type the same way nftw() with FTW_PHYS does
+        int type = de->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat sb;
+            if (lstat(path, &sb) < 0) {
+                free(path);
+                continue;
+            }
+            type = S_ISDIR(sb.st_mode) ? DT_DIR : (S_ISLNK(sb.st_mode) ? DT_LNK : DT_REG);
+        }
+
+        if (type == DT_LNK || shard_skip(path, t->level + 1, type == DT_DIR)) {
+            free(path);     // Symbolic links are never followed nor checked, other shards are not ours
+            continue;
+        }
+        deque_push(worker, path, t->level + 1, type == DT_DIR);
+    }
+    closedir(dp);
+}
+
+// Worker thread of the parallel walker
+static void *walk_worker(void *arg) {
+    int worker = (int)(long)arg;
+    walk_task t;
+    struct stat sb;
+
+    for (;;) {
+        if (deque_take(worker, &t)) {
+            if (out_stop) {
+                // Enough files found, only drain the deques
+            } else if (t.is_dir && prune_active && lstat(t.path, &sb) == 0 && index_prunes(AT_FDCWD, t.path, &sb)) {
+                // The index rules out every file below the directory
+            } else if (t.is_dir) {
+                struct timespec t0, t1;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                walk_read_dir(worker, &t);
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                struct stats *st = stats_get();
+                st->walk_ns += ts_diff(t0, t1);
+                st->dirs++;
+            } else {
+                // Only the index, metadata predicates and --dedupe need stat data, d_type is enough otherwise
+                int have_sb = (index_path || meta_in_use || dedupe != DEDUPE_NONE) && lstat(t.path, &sb) == 0;
+                print_entry(t.level, FTW_F, t.path, have_sb ? &sb : NULL);
+            }
+            free(t.path);
+
+            // The last finished task ends the walk for everyone
+            if (__atomic_sub_fetch(&pending_tasks, 1, __ATOMIC_SEQ_CST) == 0) {
+                pthread_mutex_lock(&idle_lock);
+                pthread_cond_broadcast(&idle_cond);
+                pthread_mutex_unlock(&idle_lock);
+            }
+            continue;
+        }
+
+        // Nothing to steal: wait until somebody pushes a task or the walk ends
+        pthread_mutex_lock(&idle_lock);
+        if (__atomic_load_n(&pending_tasks, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_unlock(&idle_lock);
+            break;
+        }
+        __atomic_add_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;      // Recheck every millisecond, pushes do not hold idle_lock
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&idle_cond, &idle_lock, &ts);
+        __atomic_sub_fetch(&idle_workers, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&idle_lock);
+    }
+    out_flush();
+    report_release();
+    return NULL;
+}
+
+// Function to traverse directories with n_jobs threads
+void walk_dir_parallel(const char *dir) {
+    struct stat sb;
+    if (lstat(dir, &sb) < 0) {
+        fprintf(stderr, "lstat() failed for %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        // nftw() reports a non-directory root as the only entry
+        if (!S_ISLNK(sb.st_mode) && !shard_skip(dir, 0, 0)) print_entry(0, FTW_F, dir, &sb);
+        return;
+    }
+
+    deques = calloc(n_jobs, sizeof(task_deque));
+    pthread_t *threads = calloc(n_jobs, sizeof(pthread_t));
+    if (!deques || !threads) {
+        fprintf(stderr, "calloc() failed: %s\n", strerror(errno));
+        free(deques);
+        free(threads);
+        return;
+    }
+    for (int i = 0; i < n_jobs; i++)
+        pthread_mutex_init(&deques[i].lock, NULL);
+
+    // Strip trailing slashes like nftw() does so printed paths are the same
+    char *root = strdup(dir);
+    size_t rlen = strlen(root);
+    while (rlen > 1 && root[rlen - 1] == '/') root[--rlen] = '\0';
+    deque_push(0, root, 0, 1);
+
+    int started = 0;
+    for (; started < n_jobs; started++) {
+        if (pthread_create(&threads[started], NULL, walk_worker, (void *)(long)started) != 0) {
+            fprintf(stderr, "pthread_create() failed\n");
+            break;
+        }
+    }
+    if (started == 0) walk_worker((void *)0L);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < n_jobs; i++) {
+        pthread_mutex_destroy(&deques[i].lock);
+        free(deques[i].tasks);
+    }
+    free(deques);
+    deques = NULL;
+    free(threads);
+}
+
+/*
+    Read-ahead I/O engines (--io).
+
+    The serial walk puts every file into a window of io_depth slots. The
+    engine opens and reads the files of the window in the background while
+    the walk goes on, and the file at the head of the window is checked by
+    the plugins as soon as its read completes, so files are still checked and
+    printed in walk order. The uring engine submits openat and read requests
+    through io_uring; the pool engine, used when io_uring is not available,
+    runs open() and pread() on a pool of threads. Files larger than a slot
+    buffer are left to the plugins, as are all files if no plugin accepts
+    buffers.
+*/
+
+#define IO_SLOT_SIZE (256 * 1024)   // Largest file read by the engine
+
+// States of a read-ahead slot
+enum { SLOT_FREE, SLOT_QUEUED, SLOT_OPENING, SLOT_READING, SLOT_DONE };
+
+// File in the read-ahead window
+struct io_slot {
+    char *path;             // Path of the file (owned)
+    int level;              // Depth reported by nftw()
+    int state;              // One of SLOT_*
+    int fd;                 // Open file, -1 if not opened
+    int failed;             // Could not be read, plugins will report the error
+    struct stat sb;         // Stat data from the walk
+    int by_path;            // Not read by the engine, plugins get the path
+    size_t size;            // Size from stat()
+    size_t len;             // Bytes read so far
+    unsigned char *buf;     // Contents, IO_SLOT_SIZE bytes
+};
+
+static struct io_slot *io_slots = NULL;
+static int io_head = 0, io_cnt = 0;     // Window is io_slots[io_head..io_head+io_cnt)
+
+// io_uring rings mapped from the kernel
+static struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned to_submit;
+} ring = { .fd = -1 };
+
+// Thread pool of the pread() engine
+static pthread_t *io_threads = NULL;
+static int io_thread_cnt = 0;
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t io_done_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long io_pushed = 0, io_taken = 0;  // Sequence numbers of queued and taken slots
+static int io_stop = 0;
+
+// Function to check whether any plugin in use can take a buffer
+static int io_wanted(void) {
+    for (int i = 0; i < plug_cnt; i++) {
+        if (plugins[i].in_opts_len == 0) continue;
+        if ((plugins[i].query && plugins[i].pcb) || (!plugins[i].query && plugins[i].ppb))
+            return 1;
+    }
+    return 0;
+}
+
+// Function to set up an io_uring instance, returns -1 if the kernel refuses
+static int uring_setup(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) return -1;
+
+    ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_sz > ring.sq_ring_sz) ring.sq_ring_sz = ring.cq_ring_sz;
+        ring.cq_ring_sz = ring.sq_ring_sz;
+    }
+    ring.sq_ring = mmap(NULL, ring.sq_ring_sz, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_sz, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            munmap(ring.sq_ring, ring.sq_ring_sz);
+            close(fd);
+            return -1;
+        }
+    }
+    ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        if (ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_sz);
+        munmap(ring.sq_ring, ring.sq_ring_sz);
+        close(fd);
+        return -1;
+    }
+
+    char *sq = ring.sq_ring, *cq = ring.cq_ring;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.fd = fd;
+    ring.to_submit = 0;
+    return 0;
+}
+
+// Function to release the io_uring instance
+static void uring_close(void) {
+    if (ring.fd < 0) return;
+    munmap(ring.sqes, ring.sqes_sz);
+    if (ring.cq_ring != ring.sq_ring) munmap(ring.cq_ring, ring.cq_ring_sz);
+    munmap(ring.sq_ring, ring.sq_ring_sz);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+// Function to queue an openat or read request for a slot
+static void uring_queue(int slot) {
+    struct io_slot *s = &io_slots[slot];
+    unsigned tail = *ring.sq_tail;
+    unsigned idx = tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (s->state == SLOT_OPENING) {
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)s->path;
+        sqe->open_flags = O_RDONLY;
+    } else {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = s->fd;
+        sqe->addr = (unsigned long)(s->buf + s->len);
+        sqe->len = (unsigned)(s->size - s->len);
+        sqe->off = s->len;
+    }
+    sqe->user_data = (unsigned long)slot;
+    ring.sq_array[idx] = idx;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.to_submit++;
+}
+
+// Function to submit queued requests and optionally wait for one completion
+static int uring_enter(unsigned wait) {
+    int res = (int)syscall(__NR_io_uring_enter, ring.fd, ring.to_submit, wait,
+                           wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (res < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return -1;
+    if (res > 0) ring.to_submit -= (unsigned)res;
+    return 0;
+}
+
+// Function to handle all completed io_uring requests
+static void uring_reap(void) {
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        struct io_slot *s = &io_slots[cqe->user_data];
+        int res = cqe->res;
+        head++;
+
+        if (res < 0) {
+            s->failed = 1;
+            s->state = SLOT_DONE;
+        } else if (s->state == SLOT_OPENING) {
+            s->fd = res;
+            s->state = s->size > 0 ? SLOT_READING : SLOT_DONE;
+            if (s->state == SLOT_READING) uring_queue((int)cqe->user_data);
+        } else {
+            s->len += (size_t)res;
+            if (res == 0 || s->len >= s->size) {
+                s->size = s->len;       // File shrank after stat()
+                s->state = SLOT_DONE;
+            } else {
+                uring_queue((int)cqe->user_data);   // Short read, continue
+            }
+        }
+        if (s->state == SLOT_DONE && s->fd >= 0) {
+            close(s->fd);
+            s->fd = -1;
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Function to read one slot on a pool thread
+static void pool_read(struct io_slot *s) {
+    int fd = open(s->path, O_RDONLY);
+    if (fd < 0) {
+        s->failed = 1;
+        return;
+    }
+    while (s->len < s->size) {
+        ssize_t t = pread(fd, s->buf + s->len, s->size - s->len, (off_t)s->len);
+        if (t < 0 && errno == EINTR) continue;
+        if (t < 0) {
+            s->failed = 1;
+            break;
+        }
+        if (t == 0) break;
+        s->len += (size_t)t;
+    }
+    s->size = s->len;
+    close(fd);
+}
+
+// Worker thread of the pread() engine
+static void *pool_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&io_lock);
+    for (;;) {
+        while (io_taken == io_pushed && !io_stop)
+            pthread_cond_wait(&io_job_cond, &io_lock);
+        if (io_taken == io_pushed) break;
+
+        struct io_slot *s = &io_slots[io_taken++ % (unsigned long)io_depth];
+        // Slots checked by path are skipped, a reused slot may already be taken
+        if (s->state != SLOT_QUEUED) continue;
+        s->state = SLOT_READING;
+        pthread_mutex_unlock(&io_lock);
+        pool_read(s);
+        pthread_mutex_lock(&io_lock);
+        s->state = SLOT_DONE;
+        pthread_cond_broadcast(&io_done_cond);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return NULL;
+}
+
+// Function to prepare the engine before the walk
+void io_start(void) {
+    if (io_engine == IO_SYNC) return;
+    if (!io_wanted()) {
+        io_engine = IO_SYNC;    // Nothing to gain, every plugin reads by path
+        return;
+    }
+
+    io_slots = calloc(io_depth, sizeof(struct io_slot));
+    if (!io_slots) {
+        io_engine = IO_SYNC;
+        return;
+    }
+    for (int i = 0; i < io_depth; i++)
+        io_slots[i].fd = -1;    // Buffers come from the pool when files are pushed
+    io_head = io_cnt = 0;
+
+    if (io_engine == IO_URING && uring_setup((unsigned)io_depth) < 0) {
+        if (debug)
+            fprintf(stderr, "io_uring is not available (%s), using the thread pool\n", strerror(errno));
+        io_engine = IO_POOL;
+    }
+    if (io_engine == IO_POOL) {
+        io_thread_cnt = MIN(io_depth, 16);
+        io_threads = calloc(io_thread_cnt, sizeof(pthread_t));
+        io_pushed = io_taken = 0;
+        io_stop = 0;
+        int started = 0;
+        for (; io_threads && started < io_thread_cnt; started++)
+            if (pthread_create(&io_threads[started], NULL, pool_worker, NULL) != 0) break;
+        io_thread_cnt = started;
+        if (started == 0) {
+            fprintf(stderr, "pthread_create() failed, reading synchronously\n");
+            free(io_threads);
+            io_threads = NULL;
+            free(io_slots);
+            io_slots = NULL;
+            io_engine = IO_SYNC;
+        }
+    }
+}
+
+// Function to check the file at the head of the window once it is read
+static void io_complete_head(void) {
+    struct io_slot *s = &io_slots[io_head];
+
+    // Waiting for the engine counts as reading time
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (io_engine == IO_URING) {
+        while (s->state != SLOT_DONE) {
+            if (uring_enter(1) < 0) {
+                // The ring is unusable, let the plugins read the file themselves
+                s->by_path = 1;
+                break;
+            }
+            uring_reap();
+        }
+    } else if (!s->by_path) {
+        pthread_mutex_lock(&io_lock);
+        while (s->state != SLOT_DONE)
+            pthread_cond_wait(&io_done_cond, &io_lock);
+        pthread_mutex_unlock(&io_lock);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats_get()->read_ns += ts_diff(t0, t1);
+
+    struct file_view view;
+    view.map = NULL;
+    view.buf = NULL;
+    view.name = NULL;
+    view.state = 0;
+    if (!s->by_path) {
+        view.state = s->failed ? -1 : 1;
+        view.data = s->buf;
+        view.len = s->len;
+        struct stats *st = stats_get();
+        if (s->failed) st->read_errors++;
+        else st->bytes_read += s->len;
+    }
+    check_entry(s->level, s->path, &s->sb, &view);
+    view_release(&view);
+    pool_put(s->buf, IO_SLOT_SIZE);
+    s->buf = NULL;
+
+    free(s->path);
+    s->path = NULL;
+    s->state = SLOT_FREE;
+    io_head = (io_head + 1) % io_depth;
+    io_cnt--;
+}
+
+// Function to add a file from the walk to the read-ahead window
+void io_push(int level, const char *path, const struct stat *sb) {
+    if (out_stop) return;
+    // The slot keeps its own copy of the path, without one the file is not queued
+    char *copy = strdup(path);
+    if (!copy) {
+        fprintf(stderr, "strdup() failed for %s: %s\n", path, strerror(errno));
+        stats_get()->read_errors++;
+        return;
+    }
+    if (io_cnt == io_depth) io_complete_head();
+
+    int slot = (io_head + io_cnt) % io_depth;
+    struct io_slot *s = &io_slots[slot];
+    s->path = copy;
+    s->level = level;
+    s->fd = -1;
+    s->failed = 0;
+    s->len = 0;
+    s->size = (size_t)sb->st_size;
+    s->sb = *sb;
+    // Files answered from the index are not read at all
+    s->by_path = !S_ISREG(sb->st_mode) || sb->st_size > IO_SLOT_SIZE ||
+                 (index_complete && index_lookup(sb)) || meta_decided(path, sb);
+
+    // Only files the engine reads take a buffer; when the pool has none the
+    // window holds them, so its oldest files are checked to give them back
+    s->buf = NULL;
+    while (!s->by_path && !(s->buf = pool_get(IO_SLOT_SIZE))) {
+        if (io_cnt == 0) {
+            s->by_path = 1;
+            break;
+        }
+        io_complete_head();
+    }
+    io_cnt++;
+
+    if (io_engine == IO_POOL) {
+        // Workers take slots by sequence number, so skipped slots are numbered too
+        pthread_mutex_lock(&io_lock);
+        s->state = s->by_path ? SLOT_DONE : SLOT_QUEUED;
+        io_pushed++;
+        if (!s->by_path) pthread_cond_signal(&io_job_cond);
+        pthread_mutex_unlock(&io_lock);
+    } else if (s->by_path) {
+        s->state = SLOT_DONE;
+    } else {
+        s->state = SLOT_OPENING;
+        uring_queue(slot);
+        if (uring_enter(0) < 0) s->by_path = 1;
+    }
+}
+
+// Function to check the remaining files and stop the engine after the walk
+void io_finish(void) {
+    if (io_engine == IO_SYNC) return;
+    while (io_cnt > 0) io_complete_head();
+
+    if (io_engine == IO_URING) {
+        uring_close();
+    } else {
+        pthread_mutex_lock(&io_lock);
+        io_stop = 1;
+        pthread_cond_broadcast(&io_job_cond);
+        pthread_mutex_unlock(&io_lock);
+        for (int i = 0; i < io_thread_cnt; i++) pthread_join(io_threads[i], NULL);
+        free(io_threads);
+        io_threads = NULL;
+    }
+    free(io_slots);
+    io_slots = NULL;
+}
+
+
+/*
+    Content index (--index, --index-build, --index-update, --index-verify).
+
+    The index file holds a header and one index_record per regular file,
+    sorted by (dev, ino). A record is valid while the size, mtime and ctime
+    of the file are the same as when it was read; for such files plugins that
+    export plugin_process_presence() are answered from the record and the
+    file is not read. --index-update reuses the valid records of an existing
+    index and reads only new and changed files.
+
+    After the file records come directory summaries, also sorted by (dev,
+    ino): the record of a directory holds its own stamps and the union of the
+    byte sets of all files below it. A directory with a file the index could
+    not describe has no summary. Answers "does not match" of
+    plugin_process_presence() hold for every subset of the bytes, so with
+    --prune a subtree whose union is rejected by the expression is skipped
+    without being read. Before that the subtree is checked with fstatat()
+    only: every directory below must still have a valid summary and every
+    file a valid record, so an entry added, removed or renamed anywhere
+    below, or a file rewritten in place, keeps the subtree from being
+    pruned until the next --index-update brings the index up to date.
+    Directories below it may still be pruned on their own. -N shows the
+    files that do not match, so nothing is pruned with it, and summaries
+    hold the bytes of compressed files as they are on disk, so nothing is
+    pruned with --decompress either.
+*/
+
+#define INDEX_MAGIC "L1SDSIDX"
+#define INDEX_VERSION 2
+
+// Header of the index file
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t dir_count;     // Directory summaries after the file records
+};
+
+static void *index_map = NULL;              // mmap()ed index file
+static size_t index_map_len = 0;
+static const struct index_record *index_recs = NULL;
+static size_t index_cnt = 0;
+static const struct index_record *index_dirs = NULL;   // Directory summaries
+static size_t index_dir_cnt = 0;
+static const char *index_map_path = NULL;   // Path index_map was opened from
+
+// Records collected by the build walk
+static struct index_record *build_recs = NULL;
+static size_t build_cnt = 0, build_cap = 0;
+static size_t build_reused = 0, build_read = 0, build_failed = 0;
+static struct index_record *build_dirs = NULL;
+static size_t build_dir_cnt = 0, build_dir_cap = 0;
+static uint64_t (*sum_acc)[4] = NULL;       // Union of the bytes below the open directory of every level
+static int *sum_unknown = NULL;             // The directory of the level has a file without a record
+static int sum_cap = 0;
+static size_t verify_stale = 0, verify_missing = 0, verify_bad = 0;
+
+// Function to compare records by (dev, ino)
+static int index_cmp(const void *a, const void *b) {
+    const struct index_record *x = a, *y = b;
+    if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+// Function to fill the metadata part of a record from stat data
+static void index_fill(struct index_record *r, const struct stat *sb) {
+    memset(r, 0, sizeof(*r));
+    r->dev = (uint64_t)sb->st_dev;
+    r->ino = (uint64_t)sb->st_ino;
+    r->size = (int64_t)sb->st_size;
+    r->mtime_sec = (int64_t)sb->st_mtim.tv_sec;
+    r->mtime_nsec = (int64_t)sb->st_mtim.tv_nsec;
+    r->ctime_sec = (int64_t)sb->st_ctim.tv_sec;
+    r->ctime_nsec = (int64_t)sb->st_ctim.tv_nsec;
+}
+
+// Function to check that a record still describes the file
+static int index_valid(const struct index_record *r, const struct stat *sb) {
+    struct index_record cur;
+    index_fill(&cur, sb);
+    return r->size == cur.size &&
+           r->mtime_sec == cur.mtime_sec && r->mtime_nsec == cur.mtime_nsec &&
+           r->ctime_sec == cur.ctime_sec && r->ctime_nsec == cur.ctime_nsec;
+}
+
+// Function to find the record of a file, NULL if there is none or it is stale
+const struct index_record *index_lookup(const struct stat *sb) {
+    if (!index_recs || !S_ISREG(sb->st_mode)) return NULL;
+
+    struct index_record key;
+    key.dev = (uint64_t)sb->st_dev;
+    key.ino = (uint64_t)sb->st_ino;
+    const struct index_record *r = bsearch(&key, index_recs, index_cnt,
+                                           sizeof(struct index_record), index_cmp);
+    if (!r || !index_valid(r, sb)) return NULL;
+    return r;
+}
+
+// Function to find the summary of a directory, NULL if there is none or it is stale
+static const struct index_record *index_lookup_dir(const struct stat *sb) {
+    if (!index_dirs || !S_ISDIR(sb->st_mode)) return NULL;
+
+    struct index_record key;
+    key.dev = (uint64_t)sb->st_dev;
+    key.ino = (uint64_t)sb->st_ino;
+    const struct index_record *r = bsearch(&key, index_dirs, index_dir_cnt,
+                                           sizeof(struct index_record), index_cmp);
+    if (!r || !index_valid(r, sb)) return NULL;
+    return r;
+}
+
+// Function to check that nothing below a directory changed since its summary was made
+static int index_subtree_valid(int dirfd, const char *name) {
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return 0;
+    DIR *d = fdopendir(fd);
+    if (!d) {
+        close(fd);
+        return 0;
+    }
+    int valid = 1;
+    struct dirent *de;
+    while (valid && (de = readdir(d)) != NULL) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")) continue;
+        struct stat sb;
+        if (fstatat(fd, de->d_name, &sb, AT_SYMLINK_NOFOLLOW) < 0) {
+            valid = 0;
+        } else if (S_ISLNK(sb.st_mode)) {
+            // Searches never check links, the summary does not cover them
+        } else if (S_ISDIR(sb.st_mode)) {
+            valid = index_lookup_dir(&sb) && index_subtree_valid(fd, de->d_name);
+        } else {
+            valid = index_lookup(&sb) != NULL;
+        }
+    }
+    closedir(d);
+    return valid;
+}
+
+// Function to check whether the summary of a directory rules out every file below it
+int index_prunes(int dirfd, const char *name, const struct stat *sb) {
+    if (!prune_active || !sb) return 0;
+    const struct index_record *r = index_lookup_dir(sb);
+    if (!r) return 0;
+
+    // With 'and' one plugin that rejects the union is enough, with 'or' all must
+    int used = 0, rejected = 0;
+    for (int i = 0; i < plug_cnt; i++) {
+        if (plugins[i].in_opts_len == 0) continue;
+        used++;
+        if (plugins[i].query && plugins[i].ppr && plugins[i].ppr(plugins[i].query, r->presence) > 0) {
+            rejected++;
+            if (!or) break;
+        }
+    }
+    if (rejected == 0 || (or && rejected < used)) return 0;
+    if (!index_subtree_valid(dirfd, name)) return 0;
+    stats_get()->pruned++;
+    return 1;
+}
+
+// Function to compute the set of bytes occurring in a file
+static int index_read_presence(const char *path, uint64_t presence[4]) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    // Mark bytes in a byte array: stores to it do not depend on each other
+    unsigned char seen[256] = {0};
+    unsigned char buf[128 * 1024];
+    int distinct = 0;
+    for (;;) {
+        ssize_t t = read(fd, buf, sizeof(buf));
+        if (t < 0 && errno == EINTR) continue;
+        if (t < 0) {
+            close(fd);
+            return -1;
+        }
+        if (t == 0) break;
+        for (ssize_t i = 0; i < t; i++) seen[buf[i]] = 1;
+
+        // Stop once every byte value occurred
+        distinct = 0;
+        for (int b = 0; b < 256; b++) distinct += seen[b];
+        if (distinct == 256) break;
+    }
+    close(fd);
+
+    memset(presence, 0, 4 * sizeof(uint64_t));
+    for (int b = 0; b < 256; b++)
+        if (seen[b]) presence[b >> 6] |= 1ULL << (b & 63);
+    return 0;
+}
+
+// Function to map an index file, returns -1 if it is missing or damaged
+static int index_map_file(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(struct index_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const struct index_header *h = map;
+    if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 || h->version != INDEX_VERSION ||
+        h->record_size != sizeof(struct index_record) ||
+        h->count > ((size_t)sb.st_size - sizeof(*h)) / sizeof(struct index_record) ||
+        h->dir_count > ((size_t)sb.st_size - sizeof(*h)) / sizeof(struct index_record) - h->count) {
+        munmap(map, (size_t)sb.st_size);
+        errno = EINVAL;
+        return -1;
+    }
+    index_map = map;
+    index_map_len = (size_t)sb.st_size;
+    index_recs = (const struct index_record *)(h + 1);
+    index_cnt = (size_t)h->count;
+    index_dirs = index_recs + index_cnt;
+    index_dir_cnt = (size_t)h->dir_count;
+    return 0;
+}
+
+// Function to open the index given with --index before the walk
+void index_open(void) {
+    if (prune && !index_path) fprintf(stderr, "--prune needs an --index\n");
+    if (!index_path) return;
+    // The server maps its index once, queries that name another one replace it
+    if (index_map && strcmp(index_path, index_map_path) != 0) index_close();
+    if (!index_map && index_map_file(index_path) < 0) {
+        fprintf(stderr, "Cannot use index %s: %s\n", index_path, strerror(errno));
+        index_path = NULL;
+        return;
+    }
+    index_map_path = index_path;
+
+    index_complete = 1;
+    for (int i = 0; i < plug_cnt; i++) {
+        if (plugins[i].in_opts_len > 0 && !(plugins[i].query && plugins[i].ppr))
+            index_complete = 0;
+    }
+    prune_active = prune && !not && !decompress && index_dir_cnt > 0;
+    if (prune && not) fprintf(stderr, "--prune does nothing with -N\n");
+    if (prune && decompress) fprintf(stderr, "--prune does nothing with --decompress\n");
+}
+
+// Function to unmap the index
+void index_close(void) {
+    if (index_map) munmap(index_map, index_map_len);
+    index_map = NULL;
+    index_recs = NULL;
+    index_cnt = 0;
+    index_dirs = NULL;
+    index_dir_cnt = 0;
+    prune_active = 0;
+}
+
+// Function to add the summary of a directory whose entries were all visited
+static int index_sum_dir(const struct stat *sb, int level) {
+    if (level > 0) {
+        for (int w = 0; w < 4; w++) sum_acc[level - 1][w] |= sum_acc[level][w];
+        sum_unknown[level - 1] |= sum_unknown[level];
+    }
+    if (!sum_unknown[level]) {
+        if (build_dir_cnt == build_dir_cap) {
+            build_dir_cap = build_dir_cap ? build_dir_cap * 2 : 256;
+            struct index_record *tmp = realloc(build_dirs, build_dir_cap * sizeof(struct index_record));
+            if (!tmp) {
+                fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+                return -1;
+            }
+            build_dirs = tmp;
+        }
+        struct index_record *r = &build_dirs[build_dir_cnt++];
+        index_fill(r, sb);
+        memcpy(r->presence, sum_acc[level], sizeof(r->presence));
+    }
+    // The next directory of this level starts empty
+    memset(sum_acc[level], 0, sizeof(sum_acc[level]));
+    sum_unknown[level] = 0;
+    return 0;
+}
+
+// Function to add one file to the index being built
+static int index_build_func(const char *fpath, const struct stat *sb,
+                            int typeflag, struct FTW *ftwbuf) {
+    int level = ftwbuf->level;
+    if (level >= sum_cap) {
+        int cap = sum_cap ? sum_cap * 2 : 16;
+        while (cap <= level) cap *= 2;
+        uint64_t (*acc)[4] = realloc(sum_acc, cap * sizeof(*sum_acc));
+        if (acc) sum_acc = acc;
+        int *unknown = realloc(sum_unknown, cap * sizeof(int));
+        if (unknown) sum_unknown = unknown;
+        if (!acc || !unknown) {
+            fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+            return -1;
+        }
+        memset(sum_acc + sum_cap, 0, (cap - sum_cap) * sizeof(*sum_acc));
+        memset(sum_unknown + sum_cap, 0, (cap - sum_cap) * sizeof(int));
+        sum_cap = cap;
+    }
+    if (typeflag == FTW_DP) return index_sum_dir(sb, level);
+    if (typeflag == FTW_SL || typeflag == FTW_SLN) return 0;   // Searches never check links
+    if (!sb || typeflag != FTW_F || !S_ISREG(sb->st_mode)) {
+        // Searches give such entries to the plugins, the directory is never ruled out
+        if (level > 0) sum_unknown[level - 1] = 1;
+        return 0;
+    }
+
+    if (build_cnt == build_cap) {
+        build_cap = build_cap ? build_cap * 2 : 1024;
+        struct index_record *tmp = realloc(build_recs, build_cap * sizeof(struct index_record));
+        if (!tmp) {
+            fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+            return -1;
+        }
+        build_recs = tmp;
+    }
+
+    // Reuse the record of an unchanged file when updating
+    struct index_record *r = &build_recs[build_cnt];
+    const struct index_record *old = index_cmd == INDEX_UPDATE ? index_lookup(sb) : NULL;
+    if (old) {
+        *r = *old;
+        build_reused++;
+    } else {
+        index_fill(r, sb);
+        if (index_read_presence(fpath, r->presence) < 0) {
+            fprintf(stderr, "Cannot read %s: %s\n", fpath, strerror(errno));
+            build_failed++;
+            if (level > 0) sum_unknown[level - 1] = 1;
+            return 0;
+        }
+        build_read++;
+    }
+    if (level > 0) {
+        for (int w = 0; w < 4; w++) sum_acc[level - 1][w] |= r->presence[w];
+    }
+    build_cnt++;
+    return 0;
+}
+
+// Function to compare a file with its record
+static int index_verify_func(const char *fpath, const struct stat *sb,
+                             int typeflag, struct FTW *ftwbuf) {
+    (void)ftwbuf;
+    if (!sb || typeflag != FTW_F || !S_ISREG(sb->st_mode)) return 0;
+
+    struct index_record key;
+    key.dev = (uint64_t)sb->st_dev;
+    key.ino = (uint64_t)sb->st_ino;
+    const struct index_record *r = bsearch(&key, index_recs, index_cnt,
+                                           sizeof(struct index_record), index_cmp);
+    if (!r) {
+        verify_missing++;
+        return 0;
+    }
+    if (!index_valid(r, sb)) {
+        verify_stale++;
+        return 0;
+    }
+
+    uint64_t presence[4];
+    if (index_read_presence(fpath, presence) < 0) {
+        fprintf(stderr, "Cannot read %s: %s\n", fpath, strerror(errno));
+        return 0;
+    }
+    if (memcmp(presence, r->presence, sizeof(presence)) != 0) {
+        printf("Index record does not match contents: %s\n", fpath);
+        verify_bad++;
+    }
+    return 0;
+}
+
+// Function to write the collected records to the index file atomically
+static int index_write(const char *path) {
+    qsort(build_recs, build_cnt, sizeof(struct index_record), index_cmp);
+
+    // A file may be seen twice through hard links, keep one record per inode
+    size_t uniq = 0;
+    for (size_t i = 0; i < build_cnt; i++) {
+        if (uniq == 0 || index_cmp(&build_recs[uniq - 1], &build_recs[i]) != 0)
+            build_recs[uniq++] = build_recs[i];
+    }
+    build_cnt = uniq;
+    qsort(build_dirs, build_dir_cnt, sizeof(struct index_record), index_cmp);
+    uniq = 0;
+    for (size_t i = 0; i < build_dir_cnt; i++) {
+        if (uniq == 0 || index_cmp(&build_dirs[uniq - 1], &build_dirs[i]) != 0)
+            build_dirs[uniq++] = build_dirs[i];
+    }
+    build_dir_cnt = uniq;
+
+    size_t tlen = strlen(path) + 5;
+    char *tmp = malloc(tlen);
+    if (!tmp) return -1;
+    snprintf(tmp, tlen, "%s.tmp", path);
+
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        fprintf(stderr, "fopen() failed for %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+    struct index_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, INDEX_MAGIC, 8);
+    h.version = INDEX_VERSION;
+    h.record_size = sizeof(struct index_record);
+    h.count = build_cnt;
+    h.dir_count = build_dir_cnt;
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(build_recs, sizeof(struct index_record), build_cnt, f) == build_cnt &&
+             fwrite(build_dirs, sizeof(struct index_record), build_dir_cnt, f) == build_dir_cnt;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, path) < 0) {
+        fprintf(stderr, "Cannot write index %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+// Function to run an index maintenance command on a directory
+int index_run(const char *dir) {
+    int res = 0;
+
+    if (index_cmd == INDEX_UPDATE && index_map_file(index_path) < 0) {
+        // Nothing to reuse, build the index from scratch
+        if (debug)
+            fprintf(stderr, "No usable index at %s, building a new one\n", index_path);
+    }
+    if (index_cmd == INDEX_VERIFY) {
+        if (index_map_file(index_path) < 0) {
+            fprintf(stderr, "Cannot open index %s: %s\n", index_path, strerror(errno));
+            return -1;
+        }
+        for (size_t i = 1; i < index_cnt; i++) {
+            if (index_cmp(&index_recs[i - 1], &index_recs[i]) >= 0) {
+                printf("Index records are not sorted at record %zu\n", i);
+                verify_bad++;
+                break;
+            }
+        }
+        if (nftw(dir, index_verify_func, 10, FTW_PHYS) < 0)
+            fprintf(stderr, "ntfw() failed: %s\n", strerror(errno));
+        printf("Index %s: %zu records, %zu stale, %zu files missing, %zu bad\n",
+               index_path, index_cnt, verify_stale, verify_missing, verify_bad);
+        index_close();
+        return verify_bad > 0 ? -1 : 0;
+    }
+
+    // Directories are reported after their entries, when their summary is complete
+    if (nftw(dir, index_build_func, 10, FTW_PHYS | FTW_DEPTH) < 0) {
+        fprintf(stderr, "ntfw() failed: %s\n", strerror(errno));
+        res = -1;
+    }
+    index_close();
+    if (res == 0) res = index_write(index_path);
+    if (res == 0)
+        printf("Index %s: %zu files, %zu read, %zu reused, %zu unreadable, %zu directory summaries\n",
+               index_path, build_cnt, build_read, build_reused, build_failed, build_dir_cnt);
+    free(build_recs);
+    build_recs = NULL;
+    build_cnt = build_cap = 0;
+    free(build_dirs);
+    build_dirs = NULL;
+    build_dir_cnt = build_dir_cap = 0;
+    free(sum_acc);
+    free(sum_unknown);
+    sum_acc = NULL;
+    sum_unknown = NULL;
+    sum_cap = 0;
+    return res;
+}
+
+
+/*
+    Batches (--batch N).
+
+    The serial walk collects files into batches of batch_size. A batch is
+    checked plugin by plugin in the evaluation order: a plugin that exports
+    plugin_process_files() gets all files of the batch that are still
+    undecided in one call, other plugins are called per file. Found files
+    are printed in walk order once the whole batch is decided.
+
+    With --schedule the batch is a window of --window files that is read in
+    disk order instead of walk order. The regular files of the window are
+    opened and sorted by device and inode number, or by the physical offset
+    of their first extent from FIEMAP. Files whose extents are unknown
+    (tmpfs, inline data, FIEMAP not supported) follow in inode order. The
+    start of every file is then hinted with POSIX_FADV_WILLNEED in that
+    order, so the kernel queues the reads sorted, and the plugins check the
+    files in the same order through the open descriptors.
+*/
+
+#define SCHED_HINT_SIZE (512 * 1024)    // Start of a file hinted by --schedule
+
+// File waiting in a batch
+struct batch_entry {
+    char *path;                 // Path of the file (owned)
+    int level;                  // Depth reported by nftw()
+    struct stat sb;             // Stat data from the walk
+    int decided;                // A plugin already decided the expression
+    int matched;                // Value of the expression without -N
+    int last;                   // Result of the last plugin call
+    uint64_t hits;              // Plugins that matched
+    struct file_view *view;     // Contents shared by buffer plugins, allocated on demand
+    struct report_buf report;   // Plugin reports about the file
+    struct dedupe_entry *dedupe;    // Verdicts shared with aliases (--dedupe)
+    size_t report_mark;         // Length of the reports before the batch call
+    int deferred;               // Waits for an alias checked by the same batch call
+    struct stream_verdicts stream;  // Verdicts of the stream plugins (--decompress)
+    int fd;                     // Opened for --schedule, -1 if not
+    int sched_class;            // 0 - key is a physical offset, 1 - an inode number
+    uint64_t sched_key;         // Position of the file on its device
+};
+
+static struct batch_entry *batch = NULL;
+static int batch_cnt = 0;
+static const char **batch_names = NULL;     // Arguments of one batch call
+static int *batch_idx = NULL, *batch_res = NULL;
+static struct report_buf **batch_reports = NULL;
+static int *batch_fds = NULL;               // Descriptors of the files of a batch call
+static int *batch_order = NULL;             // Entries in the order they are checked
+static unsigned long batch_calls = 0;       // Batch calls made so far
+
+// Function to add a file from the walk to the current batch
+void batch_push(int level, const char *path, const struct stat *sb) {
+    if (out_stop) return;
+    if (!batch) {
+        batch = calloc(batch_size, sizeof(struct batch_entry));
+        batch_names = calloc(batch_size, sizeof(char *));
+        batch_idx = calloc(batch_size, sizeof(int));
+        batch_res = calloc(batch_size, sizeof(int));
+        batch_reports = calloc(batch_size, sizeof(struct report_buf *));
+        batch_fds = calloc(batch_size, sizeof(int));
+        batch_order = calloc(batch_size, sizeof(int));
+        if (!batch || !batch_names || !batch_idx || !batch_res || !batch_reports ||
+            !batch_fds || !batch_order) {
+            fprintf(stderr, "calloc() failed: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct batch_entry *e = &batch[batch_cnt];
+    e->path = strdup(path);
+    if (!e->path) {
+        print_entry(level, FTW_F, path, sb);    // Out of memory, check it alone
+        return;
+    }
+    e->level = level;
+    e->sb = *sb;
+    e->view = NULL;
+    e->report.len = 0;
+    e->stream.state = 0;
+    e->fd = -1;
+    if (++batch_cnt == batch_size) batch_flush();
+}
+
+// Function to record a plugin result for a batch entry
+static void batch_decide(struct batch_entry *e, int res) {
+    e->last = res;
+    // An error counts as a mismatch
+    if ((res == 0) == or) {
+        e->decided = 1;
+        e->matched = or;
+    }
+}
+
+// Function to call plugin i on a file of the batch by itself
+static void batch_call_one(int i, struct batch_entry *e, const struct index_record *rec) {
+    if (!e->view) {
+        e->view = malloc(sizeof(struct file_view));
+        if (!e->view) {
+            batch_decide(e, -1);
+            return;
+        }
+        e->view->state = 0;
+        e->view->map = NULL;
+        e->view->buf = NULL;
+        e->view->name = NULL;
+    }
+    tl_report_dst = &e->report;
+    tl_dedupe = e->dedupe;
+    tl_stream = &e->stream;
+    batch_decide(e, plugin_call(i, e->path, &e->sb, rec, e->view));
+    tl_report_dst = NULL;
+    tl_dedupe = NULL;
+    tl_stream = NULL;
+}
+
+// Function to get the physical offset of the first extent of a file
+static int sched_extent(int fd, uint64_t *phys) {
+    uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t) + 1];
+    struct fiemap *fm = (struct fiemap *)buf;
+    memset(buf, 0, sizeof(buf));
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, fm) < 0 || fm->fm_mapped_extents == 0)
+        return -1;
+    // Such extents have no place on the disk yet or share a block with metadata
+    if (fm->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                                       FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED))
+        return -1;
+    *phys = fm->fm_extents[0].fe_physical;
+    return 0;
+}
+
+static int sched_cmp(const void *a, const void *b) {
+    const struct batch_entry *x = &batch[*(const int *)a], *y = &batch[*(const int *)b];
+    if (x->sb.st_dev != y->sb.st_dev) return x->sb.st_dev < y->sb.st_dev ? -1 : 1;
+    if (x->sched_class != y->sched_class) return x->sched_class - y->sched_class;
+    if (x->sched_key != y->sched_key) return x->sched_key < y->sched_key ? -1 : 1;
+    return *(const int *)a - *(const int *)b;
+}
+
+// Function to choose the order the files of the batch are checked in
+static void sched_order(void) {
+    for (int j = 0; j < batch_cnt; j++) batch_order[j] = j;
+    // Files answered by the index are not read at all
+    if (schedule == SCHED_WALK || index_complete) return;
+
+    long opened = 0;
+    for (int j = 0; j < batch_cnt; j++) {
+        struct batch_entry *e = &batch[j];
+        e->sched_class = 1;
+        e->sched_key = e->sb.st_ino;
+        // Opening a FIFO or a device may block, they stay in walk order
+        if (!S_ISREG(e->sb.st_mode) || e->sb.st_size == 0 || opened >= sched_fd_max) continue;
+        e->fd = open(e->path, O_RDONLY | O_CLOEXEC);
+        if (e->fd >= 0) opened++;
+        if (e->fd >= 0 && schedule == SCHED_EXTENT && sched_extent(e->fd, &e->sched_key) == 0)
+            e->sched_class = 0;
+    }
+    qsort(batch_order, batch_cnt, sizeof(int), sched_cmp);
+
+    // The hints queue the reads in disk order before the first plugin asks
+    for (int j = 0; j < batch_cnt; j++) {
+        struct batch_entry *e = &batch[batch_order[j]];
+        if (e->fd >= 0) posix_fadvise(e->fd, 0, SCHED_HINT_SIZE, POSIX_FADV_WILLNEED);
+    }
+}
+
+// Function to decide a batch entry with the verdict of an alias, returns 0 if there is none
+static int batch_take(int i, struct batch_entry *e) {
+    int cached;
+    if (!e->dedupe) return 0;
+    // The batch call opens the file itself, so it is sampled with pread()
+    dedupe_resolve(e->dedupe, e->path, NULL);
+    if (!dedupe_get(e->dedupe, i, &e->report, &cached)) return 0;
+    if (cached == 0 && i < 64) e->hits |= 1ULL << i;
+    batch_decide(e, cached);
+    return 1;
+}
+
+// Function to check all files of the batch and print the found ones
+void batch_flush(void) {
+    if (batch_cnt == 0) return;
+
+    for (int j = 0; j < batch_cnt; j++) {
+        batch[j].decided = 0;
+        batch[j].matched = !or;
+        batch[j].hits = 0;
+    }
+    sched_order();
+    for (int jj = 0; jj < batch_cnt; jj++) {
+        struct batch_entry *e = &batch[batch_order[jj]];
+        e->dedupe = dedupe_find(e->path, &e->sb);
+    }
+
+    const int *order = eval_order();
+    for (int k = 0; k < plug_cnt; k++) {
+        int i = order ? order[k] : k;
+        if (plugins[i].in_opts_len == 0) continue;
+
+        // Files the index answers and plugins without a batch call go one by one,
+        // aliases of a file in the call wait for its verdict
+        int m = 0, deferred = 0;
+        batch_calls++;
+        for (int jj = 0; jj < batch_cnt; jj++) {
+            int j = batch_order[jj];
+            batch[j].deferred = 0;
+            if (batch[j].decided) continue;
+            if (meta_rejects(i, batch[j].path, &batch[j].sb)) {
+                batch_decide(&batch[j], 1);
+                continue;
+            }
+            const struct index_record *rec = index_lookup(&batch[j].sb);
+            // Compressed files are decoded by the host, not read by the batch call
+            int stream = decompress && plugins[i].psb && batch[j].stream.state != 1 &&
+                         (batch[j].stream.state == 2 || dec_codec_path(batch[j].path) != CODEC_NONE);
+            if (stream || (rec && plugins[i].query && plugins[i].ppr) || !plugins[i].query || !plugins[i].pbf) {
+                batch_call_one(i, &batch[j], rec);
+                if (batch[j].last == 0 && i < 64) batch[j].hits |= 1ULL << i;
+            } else if (batch_take(i, &batch[j])) {
+                // Checked before as another path
+            } else if (batch[j].dedupe && dedupe_canon(batch[j].dedupe)->batch_call == batch_calls) {
+                batch[j].deferred = 1;
+                deferred++;
+            } else {
+                if (batch[j].dedupe) dedupe_canon(batch[j].dedupe)->batch_call = batch_calls;
+                batch_names[m] = batch[j].path;
+                batch_reports[m] = &batch[j].report;
+                batch[j].report_mark = batch[j].report.len;
+                // An earlier plugin may have read the descriptor to the end
+                batch_fds[m] = batch[j].fd >= 0 && lseek(batch[j].fd, 0, SEEK_SET) == 0 ? batch[j].fd : -1;
+                batch_idx[m++] = j;
+            }
+        }
+        if (m == 0) continue;
+
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        tl_report_plugin = i;
+        tl_report_files = batch_reports;
+        tl_report_cnt = m;
+        if (plugins[i].pbf(plugins[i].query, batch_names, schedule != SCHED_WALK ? batch_fds : NULL, m, batch_res) < 0) {
+            int err = errno;
+            for (int j = 0; j < m; j++) batch_res[j] = -err;
+        }
+        tl_report_files = NULL;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+
+        unsigned long matches = 0;
+        for (int j = 0; j < m; j++) {
+            if (batch_res[j] < 0) plugin_error(i, -batch_res[j]);
+            if (batch_res[j] == 0) matches++;
+            struct batch_entry *e = &batch[batch_idx[j]];
+            if (batch_res[j] == 0 && i < 64) e->hits |= 1ULL << i;
+            batch_decide(e, batch_res[j]);
+            if (e->dedupe)
+                dedupe_put(e->dedupe, i, batch_res[j], &e->report, e->report_mark);
+        }
+        eval_account(i, m, matches, t0, t1);
+
+        // An alias whose file failed is checked by itself
+        for (int j = 0; deferred > 0 && j < batch_cnt; j++) {
+            if (!batch[j].deferred || batch_take(i, &batch[j])) continue;
+            batch_call_one(i, &batch[j], NULL);
+            if (batch[j].last == 0 && i < 64) batch[j].hits |= 1ULL << i;
+        }
+    }
+
+    // Print found files in walk order
+    struct stats *st = stats_get();
+    st->files += batch_cnt;
+    for (int j = 0; j < batch_cnt; j++) {
+        struct batch_entry *e = &batch[j];
+        if (e->matched != not && !out_stop)
+            emit_found(e->level, e->path, e->hits, &e->report);
+        if (e->view) {
+            view_release(e->view);
+            free(e->view);
+        }
+        if (e->fd >= 0) close(e->fd);
+        free(e->path);
+    }
+    batch_cnt = 0;
+    scratch_reset();
+}
+
+/*
+    Merging shard results (--merge, --merge-stats).
+
+    With --shard i/N every process walks the subtrees whose names hash to i,
+    so N processes on any hosts that see the same tree cover it exactly once.
+    Each one writes its found files and --stats=json report to its own files.
+    --merge reads the found files of all shards, written with the --format
+    given to it, and prints them sorted by path, so the result does not
+    depend on the number of shards or on the order they finished in.
+    --merge-stats adds up the counters of the reports; the wall time and the
+    buffer pool peak of the merged report are the largest ones.
+*/
+
+// Found file read from a shard output
+struct merge_rec {
+    const char *rec;        // Whole record without its terminator
+    size_t len;
+    const char *key;        // Path the records are sorted by
+    size_t key_len;
+};
+
+// Number in a --stats=json report
+struct merge_num {
+    const char *at, *end;   // Text of the number in the report
+    unsigned long long val;
+    int is_max;             // Longest of the shards is taken instead of the sum
+};
+
+// Function to read a whole file, the contents are NUL-terminated
+static char *merge_read(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "fopen() failed for %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    char *buf = NULL;
+    size_t cap = 0, n = 0, r;
+    do {
+        if (cap - n < 64 * 1024 + 1) {
+            cap = cap ? cap * 2 : 128 * 1024;
+            char *nb = realloc(buf, cap);
+            if (!nb) {
+                fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = nb;
+        }
+        r = fread(buf + n, 1, cap - n - 1, f);
+        n += r;
+    } while (r > 0);
+    if (ferror(f)) {
+        fprintf(stderr, "fread() failed for %s\n", path);
+        free(buf);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
+
+// Function to find the path in a found file record of the current format
+static void merge_key(struct merge_rec *r) {
+    r->key = r->rec;
+    r->key_len = r->len;
+    if (out_format == FORMAT_TREE) {
+        const char *p = memmem(r->rec, r->len, "Found file: ", 12);
+        if (p) {
+            r->key = p + 12;
+            r->key_len = r->len - (size_t)(r->key - r->rec);
+        }
+    } else if (out_format == FORMAT_JSONL) {
+        // The escaped path is compared as it is, the order is still the same for every run
+        const char *p = memmem(r->rec, r->len, "\"path\": \"", 9);
+        if (p) {
+            const char *b = p + 9, *e = b, *end = r->rec + r->len;
+            while (e < end && *e != '"') e += (*e == '\\' && e + 1 < end) ? 2 : 1;
+            r->key = b;
+            r->key_len = (size_t)(e - b);
+        }
+    }
+}
+
+static int merge_cmp(const void *a, const void *b) {
+    const struct merge_rec *x = a, *y = b;
+    int res = memcmp(x->key, y->key, MIN(x->key_len, y->key_len));
+    if (res == 0 && x->key_len != y->key_len) res = x->key_len < y->key_len ? -1 : 1;
+    if (res == 0) res = memcmp(x->rec, y->rec, MIN(x->len, y->len));
+    if (res == 0 && x->len != y->len) res = x->len < y->len ? -1 : 1;
+    return res;
+}
+
+// Function to print the found files of all shard outputs sorted by path
+static int merge_output(int cnt, char *files[]) {
+    char sep = out_format == FORMAT_NUL ? '\0' : '\n';
+    char **bufs = calloc(cnt, sizeof(char *));
+    struct merge_rec *recs = NULL;
+    size_t recs_cnt = 0, recs_cap = 0;
+    int res = bufs ? 0 : -1;
+
+    for (int f = 0; f < cnt && res == 0; f++) {
+        size_t len;
+        if (!(bufs[f] = merge_read(files[f], &len))) {
+            res = -1;
+            break;
+        }
+        for (char *p = bufs[f], *end = bufs[f] + len; p < end; ) {
+            char *e = memchr(p, sep, (size_t)(end - p));
+            if (!e) e = end;    // Last record of a shard that was cut short
+            if (e > p) {
+                if (recs_cnt == recs_cap) {
+                    recs_cap = recs_cap ? recs_cap * 2 : 1024;
+                    struct merge_rec *nr = realloc(recs, recs_cap * sizeof(struct merge_rec));
+                    if (!nr) {
+                        fprintf(stderr, "realloc() failed: %s\n", strerror(errno));
+                        res = -1;
+                        break;
+                    }
+                    recs = nr;
+                }
+                recs[recs_cnt].rec = p;
+                recs[recs_cnt].len = (size_t)(e - p);
+                merge_key(&recs[recs_cnt++]);
+            }
+            p = e + 1;
+        }
+    }
+
+    if (res == 0) {
+        qsort(recs, recs_cnt, sizeof(struct merge_rec), merge_cmp);
+        for (size_t i = 0; i < recs_cnt; i++) {
+            out_put(recs[i].rec, recs[i].len);
+            out_put(&sep, 1);
+        }
+        out_flush();
+    }
+
+    for (int f = 0; bufs && f < cnt; f++) free(bufs[f]);
+    free(bufs);
+    free(recs);
+    return res;
+}
+
+// Function to find the numbers of a --stats=json report, returns their count
+static size_t merge_numbers(const char *s, struct merge_num **out) {
+    struct merge_num *nums = NULL;
+    size_t cnt = 0, cap = 0;
+    const char *key = "";
+    size_t key_len = 0;
+
+    for (const char *c = s; *c && *c != '\n'; ) {
+        if (*c == '"') {
+            // Digits inside strings (plugin purposes) are not counters
+            const char *b = ++c;
+            while (*c && *c != '"') c += (*c == '\\' && c[1]) ? 2 : 1;
+            key = b;
+            key_len = (size_t)(c - b);
+            if (*c) c++;
+        } else if (*c >= '0' && *c <= '9') {
+            if (cnt == cap) {
+                cap = cap ? cap * 2 : 64;
+                struct merge_num *nn = realloc(nums, cap * sizeof(struct merge_num));
+                if (!nn) {
+                    free(nums);
+                    *out = NULL;
+                    return 0;
+                }
+                nums = nn;
+            }
+            char *end;
+            nums[cnt].val = strtoull(c, &end, 10);
+            nums[cnt].at = c;
+            nums[cnt].end = end;
+            nums[cnt].is_max = (key_len == 7 && !memcmp(key, "wall_ns", 7)) ||
+                               (key_len == 9 && !memcmp(key, "pool_peak", 9));
+            cnt++;
+            c = end;
+        } else {
+            c++;
+        }
+    }
+    *out = nums;
+    return cnt;
+}
+
+// Function to print the sum of the --stats=json reports of all shards
+static int merge_stats(int cnt, char *files[]) {
+    char **bufs = calloc(cnt, sizeof(char *));
+    struct merge_num *sum = NULL, *nums = NULL;
+    size_t sum_cnt = 0;
+    const char *report = NULL;
+    int res = bufs ? 0 : -1;
+
+    for (int f = 0; f < cnt && res == 0; f++) {
+        size_t len;
+        if (!(bufs[f] = merge_read(files[f], &len))) {
+            res = -1;
+            break;
+        }
+        // The report may follow other messages written to stderr
+        const char *r = strstr(bufs[f], "{\"wall_ns\"");
+        if (!r) {
+            fprintf(stderr, "No --stats=json report in %s\n", files[f]);
+            res = -1;
+            break;
+        }
+        if (f == 0) {
+            report = r;
+            sum_cnt = merge_numbers(r, &sum);
+            continue;
+        }
+        size_t n = merge_numbers(r, &nums);
+        if (n != sum_cnt) {
+            fprintf(stderr, "Reports in %s and %s have different plugins\n", files[0], files[f]);
+            res = -1;
+        }
+        for (size_t i = 0; res == 0 && i < n; i++) {
+            if (!sum[i].is_max) sum[i].val += nums[i].val;
+            else if (nums[i].val > sum[i].val) sum[i].val = nums[i].val;
+        }
+        free(nums);
+        nums = NULL;
+    }
+
+    if (res == 0) {
+        // The first report is printed with its numbers replaced by the merged ones
+        const char *p = report;
+        for (size_t i = 0; i < sum_cnt; i++) {
+            printf("%.*s%llu", (int)(sum[i].at - p), p, sum[i].val);
+            p = sum[i].end;
+        }
+        printf("%.*s\n", (int)strcspn(p, "\n"), p);
+    }
+
+    for (int f = 0; bufs && f < cnt; f++) free(bufs[f]);
+    free(bufs);
+    free(sum);
+    return res;
+}
+
+// Function to run --merge or --merge-stats on the given files
+int merge_run(int argc, char *argv[]) {
+    if (argc < 1) {
+        fprintf(stderr, "%s expects the files written by the shards\n",
+                merge_mode == MERGE_STATS ? "--merge-stats" : "--merge");
+        return -1;
+    }
+    return merge_mode == MERGE_STATS ? merge_stats(argc, argv) : merge_output(argc, argv);
+}
+
+/*
+    Watch mode (--watch).
+
+    Every directory of the tree gets an inotify watch before the first walk,
+    so changes made while it runs are not lost. The walk prints found files
+    as usual and keeps them in a set. Then the paths named by inotify events
+    are gathered in a bounded set of pending changes and checked again with
+    print_entry() after each read of the event queue: a file that starts to
+    match is printed as a match event, a matched file that changed, was
+    removed or moved away as an unmatch event. A new directory gets its
+    watches and all its files are checked. When the kernel queue or the
+    pending set overflows the tree is walked again and only the difference
+    to the old set is printed. Directories beyond fs.inotify.max_user_watches
+    are reported once and their changes are missed until a rescan.
+*/
+#define WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_MOVED_TO | \
+                    IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR)
+
+// Path kept in a watch set
+struct watch_file {
+    char *path;
+    int level;
+    uint64_t hits;          // Matched plugins for found files, IN_ISDIR for changes
+    struct watch_file *next;
+};
+
+// Hash set of paths
+struct watch_set {
+    struct watch_file **b;
+    size_t cap, cnt;        // cap is a power of two
+};
+
+// Watched directory, indexed by the inotify watch descriptor
+struct watch_dir {
+    char *path;
+    int level;
+};
+
+enum { WATCH_SCAN, WATCH_RESCAN, WATCH_EVENTS };
+static int watch_fd = -1;
+static int watch_phase = WATCH_SCAN;
+static struct watch_set watch_found_set, watch_next_set, watch_pending;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct watch_dir *watch_dirs = NULL;
+static int watch_dirs_cap = 0;
+static int watch_base_level = 0;    // Level of the directory nftw() starts from
+static int watch_check_files = 0;   // Check the files of directories being added
+static int watch_hit = 0;           // The file checked last was found
+static uint64_t watch_hits = 0;
+static int watch_full = 0;          // Out of watches, reported once
+static volatile sig_atomic_t watch_stop = 0;
+
+static void watch_check(const char *path, int level);
+
+// Function to find the link to a path in a watch set
+static struct watch_file **watch_set_find(struct watch_set *set, const char *path) {
+    if (set->cap == 0) return NULL;
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *c = path; *c; c++) h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    struct watch_file **p = &set->b[h & (set->cap - 1)];
+    while (*p && strcmp((*p)->path, path) != 0) p = &(*p)->next;
+    return p;
+}
+
+// Function to add a path to a watch set or update it, returns -1 if out of memory
+static int watch_set_put(struct watch_set *set, const char *path, int level, uint64_t hits) {
+    if (set->cnt >= set->cap) {
+        // Keep the load factor at most 1 by doubling the table
+        size_t cap = set->cap ? set->cap * 2 : 1024;
+        struct watch_file **b = calloc(cap, sizeof(struct watch_file *));
+        if (!b) return -1;
+        struct watch_set grown = {b, cap, set->cnt};
+        for (size_t i = 0; i < set->cap; i++) {
+            for (struct watch_file *f = set->b[i], *next; f; f = next) {
+                next = f->next;
+                struct watch_file **p = watch_set_find(&grown, f->path);
+                f->next = NULL;
+                *p = f;
+            }
+        }
+        free(set->b);
+        *set = grown;
+    }
+    struct watch_file **p = watch_set_find(set, path);
+    if (!*p) {
+        struct watch_file *f = calloc(1, sizeof(struct watch_file));
+        if (!f || !(f->path = strdup(path))) {
+            free(f);
+            return -1;
+        }
+        *p = f;
+        set->cnt++;
+    }
+    (*p)->level = level;
+    (*p)->hits |= hits;
+    return 0;
+}
+
+// Function to remove an entry from a watch set by its link
+static void watch_set_unlink(struct watch_set *set, struct watch_file **p) {
+    struct watch_file *f = *p;
+    *p = f->next;
+    free(f->path);
+    free(f);
+    set->cnt--;
+}
+
+static void watch_set_free(struct watch_set *set) {
+    for (size_t i = 0; i < set->cap; i++) {
+        while (set->b[i]) watch_set_unlink(set, &set->b[i]);
+    }
+    free(set->b);
+    memset(set, 0, sizeof(*set));
+}
+
+// Function to keep a found file, returns 1 if it must not be printed now
+static int watch_found(int level, const char *path, uint64_t hits) {
+    if (watch_phase == WATCH_EVENTS) {
+        watch_hit = 1;
+        watch_hits = hits;
+        return 1;
+    }
+    pthread_mutex_lock(&watch_lock);
+    struct watch_set *set = watch_phase == WATCH_SCAN ? &watch_found_set : &watch_next_set;
+    if (watch_set_put(set, path, level, hits) < 0)
+        fprintf(stderr, "Out of memory, changes of %s will not be reported\n", path);
+    pthread_mutex_unlock(&watch_lock);
+    return watch_phase == WATCH_RESCAN;
+}
+
+// Function to print a match or unmatch event
+static void watch_emit(int matched, int level, const char *path, uint64_t hits) {
+    switch (out_format) {
+        case FORMAT_NUL:
+            out_put(matched ? "+" : "-", 1);
+            out_put(path, strlen(path) + 1);
+            break;
+        case FORMAT_JSONL: {
+            char num[32];
+            out_put(matched ? "{\"event\": \"match\", \"path\": " : "{\"event\": \"unmatch\", \"path\": ",
+                    matched ? 27 : 29);
+            out_put_json(path);
+            out_put(", \"depth\": ", 11);
+            out_put(num, snprintf(num, sizeof(num), "%d", level));
+            if (matched) out_put_plugins(hits);
+            out_put("}\n", 2);
+            break;
+        }
+        default:
+            out_put(out_spaces, MIN(level, MAX_INDENT_LEVEL - 1));
+            if (matched) out_put("Matched file: ", 14);
+            else out_put("Unmatched file: ", 16);
+            out_put(path, strlen(path));
+            out_put("\n", 1);
+            break;
+    }
+}
+
+// Function to add the inotify watch of a directory, checking its files if asked
+static int watch_dir_func(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    int level = watch_base_level + ftwbuf->level;
+    if (watch_stop) return FTW_STOP;
+    if (shard_skip(fpath, level, typeflag == FTW_D))
+        return typeflag == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    if (typeflag == FTW_F && watch_check_files) {
+        watch_check(fpath, level);
+        return FTW_CONTINUE;
+    }
+    if (typeflag != FTW_D) return FTW_CONTINUE;
+
+    int wd = inotify_add_watch(watch_fd, fpath, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC && !watch_full) {
+            fprintf(stderr, "Out of inotify watches, raise fs.inotify.max_user_watches\n");
+            watch_full = 1;
+        }
+        return FTW_CONTINUE;
+    }
+    if (wd >= watch_dirs_cap) {
+        int cap = watch_dirs_cap ? watch_dirs_cap : 256;
+        while (cap <= wd) cap *= 2;
+        struct watch_dir *d = realloc(watch_dirs, cap * sizeof(struct watch_dir));
+        if (!d) return FTW_CONTINUE;
+        memset(d + watch_dirs_cap, 0, (cap - watch_dirs_cap) * sizeof(struct watch_dir));
+        watch_dirs = d;
+        watch_dirs_cap = cap;
+    }
+    // A directory moved inside the tree keeps its watch descriptor, only the path changes
+    free(watch_dirs[wd].path);
+    watch_dirs[wd].path = strdup(fpath);
+    watch_dirs[wd].level = level;
+    return FTW_CONTINUE;
+}
+
+// Function to add watches for a directory tree, level is the depth of its root
+static void watch_add_tree(const char *dir, int level, int check_files) {
+    watch_base_level = level;
+    watch_check_files = check_files;
+    nftw(dir, watch_dir_func, 10, FTW_PHYS | FTW_ACTIONRETVAL);
+}
+
+// Function to check a changed file again and print an event if its state changed
+static void watch_check(const char *path, int level) {
+    struct stat sb;
+    watch_hit = 0;
+    watch_hits = 0;
+    // Only regular files are opened, a FIFO would block the loop
+    if (lstat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+        print_entry(level, FTW_F, path, &sb);
+
+    struct watch_file **p = watch_set_find(&watch_found_set, path);
+    int was = p && *p;
+    if (watch_hit && !was) {
+        if (watch_set_put(&watch_found_set, path, level, watch_hits) == 0)
+            watch_emit(1, level, path, watch_hits);
+    } else if (!watch_hit && was) {
+        watch_emit(0, level, path, 0);
+        watch_set_unlink(&watch_found_set, p);
+    }
+}
+
+// Function to forget a directory that was removed or moved away
+static void watch_forget_dir(const char *path) {
+    size_t len = strlen(path);
+    for (size_t i = 0; i < watch_found_set.cap; i++) {
+        struct watch_file **p = &watch_found_set.b[i];
+        while (*p) {
+            if (!strncmp((*p)->path, path, len) && (*p)->path[len] == '/') {
+                watch_emit(0, (*p)->level, (*p)->path, 0);
+                watch_set_unlink(&watch_found_set, p);
+            } else {
+                p = &(*p)->next;
+            }
+        }
+    }
+    for (int wd = 0; wd < watch_dirs_cap; wd++) {
+        const char *d = watch_dirs[wd].path;
+        if (d && !strncmp(d, path, len) && (d[len] == '/' || d[len] == '\0')) {
+            inotify_rm_watch(watch_fd, wd);
+            free(watch_dirs[wd].path);
+            watch_dirs[wd].path = NULL;
+        }
+    }
+}
+
+// Function to walk the tree again and print only what changed since the last walk
+static void watch_rescan(const char *dir) {
+    watch_set_free(&watch_pending);
+    watch_add_tree(dir, 0, 0);
+    watch_phase = WATCH_RESCAN;
+    walk_dir(dir);
+    watch_phase = WATCH_EVENTS;
+
+    for (size_t i = 0; i < watch_found_set.cap; i++) {
+        for (struct watch_file *f = watch_found_set.b[i]; f; f = f->next) {
+            struct watch_file **p = watch_set_find(&watch_next_set, f->path);
+            if (!p || !*p) watch_emit(0, f->level, f->path, 0);
+        }
+    }
+    for (size_t i = 0; i < watch_next_set.cap; i++) {
+        for (struct watch_file *f = watch_next_set.b[i]; f; f = f->next) {
+            struct watch_file **p = watch_set_find(&watch_found_set, f->path);
+            if (!p || !*p) watch_emit(1, f->level, f->path, f->hits);
+        }
+    }
+    watch_set_free(&watch_found_set);
+    watch_found_set = watch_next_set;
+    memset(&watch_next_set, 0, sizeof(watch_next_set));
+}
+
+// Function to check the pending changes
+static void watch_process(void) {
+    for (size_t i = 0; i < watch_pending.cap && !watch_stop; i++) {
+        for (struct watch_file *f = watch_pending.b[i]; f; f = f->next) {
+            struct stat sb;
+            if (lstat(f->path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+                // New files may be written before the watch is added, check them all
+                watch_add_tree(f->path, f->level, 1);
+            } else {
+                if (f->hits & IN_ISDIR) watch_forget_dir(f->path);
+                watch_check(f->path, f->level);
+            }
+        }
+    }
+    watch_set_free(&watch_pending);
+    out_flush();
+}
+
+static void watch_signal(int sig) {
+    (void)sig;
+    watch_stop = 1;
+}
+
+// Function to add the watches before the first walk
+void watch_init(const char *dir) {
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd < 0) {
+        fprintf(stderr, "inotify_init1() failed: %s\n", strerror(errno));
+        watch_mode = 0;
+        return;
+    }
+    // The walk sets the root length that shard_skip() needs
+    shard_root_len = strlen(dir);
+    while (shard_root_len > 1 && dir[shard_root_len - 1] == '/') shard_root_len--;
+    watch_add_tree(dir, 0, 0);
+}
+
+// Function to print events for changed files until the program is interrupted
+void watch_run(const char *dir) {
+    if (!watch_mode || out_stop) return;
+    watch_phase = WATCH_EVENTS;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;   // No SA_RESTART, poll() returns at once
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = {watch_fd, POLLIN, 0};
+    while (!watch_stop && !out_stop) {
+        int n = poll(&pfd, 1, -1);
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "poll() failed: %s\n", strerror(errno));
+            break;
+        }
+        if (n <= 0) continue;
+
+        ssize_t len = read(watch_fd, buf, sizeof(buf));
+        int overflow = 0;
+        for (char *p = buf; len > 0 && p < buf + len; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = 1;
+            } else if (ev->mask & IN_IGNORED) {
+                if (ev->wd >= 0 && ev->wd < watch_dirs_cap) {
+                    free(watch_dirs[ev->wd].path);
+                    watch_dirs[ev->wd].path = NULL;
+                }
+            } else if (ev->len > 0 && ev->wd >= 0 && ev->wd < watch_dirs_cap && watch_dirs[ev->wd].path) {
+                struct watch_dir *d = &watch_dirs[ev->wd];
+                char *path = join_path(d->path, ev->name);
+                if (!path) continue;
+                if (!shard_skip(path, d->level + 1, (ev->mask & IN_ISDIR) != 0) &&
+                    ((int)watch_pending.cnt >= watch_queue ||
+                     watch_set_put(&watch_pending, path, d->level + 1, ev->mask & IN_ISDIR) < 0))
+                    overflow = 1;
+                free(path);
+            }
+        }
+        // Events of one read name most paths once, they are checked together
+        if (overflow) {
+            if (debug) fprintf(stderr, "Change queue overflow, walking %s again\n", dir);
+            watch_rescan(dir);
+            out_flush();
+        } else if (watch_pending.cnt) {
+            watch_process();
+        }
+    }
+
+    watch_set_free(&watch_pending);
+    watch_set_free(&watch_found_set);
+    for (int wd = 0; wd < watch_dirs_cap; wd++) free(watch_dirs[wd].path);
+    free(watch_dirs);
+    watch_dirs = NULL;
+    close(watch_fd);
+    watch_fd = -1;
+}
+
+
+/*
+    Server mode (--serve, --connect).
+
+    A server opens every plugin library and its --index once and listens on
+    a Unix socket. A client started with --connect loads no plugins: it sends
+    its working directory and arguments, together with its standard output
+    and error descriptors, and waits for the exit status of the query. The
+    server forks a process per client, which forks the query itself with the
+    client's descriptors, directory and arguments: the query parses its
+    options and compiles them as a run of its own would, but the libraries,
+    the option tables and the index are already there, inherited from the
+    server. Found files go straight to the client's output. A client that
+    goes away takes its query with it. At most --serve-max queries run at
+    once, further clients wait in the listen queue of the socket.
+
+    Queries run with the credentials of the server, so only clients of the
+    same user are served, and options that load libraries or write files
+    (-P, --index-build, --index-update, --serve) are refused.
+
+    Request: a 32-bit length with both descriptors attached, then that many
+    bytes of NUL-terminated strings, the directory first. Reply: the 32-bit
+    exit status.
+*/
+
+#define SERVE_REQ_MAX (1024 * 1024)     // Longest request a server accepts
+
+static volatile sig_atomic_t serve_stop = 0;
+
+// Function to find the socket of --connect before the plugins are opened
+static const char *connect_arg(int argc, char *argv[]) {
+    for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+        if (!strcmp(argv[i], "--connect")) return i + 1 < argc ? argv[i + 1] : NULL;
+        if (!strncmp(argv[i], "--connect=", 10)) return argv[i] + 10;
+    }
+    return NULL;
+}
+
+// Function to fill the address of a socket path
+static int serve_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// Function to write all of a buffer
+static int serve_write(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t t = write(fd, p, len);
+        if (t < 0 && errno == EINTR) continue;
+        if (t <= 0) return -1;
+        p += t;
+        len -= (size_t)t;
+    }
+    return 0;
+}
+
+// Function to read all of a buffer, returns -1 on an error or an early end
+static int serve_read(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t t = read(fd, p, len);
+        if (t < 0 && errno == EINTR) continue;
+        if (t <= 0) return -1;
+        p += t;
+        len -= (size_t)t;
+    }
+    return 0;
+}
+
+// Function to run a query on a server and pass on its exit status
+int serve_connect(const char *path, int argc, char *argv[]) {
+    // The directory and the arguments without --connect form the request
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        fprintf(stderr, "getcwd() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    size_t len = strlen(cwd) + 1;
+    for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+    char *req = malloc(len);
+    if (!req) {
+        fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+        return EXIT_FAILURE;
+    }
+    size_t off = 0;
+    int skip = 0;
+    for (int i = -1; i < argc; i++) {
+        const char *a = i < 0 ? cwd : argv[i];
+        if (skip) {
+            skip = 0;
+            continue;
+        }
+        if (i > 0 && (!strcmp(a, "--connect") || !strncmp(a, "--connect=", 10))) {
+            skip = a[9] == '\0';
+            continue;
+        }
+        size_t l = strlen(a) + 1;
+        memcpy(req + off, a, l);
+        off += l;
+    }
+
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || serve_addr(path, &addr) < 0 ||
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0) fprintf(stderr, "connect() failed for %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        free(req);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // The output descriptors travel with the length of the request
+    uint32_t hdr = (uint32_t)off;
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    memset(ctl, 0, sizeof(ctl));
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    int32_t status = EXIT_FAILURE;
+    ssize_t t;
+    while ((t = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR);
+    if (t != (ssize_t)sizeof(hdr) || serve_write(fd, req, off) < 0) {
+        fprintf(stderr, "Cannot send the query to %s: %s\n", path, strerror(errno));
+    } else if (serve_read(fd, &status, sizeof(status)) < 0) {
+        fprintf(stderr, "Server %s closed the connection\n", path);
+        status = EXIT_FAILURE;
+    }
+    close(fd);
+    free(req);
+    return status;
+}
+
+// Function to find an option a client may not pass, NULL if there is none
+static const char *serve_refused(int argc, char *argv[]) {
+    struct option *long_options = build_long_options();
+    const char *bad = NULL;
+    int choice;
+    opterr = 0;         // The query itself reports bad options
+    optind = 0;
+    while (!bad && (choice = getopt_long(argc, argv, "vhP:OANj:", long_options, NULL)) != -1) {
+        switch (choice) {
+            case 'P': bad = "-P"; break;
+            case OPT_INDEX_BUILD: bad = "--index-build"; break;
+            case OPT_INDEX_UPDATE: bad = "--index-update"; break;
+            case OPT_SERVE: bad = "--serve"; break;
+        }
     }
+    opterr = 1;
+    free(long_options);
+    return bad;
+}
+
+// Function to run the query of a client, does not return
+static void serve_query(int cfd, const int fds[2], char *req, size_t len) {
+    // Count the strings of the request, the first one is the directory
+    int argc = -1;
+    for (size_t i = 0; i < len; i++) argc += req[i] == '\0';
+    char **argv = calloc(argc > 0 ? argc + 1 : 1, sizeof(char *));
+    if (argc < 1 || !argv) _exit(EXIT_FAILURE);
+    char *p = req + strlen(req) + 1;
+    for (int i = 0; i < argc; i++, p += strlen(p) + 1) argv[i] = p;
+
+    int done[2];
+    if (pipe2(done, O_CLOEXEC) < 0) _exit(EXIT_FAILURE);
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // The query owns the write end of the pipe, it closes when the query exits
+        close(cfd);
+        close(done[0]);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        if (dup2(fds[0], STDOUT_FILENO) < 0 || dup2(fds[1], STDERR_FILENO) < 0) _exit(EXIT_FAILURE);
+        close(fds[0]);
+        close(fds[1]);
+        const char *bad = serve_refused(argc, argv);
+        if (bad) {
+            fprintf(stderr, "%s is not allowed in a query to a server\n", bad);
+            _exit(EXIT_FAILURE);
+        }
+        if (chdir(req) < 0) {
+            fprintf(stderr, "chdir() failed for %s: %s\n", req, strerror(errno));
+            _exit(EXIT_FAILURE);
+        }
+        serve_path = NULL;
+        optind = 0;     // Start getopt_long() over on the arguments of the client
+        optparse(argc, argv);
+        exit(run_search(argc, argv));
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(done[1]);
+    if (pid < 0) _exit(EXIT_FAILURE);
+
+    // Wait for the query to end, or for the client to hang up and stop it
+    struct pollfd pfd[2] = {{done[0], POLLIN, 0}, {cfd, POLLIN | POLLRDHUP, 0}};
+    while (poll(pfd, 2, -1) < 0 && errno == EINTR);
+    if (!pfd[0].revents && pfd[1].revents) kill(pid, SIGTERM);
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+    int32_t code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    serve_write(cfd, &code, sizeof(code));
+    _exit(EXIT_SUCCESS);
+}
+
+// Function to serve one client, runs in its own process and does not return
+static void serve_client(int cfd) {
+    uint32_t hdr = 0;
+    int fds[2] = {-1, -1};
+    char ctl[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {&hdr, sizeof(hdr)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    ssize_t t;
+    while ((t = recvmsg(cfd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    struct cmsghdr *cm = t > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+        cm->cmsg_len == CMSG_LEN(sizeof(fds)))
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    if (fds[0] < 0 || fds[1] < 0 ||
+        (t < (ssize_t)sizeof(hdr) && serve_read(cfd, (char *)&hdr + t, sizeof(hdr) - (size_t)t) < 0) ||
+        hdr == 0 || hdr > SERVE_REQ_MAX) {
+        if (debug) fprintf(stderr, "Bad request from a client\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    char *req = malloc(hdr);
+    if (!req || serve_read(cfd, req, hdr) < 0 || req[hdr - 1] != '\0') _exit(EXIT_FAILURE);
+
+    // The query would run as the server's user, other users are turned away
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if (getsockopt(cfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 || cred.uid != getuid()) {
+        dprintf(fds[1], "The server serves only the user that started it\n");
+        int32_t code = EXIT_FAILURE;
+        serve_write(cfd, &code, sizeof(code));
+        _exit(EXIT_FAILURE);
+    }
+    serve_query(cfd, fds, req, hdr);
+}
+
+// Function to stop the server
+static void serve_signal(int sig) {
+    (void)sig;
+    serve_stop = 1;
+}
+
+// Function to accept clients until the server is interrupted
+int serve_run(void) {
+    struct sockaddr_un addr;
+    if (serve_addr(serve_path, &addr) < 0) return -1;
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    // A socket left behind by a server that is gone is replaced
+    struct stat sb;
+    if (lstat(serve_path, &sb) == 0 && S_ISSOCK(sb.st_mode)) unlink(serve_path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, SOMAXCONN) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\n", serve_path, strerror(errno));
+        close(lfd);
+        return -1;
+    }
+    if (serve_max == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        serve_max = cpus > 0 ? (int)cpus : 1;
+    }
+
+    // The index stays mapped and read in for all queries
+    index_open();
+    if (index_map) madvise(index_map, index_map_len, MADV_WILLNEED);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_signal;   // No SA_RESTART, accept() returns at once
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (debug) fprintf(stderr, "Serving on %s, %d queries at once\n", serve_path, serve_max);
+
+    int active = 0;
+    while (!serve_stop) {
+        while (active > 0 && waitpid(-1, NULL, WNOHANG) > 0) active--;
+        if (active >= serve_max) {
+            // Admission control: new clients wait in the listen queue
+            if (waitpid(-1, NULL, 0) > 0) active--;
+            continue;
+        }
+
+        int cfd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+        if (cfd < 0) {
+            if (errno != EINTR) fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+            continue;
+        }
+        fflush(NULL);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(lfd);
+            serve_client(cfd);
+        }
+        if (pid < 0) fprintf(stderr, "fork() failed: %s\n", strerror(errno));
+        else active++;
+        close(cfd);
+    }
+
+    close(lfd);
+    unlink(serve_path);
+    // Queries that are running are finished
+    while (active > 0) {
+        if (waitpid(-1, NULL, 0) > 0) active--;
+        else if (errno != EINTR) break;
+    }
+    index_close();
+    return 0;
 }
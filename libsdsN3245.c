@@ -4,6 +4,15 @@
 #define _XOPEN_SOURCE 500
 #include <stdio.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 
 #include "plugin_api.h"
@@ -17,195 +26,1912 @@ static struct plugin_option g_options[] = {
     {
         {"bytes", required_argument, 0, 0},
         "Bytes to search for"
+    },
+    {
+        {"sequences", required_argument, 0, 0},
+        "Byte sequences in hex that must all occur, e.g. 7f454c46,504b0304"
+    },
+    {
+        {"split-threshold", required_argument, 0, 0},
+        "Files of at least this size (K, M, G suffixes, default 1G) are scanned by several threads"
+    },
+    {
+        {"split-chunk", required_argument, 0, 0},
+        "Size of the ranges of a split file (default 64M)"
+    },
+    {
+        {"split-threads", required_argument, 0, 0},
+        "Threads scanning a split file (default: online CPUs, 1 turns splitting off)"
+    },
+    {
+        {"count", no_argument, 0, 0},
+        "Report how many times each target byte occurs in a found file"
+    },
+    {
+        {"offsets", required_argument, 0, 0},
+        "Report the offsets of the first N occurrences of each target byte"
     }
 };
 
 // Number of supported plugin options
 static int g_options_len = sizeof(g_options) / sizeof(g_options[0]);
 
-// Function to retrieve plugin information
-int plugin_get_info(struct plugin_info *ppi)
+// Size of the blocks the file is read and scanned in
+#define SCAN_BLOCK_SIZE (128 * 1024)
+
+/*
+    Byte-set scanning kernel.
+
+    The bytes that are still missing form a 256-bit set. find_any() returns the
+    offset of the first byte of a block that belongs to the set; the byte is
+    then removed from the set, so every target byte stops the vector loop only
+    once and the scan ends as soon as the set is empty.
+
+    The vector kernels test set membership with two nibble lookups: the low
+    nibble of a byte selects a row of nib[0] (high nibble 0..7) or nib[1]
+    (high nibble 8..15), and the high nibble selects a bit of that row. SSE2
+    has no byte shuffle, so its kernel compares against the missing bytes one
+    by one. The kernel is picked by cpuid when the library is loaded.
+*/
+struct scan_state {
+    uint64_t set[4];                        // Missing bytes, bit b = byte b
+    unsigned char nib[2][16] __attribute__((aligned(16)));  // Nibble lookup rows
+    unsigned char list[256];                // Missing bytes as a list (SSE2)
+    int left;                               // Number of missing bytes
+};
+
+static inline int scan_has(const struct scan_state *st, unsigned char b)
 {
-    // Check for valid argument
-    if (!ppi)
-    {
-        fprintf(stderr, "ERROR: Invalid argument\n");
-        return -1;
+    return (st->set[b >> 6] >> (b & 63)) & 1;
+}
+
+static void scan_init(struct scan_state *st)
+{
+    memset(st, 0, sizeof(*st));
+}
+
+static void scan_add(struct scan_state *st, unsigned char b)
+{
+    if (scan_has(st, b))
+        return;
+    st->set[b >> 6] |= 1ULL << (b & 63);
+    st->nib[b >> 7][b & 15] |= 1 << ((b >> 4) & 7);
+    st->list[st->left++] = b;
+}
+
+static void scan_del(struct scan_state *st, unsigned char b)
+{
+    st->set[b >> 6] &= ~(1ULL << (b & 63));
+    st->nib[b >> 7][b & 15] &= ~(1 << ((b >> 4) & 7));
+    for (int i = 0; i < st->left; i++) {
+        if (st->list[i] == b) {
+            st->list[i] = st->list[--st->left];
+            break;
+        }
     }
+}
 
-    // Assign plugin purpose, author, and supported options
-    ppi->plugin_purpose = g_purpose;
-    ppi->plugin_author = g_author;
-    ppi->sup_opts_len = g_options_len;
-    ppi->sup_opts = g_options;
+// Scalar kernel: one bitmap lookup per byte
+static size_t find_any_scalar(const unsigned char *p, size_t n, const struct scan_state *st)
+{
+    for (size_t i = 0; i < n; i++) {
+        if (scan_has(st, p[i]))
+            return i;
+    }
+    return n;
+}
 
-    return 0;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static size_t find_any_sse2(const unsigned char *p, size_t n, const struct scan_state *st)
+{
+    __m128i want[8];
+    int cnt = st->left;
+    if (cnt > 8)
+        return find_any_scalar(p, n, st);   // Too many compares per block
+    for (int j = 0; j < cnt; j++)
+        want[j] = _mm_set1_epi8((char)st->list[j]);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hit = _mm_setzero_si128();
+        for (int j = 0; j < cnt; j++)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(x, want[j]));
+        unsigned m = (unsigned)_mm_movemask_epi8(hit);
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + find_any_scalar(p + i, n - i, st);
 }
 
-// Function to process a file for specified bytes
-int plugin_process_file(const char *fname,
-                        struct option in_opts[],
-                        size_t in_opts_len)
+__attribute__((target("ssse3")))
+static size_t find_any_ssse3(const unsigned char *p, size_t n, const struct scan_state *st)
 {
-    // Check for valid arguments
-    if (!fname || !in_opts || !in_opts_len)
+    const __m128i t0 = _mm_load_si128((const __m128i *)st->nib[0]);
+    const __m128i t1 = _mm_load_si128((const __m128i *)st->nib[1]);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i low = _mm_set1_epi8(0x0f);
+    const __m128i eight = _mm_set1_epi8(8);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_and_si128(x, low);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(x, 4), low);
+        __m128i first = _mm_cmpgt_epi8(eight, hi);
+        __m128i row = _mm_or_si128(_mm_and_si128(first, _mm_shuffle_epi8(t0, lo)),
+                                   _mm_andnot_si128(first, _mm_shuffle_epi8(t1, lo)));
+        __m128i bit = _mm_shuffle_epi8(bits, hi);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + find_any_scalar(p + i, n - i, st);
+}
+
+__attribute__((target("avx2")))
+static size_t find_any_avx2(const unsigned char *p, size_t n, const struct scan_state *st)
+{
+    const __m256i t0 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)st->nib[0]));
+    const __m256i t1 = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)st->nib[1]));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    const __m256i eight = _mm256_set1_epi8(8);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i lo = _mm256_and_si256(x, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), low);
+        __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(t1, lo),
+                                         _mm256_shuffle_epi8(t0, lo),
+                                         _mm256_cmpgt_epi8(eight, hi));
+        __m256i bit = _mm256_shuffle_epi8(bits, hi);
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + find_any_scalar(p + i, n - i, st);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t find_any_avx512(const unsigned char *p, size_t n, const struct scan_state *st)
+{
+    const __m512i t0 = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)st->nib[0]));
+    const __m512i t1 = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)st->nib[1]));
+    const __m512i bits = _mm512_broadcast_i32x4(_mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                                              1, 2, 4, 8, 16, 32, 64, -128));
+    const __m512i low = _mm512_set1_epi8(0x0f);
+    const __m512i eight = _mm512_set1_epi8(8);
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i x = _mm512_loadu_si512((const void *)(p + i));
+        __m512i lo = _mm512_and_si512(x, low);
+        __m512i hi = _mm512_and_si512(_mm512_srli_epi16(x, 4), low);
+        __m512i row = _mm512_mask_blend_epi8(_mm512_cmpgt_epi8_mask(eight, hi),
+                                             _mm512_shuffle_epi8(t1, lo),
+                                             _mm512_shuffle_epi8(t0, lo));
+        uint64_t m = _mm512_test_epi8_mask(row, _mm512_shuffle_epi8(bits, hi));
+        if (m)
+            return i + __builtin_ctzll(m);
+    }
+    return i + find_any_scalar(p + i, n - i, st);
+}
+#endif
+
+/*
+    Counting kernels (--count, --offsets).
+
+    Counting cannot stop at the first occurrence, every byte of the file is
+    looked at. The histogram kernel spreads consecutive bytes over four
+    tables of 32-bit counters so that equal neighbouring bytes do not wait
+    for each other's increments, and adds them to the 64-bit totals before
+    a counter can overflow. For a few targets the AVX2 kernel compares 32
+    bytes with every target at once and subtracts the 0xff results from
+    per-byte counters, which are summed into 64-bit lanes every 255 steps.
+    Both kernels count into total[] indexed by the byte value.
+*/
+#define COUNT_SIMD_MAX 4                // Most targets for the compare kernel
+#define COUNT_HIST_CHUNK (1UL << 30)    // Bytes counted before the lanes are flushed
+#define COUNT_HIST_MIN 1024             // Shorter blocks are counted directly
+#define COUNT_MAX_OFFSETS 65536         // Most offsets reported for a byte
+
+// Function to count the target bytes of a block with a histogram in four lanes
+static void count_hist(const unsigned char *targets, int nt, uint64_t *total,
+                       const unsigned char *p, size_t n)
+{
+    // Clearing the lanes costs more than counting a short block directly
+    if (n < COUNT_HIST_MIN)
     {
-        errno = EINVAL;
-        return -1;
+        for (size_t i = 0; i < n; i++)
+            total[p[i]]++;
+        return;
+    }
+    uint32_t lanes[4][256];
+    while (n > 0)
+    {
+        size_t len = n < COUNT_HIST_CHUNK ? n : COUNT_HIST_CHUNK;
+        memset(lanes, 0, sizeof(lanes));
+        size_t i = 0;
+        for (; i + 4 <= len; i += 4)
+        {
+            lanes[0][p[i]]++;
+            lanes[1][p[i + 1]]++;
+            lanes[2][p[i + 2]]++;
+            lanes[3][p[i + 3]]++;
+        }
+        for (; i < len; i++)
+            lanes[0][p[i]]++;
+        for (int t = 0; t < nt; t++)
+        {
+            unsigned char b = targets[t];
+            total[b] += (uint64_t)lanes[0][b] + lanes[1][b] + lanes[2][b] + lanes[3][b];
+        }
+        p += len;
+        n -= len;
     }
+}
 
-    // Initialize variables for byte search
-    char *bytes_string = NULL;
-    for (size_t i = 0; i < in_opts_len; i++)
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static void count_eq_avx2(const unsigned char *targets, int nt, uint64_t *total,
+                          const unsigned char *p, size_t n)
+{
+    __m256i want[COUNT_SIMD_MAX], sum[COUNT_SIMD_MAX];
+    const __m256i zero = _mm256_setzero_si256();
+    for (int t = 0; t < nt; t++)
     {
-        // Extract bytes string from plugin options
-        if (!strcmp(in_opts[i].name, "bytes"))
+        want[t] = _mm256_set1_epi8((char)targets[t]);
+        sum[t] = zero;
+    }
+    size_t i = 0;
+    while (i + 32 <= n)
+    {
+        // A byte counter holds at most 255 matches
+        size_t steps = (n - i) / 32 < 255 ? (n - i) / 32 : 255;
+        size_t stop = i + steps * 32;
+        __m256i acc[COUNT_SIMD_MAX];
+        for (int t = 0; t < nt; t++)
+            acc[t] = zero;
+        for (; i < stop; i += 32)
         {
-            bytes_string = strdup((char *)in_opts[i].flag);
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            for (int t = 0; t < nt; t++)
+                acc[t] = _mm256_sub_epi8(acc[t], _mm256_cmpeq_epi8(v, want[t]));
         }
-        else
+        for (int t = 0; t < nt; t++)
+            sum[t] = _mm256_add_epi64(sum[t], _mm256_sad_epu8(acc[t], zero));
+    }
+    for (int t = 0; t < nt; t++)
+    {
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, sum[t]);
+        total[targets[t]] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    for (; i < n; i++)
+        total[p[i]]++;
+}
+#endif
+
+// Compare kernel for a few targets selected for this CPU, NULL if there is none
+static void (*count_eq)(const unsigned char *, int, uint64_t *, const unsigned char *, size_t) = NULL;
+
+// LAB1DEBUG is read once at load time, not for every file
+static int g_debug = 0;
+
+// Services of the host, NULL for hosts without plugin_set_host()
+static const struct plugin_host *g_host = NULL;
+
+// Set in threads started by the plugin, the host scratch memory is not theirs
+static __thread int tl_plugin_thread = 0;
+
+// Function to get zeroed memory that the host frees after the file, or NULL
+static void *scratch_zalloc(size_t size)
+{
+    if (!g_host || tl_plugin_thread ||
+        g_host->size < offsetof(struct plugin_host, scratch_alloc) + sizeof(g_host->scratch_alloc) ||
+        !g_host->scratch_alloc)
+        return NULL;
+    void *p = g_host->scratch_alloc(size);
+    if (p)
+        memset(p, 0, size);
+    return p;
+}
+
+// Kernel selected for this CPU
+static size_t (*find_any)(const unsigned char *, size_t, const struct scan_state *) = find_any_scalar;
+
+/*
+    Multi-sequence search.
+
+    A sequence of one byte is just a target byte and joins the set of --bytes.
+    Longer sequences are searched in one pass over the file by one of two
+    engines, picked when the query is compiled:
+
+    - A few sequences starting with few distinct bytes go to an Aho-Corasick
+      DFA. Bytes that occur in no sequence share one input class, which keeps
+      the transition table at (states x classes) entries; the entries hold row
+      offsets and SEQ_OUT marks a transition into a state where a sequence
+      ends. While the DFA is in the root, find_any() skips to the next possible
+      first byte with the vector kernel.
+
+    - Other sets use a hashed filter in the spirit of Rabin-Karp: the first k
+      bytes of every sequence (k is the length of the shortest one, at most 4)
+      set a bit of a 256 Kbit table. Every position of the file is hashed
+      independently, so the loop is not a chain of dependent table loads, and
+      only positions whose bit is set are compared with the sequences of that
+      hash. The table fits in L1, so thousands of sequences cost about as much
+      as tens.
+
+    Both engines keep state between blocks: the DFA keeps its state, the
+    filter keeps the last (longest - 1) bytes and checks the positions that
+    straddle two blocks again.
+*/
+#define SEQ_OUT 0x80000000u             // Target state ends a sequence
+#define SEQ_NONE 0xffffffffu
+#define SEQ_MAX_LEN 4096                // Longest sequence accepted
+#define SEQ_PREFILTER_MAX 16            // Most first bytes for the DFA engine
+#define SEQ_DFA_MAX (64 * 1024)         // Most DFA entries, more go to the filter
+#define SEQ_HASH_BITS 18                // Bits of the filter hash
+
+enum { SEQ_DFA, SEQ_HASH };
+
+struct seq_automaton {
+    int engine;                         // SEQ_DFA or SEQ_HASH
+    size_t n_term;                      // Number of distinct sequences
+    size_t max_len;                     // Longest sequence
+    unsigned char *bytes;               // Sequences back to back
+    size_t *off;                        // Start of sequence t in bytes
+    uint32_t *len;                      // Length of sequence t
+    unsigned char used[256];            // Bytes that occur in some sequence
+    char *spec;                         // Sequences as given, for debug output
+
+    // DFA engine
+    uint32_t *next;                     // Transitions, states x classes, as row offsets
+    int32_t *term;                      // Sequence ending in a state, -1 if none
+    uint32_t *dict;                     // Nearest suffix state ending a sequence
+    unsigned char cls[256];             // Input class of every byte
+    int classes;
+    struct scan_state first;            // First bytes of the sequences
+
+    // Filter engine
+    int k;                              // Bytes hashed at every position
+    uint32_t kmask;                     // Keeps k bytes of a 4-byte load
+    uint64_t *filter;                   // Bit h = some sequence starts with hash h
+    uint32_t *bucket;                   // First sequence of every hash
+    uint32_t *chain;                    // Next sequence with the same hash
+};
+
+// Scan state of one file
+struct seq_run {
+    uint32_t state;                     // DFA row offset
+    size_t left;                        // Sequences not seen yet
+    uint64_t *seen;                     // Bit t = sequence t was seen
+    uint64_t seen_small[8];             // Used for up to 512 sequences
+    int seen_heap;                      // seen was taken with calloc()
+    size_t carry_len;                   // Tail of the last block (filter)
+    unsigned char carry[SEQ_MAX_LEN];
+};
+
+static void seq_free(struct seq_automaton *a)
+{
+    if (!a)
+        return;
+    free(a->bytes);
+    free(a->off);
+    free(a->len);
+    free(a->spec);
+    free(a->next);
+    free(a->term);
+    free(a->dict);
+    free(a->filter);
+    free(a->bucket);
+    free(a->chain);
+    free(a);
+}
+
+// Function to decode a hex sequence into out, returns its length or -1
+static long seq_parse_hex(const char *tok, unsigned char *out)
+{
+    if (tok[0] == '0' && tok[1] == 'x')
+        tok += 2;
+    size_t n = strlen(tok);
+    if (n == 0 || n % 2)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (n / 2 > SEQ_MAX_LEN)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    for (size_t i = 0; i < n; i += 2)
+    {
+        unsigned int v;
+        if (!isxdigit((unsigned char)tok[i]) || !isxdigit((unsigned char)tok[i + 1]) ||
+            sscanf(tok + i, "%2x", &v) != 1)
         {
             errno = EINVAL;
             return -1;
         }
+        out[i / 2] = (unsigned char)v;
     }
-    // Check if bytes string is valid
-    if (!bytes_string)
+    return (long)(n / 2);
+}
+
+// Sequence being sorted to drop duplicates
+struct seq_ref {
+    const unsigned char *p;
+    size_t off;
+    uint32_t len;
+};
+
+static int seq_cmp(const void *x, const void *y)
+{
+    const struct seq_ref *i = x, *j = y;
+    int c = memcmp(i->p, j->p, i->len < j->len ? i->len : j->len);
+    return c ? c : (i->len > j->len) - (i->len < j->len);
+}
+
+// Function to load 4 bytes for the filter hash
+static inline uint32_t seq_load(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t seq_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - SEQ_HASH_BITS);
+}
+
+// Function to build the Aho-Corasick DFA of the sequences
+static int seq_build_dfa(struct seq_automaton *a)
+{
+    int n_used = 0;
+    for (int b = 0; b < 256; b++)
+        n_used += a->used[b];
+    a->classes = n_used == 256 ? 256 : n_used + 1;
+    for (int b = 0, c = 1; b < 256; b++)
+        a->cls[b] = n_used == 256 ? (unsigned char)b : (a->used[b] ? (unsigned char)c++ : 0);
+
+    // The trie has one state per byte at most
+    size_t max_states = 1;
+    for (size_t t = 0; t < a->n_term; t++)
+        max_states += a->len[t];
+    a->next = calloc(max_states * a->classes, sizeof(uint32_t));
+    a->term = malloc(max_states * sizeof(int32_t));
+    a->dict = malloc(max_states * sizeof(uint32_t));
+    uint32_t *fail = malloc(max_states * sizeof(uint32_t));
+    uint32_t *queue = malloc(max_states * sizeof(uint32_t));
+    if (!a->next || !a->term || !a->dict || !fail || !queue)
     {
-        errno = EINVAL;
+        free(fail);
+        free(queue);
         return -1;
     }
+    for (size_t i = 0; i < max_states; i++)
+        a->term[i] = -1;
 
-    // Initialize variables for byte parsing
-    unsigned char *bytes = NULL;
-    size_t bytes_cnt = 0;
-    char *saveptr = NULL;
-    char *tok = strtok_r(bytes_string, ",", &saveptr);
-    while (tok != NULL) {
-        // Parse binary format bytes
-        if (strlen(tok) > 2 && tok[0] == '0' && tok[1] == 'b') {
-            if (strlen(tok) > 10) {
-                errno = ERANGE;
-                if (bytes_string)
-                    free(bytes_string);
-                if (bytes)
-                    free(bytes);
-                return -1;
-            }
-            bytes = realloc(bytes, sizeof(unsigned char) * (bytes_cnt + 1));
-            bytes[bytes_cnt] = 0;
-            for (size_t i = strlen(tok) - 1; i > 1; i--) {
-                if (tok[i] == '1') {
-                    bytes[bytes_cnt] |= (1 << (strlen(tok) - i - 1));
-                }
-            }
-            
-            bytes_cnt++;
+    uint32_t states = 1;
+    for (size_t t = 0; t < a->n_term; t++)
+    {
+        const unsigned char *seq = a->bytes + a->off[t];
+        uint32_t st = 0;
+        for (uint32_t i = 0; i < a->len[t]; i++)
+        {
+            uint32_t *e = &a->next[(size_t)st * a->classes + a->cls[seq[i]]];
+            if (*e == 0)
+                *e = states++;
+            st = *e;
         }
-        // Parse hexadecimal format bytes
-        else if (strlen(tok) > 2 && tok[0] == '0' && tok[1] == 'x') {
-            if(strlen(tok) > 4){
-                errno = ERANGE;
-                if (bytes_string)
-                    free(bytes_string);
-                if (bytes)
-                    free(bytes);
-                return -1;
-            }
-            bytes = realloc(bytes, sizeof(unsigned char) * (bytes_cnt + 1));
-            bytes[bytes_cnt] = 0;
-            sscanf(tok+2, "%02hhx",bytes+bytes_cnt);
-            
-            bytes_cnt++;
+        a->term[st] = (int32_t)t;
+    }
+
+    // Breadth-first pass: failure links turn the trie into a DFA
+    size_t head = 0, tail = 0;
+    a->dict[0] = SEQ_NONE;
+    for (int c = 0; c < a->classes; c++)
+    {
+        uint32_t v = a->next[c];
+        if (v)
+        {
+            fail[v] = 0;
+            a->dict[v] = SEQ_NONE;
+            queue[tail++] = v;
         }
-        // Parse decimal format bytes
-        else
+    }
+    while (head < tail)
+    {
+        uint32_t u = queue[head++];
+        for (int c = 0; c < a->classes; c++)
         {
-            if(tok != NULL && tok[0] == '0' && strcmp(tok, "0")!= 0){
-                errno = EINVAL;
-                if (bytes_string)
-                    free(bytes_string);
-                if (bytes)
-                    free(bytes);
-                return -1;
-            }   
-            char *endptr;
-            long num = strtol(tok, &endptr, 10);
-            if(num == 0 && endptr == tok && strcmp(tok, "0") != 0){
-                errno = EINVAL;
-                if (bytes_string)
-                    free(bytes_string);
-                if (bytes)
-                    free(bytes);
-                return -1;
+            uint32_t *e = &a->next[(size_t)u * a->classes + c];
+            uint32_t f = a->next[(size_t)fail[u] * a->classes + c];
+            if (*e)
+            {
+                fail[*e] = f;
+                a->dict[*e] = a->term[f] >= 0 ? f : a->dict[f];
+                queue[tail++] = *e;
             }
-            if(num > 255){
-                errno = ERANGE;
-                 if (bytes_string)
-                    free(bytes_string);
-                if (bytes)
-                    free(bytes);
-                return -1;
-            } else{
-                bytes = realloc(bytes, (bytes_cnt+1) * sizeof(unsigned char));
-                bytes[bytes_cnt] = (unsigned char)num;
-                
-                
-                bytes_cnt++;
+            else
+            {
+                *e = f;
             }
         }
-        tok = strtok_r(NULL, ",", &saveptr);
     }
+    free(fail);
+    free(queue);
 
-    // Initialize variables for byte search result
-    int *found = calloc(sizeof(int), bytes_cnt);
-    FILE *f = fopen(fname, "rb");
-    if(!f){
-        fprintf(stderr, "fopen() failed:%s\n", strerror(errno));
-        if(found) 
-                free(found);
-            if (bytes_string)
-                free(bytes_string);
-            if (bytes)
-                free(bytes);
+    // Entries become row offsets, transitions into states where a sequence ends are marked
+    for (size_t i = 0; i < (size_t)states * a->classes; i++)
+    {
+        uint32_t v = a->next[i];
+        a->next[i] = v * (uint32_t)a->classes;
+        if (a->term[v] >= 0 || a->dict[v] != SEQ_NONE)
+            a->next[i] |= SEQ_OUT;
+    }
+    return 0;
+}
+
+// Function to build the hashed filter of the sequences
+static int seq_build_filter(struct seq_automaton *a)
+{
+    a->k = 4;
+    for (size_t t = 0; t < a->n_term; t++)
+        if ((int)a->len[t] < a->k)
+            a->k = (int)a->len[t];
+    unsigned char ones[4] = {0};
+    memset(ones, 0xff, (size_t)a->k);
+    a->kmask = seq_load(ones);
+
+    a->filter = calloc((1u << SEQ_HASH_BITS) / 64, sizeof(uint64_t));
+    a->bucket = malloc((1u << SEQ_HASH_BITS) * sizeof(uint32_t));
+    a->chain = malloc(a->n_term * sizeof(uint32_t));
+    if (!a->filter || !a->bucket || !a->chain)
         return -1;
+    memset(a->bucket, 0xff, (1u << SEQ_HASH_BITS) * sizeof(uint32_t));
+    for (size_t t = a->n_term; t-- > 0;)
+    {
+        unsigned char pad[4] = {0};
+        memcpy(pad, a->bytes + a->off[t], (size_t)a->k);
+        uint32_t h = seq_hash(seq_load(pad) & a->kmask);
+        a->filter[h >> 6] |= 1ULL << (h & 63);
+        a->chain[t] = a->bucket[h];
+        a->bucket[h] = (uint32_t)t;
     }
-    while(!feof(f)){
-        unsigned char buf[1];
-        size_t t = fread(buf, sizeof(unsigned char), 1, f);
-        if(t != 1 && !feof(f)) {
-            if(found) 
-                free(found);
-            if (bytes_string)
-                free(bytes_string);
-            if (bytes)
-                free(bytes);
-            fclose(f);
-            return -1;
-        } else if (t == 0) break;
-        for(size_t i = 0; i < bytes_cnt; i++){
-            if(memcmp((char*)bytes+i, (char*)buf, 1) == 0){
-                found[i]++;
-            }
+    return 0;
+}
+
+// Function to compile a comma separated list of hex sequences,
+// sequences of one byte are added to the set of target bytes
+static struct seq_automaton *seq_compile(const char *spec, struct scan_state *st)
+{
+    struct seq_automaton *a = calloc(1, sizeof(*a));
+    char *copy = strdup(spec);
+    size_t cap = strlen(spec) / 2 + 1;
+    struct seq_ref *refs = malloc(cap * sizeof(struct seq_ref));
+    if (!a || !copy || !refs)
+        goto fail;
+    a->spec = strdup(spec);
+    a->bytes = malloc(cap);
+    a->off = malloc(cap * sizeof(size_t));
+    a->len = malloc(cap * sizeof(uint32_t));
+    if (!a->bytes || !a->off || !a->len)
+        goto fail;
+
+    // Decode the sequences
+    char *saveptr = NULL;
+    size_t total = 0, count = 0;
+    for (char *tok = strtok_r(copy, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        long n = seq_parse_hex(tok, a->bytes + total);
+        if (n < 0)
+            goto fail;
+        if (n == 1)
+        {
+            scan_add(st, a->bytes[total]);
+            continue;
         }
+        refs[count].p = a->bytes + total;
+        refs[count].off = total;
+        refs[count].len = (uint32_t)n;
+        count++;
+        total += (size_t)n;
     }
-    // Check if all bytes are found in the file
-    int ret = 0;
-    for(size_t i = 0; i < bytes_cnt; i++){
-        if(found[i] == 0) ret = 1;
+
+    // Equal sequences are counted once
+    qsort(refs, count, sizeof(struct seq_ref), seq_cmp);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0 && seq_cmp(&refs[i - 1], &refs[i]) == 0)
+            continue;
+        a->off[a->n_term] = refs[i].off;
+        a->len[a->n_term] = refs[i].len;
+        a->n_term++;
     }
-    // Print debug information if LAB1DEBUG environment variable is set
-    if(getenv("LAB1DEBUG")!=NULL && ret == 0){
-        fprintf(stderr,"Debug mode: Target bytes (");
-        for(size_t i = 0; i < bytes_cnt; i++) fprintf(stderr, "%d,", (int)bytes[i]);
-        fprintf(stderr, ") found in file %s!\n", fname);
+
+    scan_init(&a->first);
+    for (size_t t = 0; t < a->n_term; t++)
+    {
+        const unsigned char *seq = a->bytes + a->off[t];
+        for (uint32_t i = 0; i < a->len[t]; i++)
+            a->used[seq[i]] = 1;
+        scan_add(&a->first, seq[0]);
+        if (a->len[t] > a->max_len)
+            a->max_len = a->len[t];
     }
-    // Free allocated memory and close file
-    if(found) free(found);
-    if (bytes_string)
-        free(bytes_string);
-    if (bytes)
-        free(bytes);
-    fclose(f);
-    return ret;
+
+    // A handful of sequences with rare first bytes is cheapest for the DFA
+    a->engine = a->first.left <= SEQ_PREFILTER_MAX && (total + 1) * 256 <= SEQ_DFA_MAX ? SEQ_DFA : SEQ_HASH;
+    if (a->n_term > 0 && (a->engine == SEQ_DFA ? seq_build_dfa(a) : seq_build_filter(a)) < 0)
+        goto fail;
+    free(refs);
+    free(copy);
+    return a;
+
+fail:;
+    int saved = errno;
+    free(refs);
+    free(copy);
+    seq_free(a);
+    errno = saved;
+    return NULL;
+}
+
+static int seq_run_init(const struct seq_automaton *a, struct seq_run *r)
+{
+    r->state = 0;
+    r->carry_len = 0;
+    r->left = a ? a->n_term : 0;
+    r->seen = r->seen_small;
+    r->seen_heap = 0;
+    size_t words = (r->left + 63) / 64;
+    if (words > sizeof(r->seen_small) / sizeof(r->seen_small[0]))
+    {
+        r->seen = scratch_zalloc(words * sizeof(uint64_t));
+        if (!r->seen)
+        {
+            r->seen = calloc(words, sizeof(uint64_t));
+            if (!r->seen)
+                return -1;
+            r->seen_heap = 1;
+        }
+    }
+    else
+    {
+        memset(r->seen_small, 0, sizeof(r->seen_small));
+    }
+    return 0;
+}
+
+static void seq_run_free(struct seq_run *r)
+{
+    if (r->seen_heap)
+        free(r->seen);
+    r->seen = r->seen_small;
+    r->seen_heap = 0;
+}
+
+static inline void seq_mark(struct seq_run *r, uint32_t t)
+{
+    if (!((r->seen[t >> 6] >> (t & 63)) & 1))
+    {
+        r->seen[t >> 6] |= 1ULL << (t & 63);
+        r->left--;
+    }
+}
+
+// Function to mark every sequence that ends in DFA state s
+static void seq_hit(const struct seq_automaton *a, struct seq_run *r, uint32_t s)
+{
+    for (; s != SEQ_NONE; s = a->dict[s])
+    {
+        if (a->term[s] >= 0)
+            seq_mark(r, (uint32_t)a->term[s]);
+    }
+}
+
+// Run the DFA over a block, the state carries over to the next block
+static void seq_dfa_block(const struct seq_automaton *a, struct seq_run *r, const unsigned char *p, size_t n)
+{
+    const uint32_t *next = a->next;
+    const unsigned char *cls = a->cls;
+    uint32_t off = r->state;
+    size_t i = 0;
+    while (i < n)
+    {
+        if (off == 0)
+        {
+            i += find_any(p + i, n - i, &a->first);
+            if (i >= n)
+                break;
+        }
+        uint32_t e = next[off + cls[p[i++]]];
+        off = e & ~SEQ_OUT;
+        if (e & SEQ_OUT)
+        {
+            seq_hit(a, r, off / (uint32_t)a->classes);
+            if (r->left == 0)
+                break;
+        }
+    }
+    r->state = off;
+}
+
+// Function to compare the sequences of hash h with the bytes at p
+static void seq_verify(const struct seq_automaton *a, struct seq_run *r,
+                       const unsigned char *p, size_t avail, uint32_t h)
+{
+    for (uint32_t t = a->bucket[h]; t != SEQ_NONE; t = a->chain[t])
+    {
+        if (a->len[t] <= avail && !memcmp(p, a->bytes + a->off[t], a->len[t]))
+            seq_mark(r, t);
+    }
+}
+
+// Scalar filter kernel: returns the first of the positions 0..n-4 whose hash
+// is in the filter, n - 3 if there is none
+static size_t seq_scan_scalar(const struct seq_automaton *a, const unsigned char *p, size_t n)
+{
+    const uint64_t *filter = a->filter;
+    const uint32_t kmask = a->kmask;
+    size_t i = 0;
+    for (; i + 4 <= n; i++)
+    {
+        uint32_t h = seq_hash(seq_load(p + i) & kmask);
+        if ((filter[h >> 6] >> (h & 63)) & 1)
+            return i;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AVX2 filter kernel: sixteen positions are hashed at once and their filter
+// words are gathered, the table is read as 32-bit little-endian words
+__attribute__((target("avx2")))
+static size_t seq_scan_avx2(const struct seq_automaton *a, const unsigned char *p, size_t n)
+{
+    const __m256i windows = _mm256_setr_epi8(0, 1, 2, 3, 1, 2, 3, 4, 2, 3, 4, 5, 3, 4, 5, 6,
+                                             4, 5, 6, 7, 5, 6, 7, 8, 6, 7, 8, 9, 7, 8, 9, 10);
+    const __m256i kmask = _mm256_set1_epi32((int)a->kmask);
+    const __m256i mul = _mm256_set1_epi32((int)2654435761u);
+    const __m256i low5 = _mm256_set1_epi32(31);
+    const int *filter = (const int *)a->filter;
+
+    size_t i = 0;
+    for (; i + 24 <= n; i += 16)
+    {
+        // Two independent gathers hide each other's latency
+        __m256i x0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p + i)));
+        __m256i x1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(p + i + 8)));
+        __m256i h0 = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_shuffle_epi8(x0, windows), kmask), mul),
+                                       32 - SEQ_HASH_BITS);
+        __m256i h1 = _mm256_srli_epi32(_mm256_mullo_epi32(_mm256_and_si256(_mm256_shuffle_epi8(x1, windows), kmask), mul),
+                                       32 - SEQ_HASH_BITS);
+        __m256i w0 = _mm256_i32gather_epi32(filter, _mm256_srli_epi32(h0, 5), 4);
+        __m256i w1 = _mm256_i32gather_epi32(filter, _mm256_srli_epi32(h1, 5), 4);
+        w0 = _mm256_sllv_epi32(w0, _mm256_sub_epi32(low5, _mm256_and_si256(h0, low5)));
+        w1 = _mm256_sllv_epi32(w1, _mm256_sub_epi32(low5, _mm256_and_si256(h1, low5)));
+        unsigned m = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(w0)) |
+                     (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(w1)) << 8;
+        if (m)
+            return i + __builtin_ctz(m);
+    }
+    return i + seq_scan_scalar(a, p + i, n - i);
+}
+#endif
+
+// Filter kernel selected for this CPU
+static size_t (*seq_scan)(const struct seq_automaton *, const unsigned char *, size_t) = seq_scan_scalar;
+
+// Function to check the positions of p[0..starts) where a sequence may begin
+static void seq_filter_run(const struct seq_automaton *a, struct seq_run *r,
+                           const unsigned char *p, size_t starts, size_t n)
+{
+    size_t i = 0;
+    while (i < starts && i + 4 <= n && r->left > 0)
+    {
+        // Positions from i up to starts - 1 that have 4 bytes to load
+        size_t m = n - i < starts - i + 3 ? n - i : starts - i + 3;
+        i += seq_scan(a, p + i, m);
+        if (i >= starts || i + 4 > n)
+            break;
+        seq_verify(a, r, p + i, n - i, seq_hash(seq_load(p + i) & a->kmask));
+        i++;
+    }
+    // The last positions cannot load 4 bytes
+    for (; i < starts && i + (size_t)a->k <= n && r->left > 0; i++)
+    {
+        unsigned char pad[4] = {0};
+        memcpy(pad, p + i, (size_t)a->k);
+        uint32_t h = seq_hash(seq_load(pad) & a->kmask);
+        if ((a->filter[h >> 6] >> (h & 63)) & 1)
+            seq_verify(a, r, p + i, n - i, h);
+    }
+}
+
+// Run the filter over a block, sequences may straddle the previous one
+static void seq_filter_block(const struct seq_automaton *a, struct seq_run *r, const unsigned char *p, size_t n)
+{
+    size_t keep = a->max_len - 1;
+    if (r->carry_len > 0)
+    {
+        // Positions in the tail of the last block, now with the bytes that follow them
+        unsigned char join[2 * SEQ_MAX_LEN];
+        size_t head = n < keep ? n : keep;
+        memcpy(join, r->carry, r->carry_len);
+        memcpy(join + r->carry_len, p, head);
+        seq_filter_run(a, r, join, r->carry_len, r->carry_len + head);
+    }
+    seq_filter_run(a, r, p, n, n);
+
+    // Keep the last bytes for the next block
+    if (n >= keep)
+    {
+        memcpy(r->carry, p + n - keep, keep);
+        r->carry_len = keep;
+    }
+    else
+    {
+        size_t drop = r->carry_len + n > keep ? r->carry_len + n - keep : 0;
+        memmove(r->carry, r->carry + drop, r->carry_len - drop);
+        memcpy(r->carry + r->carry_len - drop, p, n);
+        r->carry_len += n - drop;
+    }
+}
+
+// Function to scan a block for the sequences not seen yet
+static void seq_block(const struct seq_automaton *a, struct seq_run *r, const unsigned char *p, size_t n)
+{
+    if (a->engine == SEQ_DFA)
+        seq_dfa_block(a, r, p, n);
+    else
+        seq_filter_block(a, r, p, n);
+}
+
+// Pick the widest kernel the CPU supports when the library is loaded
+__attribute__((constructor))
+static void scan_select_kernel(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        seq_scan = seq_scan_avx2;
+        count_eq = count_eq_avx2;
+    }
+    if (__builtin_cpu_supports("avx512bw"))
+        find_any = find_any_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+        find_any = find_any_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        find_any = find_any_ssse3;
+    else if (__builtin_cpu_supports("sse2"))
+        find_any = find_any_sse2;
+#endif
+    g_debug = getenv("LAB1DEBUG") != NULL;
+    if (g_debug)
+        fprintf(stderr, "Debug mode: byte scan kernel %s\n",
+                find_any == find_any_scalar ? "scalar" :
+#if defined(__x86_64__) || defined(__i386__)
+                find_any == find_any_avx512 ? "avx512" :
+                find_any == find_any_avx2 ? "avx2" :
+                find_any == find_any_ssse3 ? "ssse3" : "sse2");
+#else
+                "scalar");
+#endif
+}
+
+// Remove every missing byte that occurs in the block from the set
+static void scan_block(struct scan_state *st, const unsigned char *p, size_t n)
+{
+    size_t i = 0;
+    while (st->left > 0 && i < n) {
+        i += find_any(p + i, n - i, st);
+        if (i >= n)
+            break;
+        scan_del(st, p[i]);
+        i++;
+    }
+}
+
+// Function to remember the services of the host
+void plugin_set_host(const struct plugin_host *host)
+{
+    g_host = host;
+}
+
+// Function to retrieve plugin information
+int plugin_get_info(struct plugin_info *ppi)
+{
+    // Check for valid argument
+    if (!ppi)
+    {
+        fprintf(stderr, "ERROR: Invalid argument\n");
+        return -1;
+    }
+
+    // Assign plugin purpose, author, and supported options
+    ppi->plugin_purpose = g_purpose;
+    ppi->plugin_author = g_author;
+    ppi->sup_opts_len = g_options_len;
+    ppi->sup_opts = g_options;
+
+    return 0;
+}
+
+static int parse_bytes(char *bytes_string, struct scan_state *st);
+struct bytes_query;
+static int parse_split(const char *name, const char *value, struct bytes_query *q);
+
+// Most threads scanning one file
+#define SPLIT_MAX_THREADS 64
+
+// Query: the bytes and sequences a file must contain
+struct bytes_query {
+    struct scan_state st;       // Set of all target bytes
+    struct seq_automaton *seq;  // Target sequences, NULL if none were given
+    uint64_t need[4];           // Every byte a matching file contains
+    uint64_t split_min;         // Smallest file scanned by several threads
+    uint64_t split_chunk;       // Range a thread takes at a time
+    int split_threads;          // Threads scanning one file, 1 - no splitting
+    int count;                  // Count every target byte (--count)
+    unsigned offsets;           // Offsets reported for every target byte (--offsets)
+    int ntargets;               // Number of target bytes
+    unsigned char targets[256]; // Target bytes in increasing order
+    unsigned char slot[256];    // Position of a target byte in targets[]
+};
+
+// Counts and offsets of the target bytes in one file
+struct count_run {
+    uint64_t pos;               // Offset of the next block in the file
+    struct scan_state pending;  // Target bytes that still need offsets
+    uint64_t total[256];        // Occurrences by byte value
+    uint32_t noff[256];         // Offsets found by byte value
+    uint64_t off[];             // Offset k of target t is off[t * offsets + k]
+};
+
+// Scan state of one file for a query
+struct query_run {
+    struct scan_state st;       // Target bytes not seen yet
+    struct seq_run seq;         // Target sequences not seen yet
+    struct count_run *cnt;      // Counts and offsets, NULL if not asked for
+    int cnt_heap;               // cnt was allocated with calloc()
+};
+
+// Index of the file in the host call, for plugin_host.report
+static __thread size_t tl_report_file = 0;
+
+static void query_free(struct bytes_query *q)
+{
+    seq_free(q->seq);
+    q->seq = NULL;
+}
+
+// Function to parse plugin options into the bytes and sequences to search for
+static int parse_opts(struct option in_opts[],
+                      size_t in_opts_len,
+                      struct bytes_query *q)
+{
+    // Check for valid arguments
+    if (!in_opts || !in_opts_len)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Initialize variables for byte search
+    char *bytes_string = NULL;
+    const char *seq_string = NULL;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    q->split_min = 1ULL << 30;
+    q->split_chunk = 64ULL << 20;
+    q->split_threads = cpus < 1 ? 1 : (cpus > SPLIT_MAX_THREADS ? SPLIT_MAX_THREADS : (int)cpus);
+    q->count = 0;
+    q->offsets = 0;
+    for (size_t i = 0; i < in_opts_len; i++)
+    {
+        // Extract bytes string from plugin options
+        if (!strcmp(in_opts[i].name, "bytes"))
+        {
+            if (bytes_string)
+                free(bytes_string);
+            bytes_string = strdup((char *)in_opts[i].flag);
+        }
+        else if (!strcmp(in_opts[i].name, "sequences"))
+        {
+            seq_string = (const char *)in_opts[i].flag;
+        }
+        else if (!strcmp(in_opts[i].name, "split-threshold") ||
+                 !strcmp(in_opts[i].name, "split-chunk") ||
+                 !strcmp(in_opts[i].name, "split-threads"))
+        {
+            if (parse_split(in_opts[i].name, (const char *)in_opts[i].flag, q) < 0)
+            {
+                if (bytes_string)
+                    free(bytes_string);
+                return -1;
+            }
+        }
+        else if (!strcmp(in_opts[i].name, "count"))
+        {
+            q->count = 1;
+        }
+        else if (!strcmp(in_opts[i].name, "offsets"))
+        {
+            const char *value = (const char *)in_opts[i].flag;
+            char *end;
+            unsigned long v = value ? strtoul(value, &end, 10) : 0;
+            if (!value || end == value || *end || v < 1 || v > COUNT_MAX_OFFSETS)
+            {
+                if (bytes_string)
+                    free(bytes_string);
+                errno = ERANGE;
+                return -1;
+            }
+            q->offsets = (unsigned)v;
+        }
+        else
+        {
+            if (bytes_string)
+                free(bytes_string);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    // Check if bytes string is valid
+    q->seq = NULL;
+    scan_init(&q->st);
+    if (!bytes_string && !seq_string)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (seq_string)
+    {
+        q->seq = seq_compile(seq_string, &q->st);
+        if (!q->seq)
+        {
+            int saved = errno;
+            free(bytes_string);
+            errno = saved;
+            return -1;
+        }
+    }
+    if (parse_bytes(bytes_string, &q->st) < 0)
+    {
+        query_free(q);
+        return -1;
+    }
+
+    // Counts and offsets are reported in the order of the byte values
+    q->ntargets = 0;
+    for (int b = 0; b < 256; b++)
+    {
+        if (scan_has(&q->st, (unsigned char)b))
+        {
+            q->slot[b] = (unsigned char)q->ntargets;
+            q->targets[q->ntargets++] = (unsigned char)b;
+        }
+    }
+
+    // A file without some byte of a sequence cannot contain the sequence
+    memcpy(q->need, q->st.set, sizeof(q->need));
+    for (int b = 0; q->seq && b < 256; b++)
+    {
+        if (q->seq->used[b])
+            q->need[b >> 6] |= 1ULL << (b & 63);
+    }
+    return 0;
+}
+
+// Function to parse one of the options of split scanning
+static int parse_split(const char *name, const char *value, struct bytes_query *q)
+{
+    char *end;
+    if (!value)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned long long v = strtoull(value, &end, 10);
+    if (end == value)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!strcmp(name, "split-threads"))
+    {
+        if (*end || v < 1 || v > SPLIT_MAX_THREADS)
+        {
+            errno = ERANGE;
+            return -1;
+        }
+        q->split_threads = (int)v;
+        return 0;
+    }
+
+    // Sizes may have a binary suffix
+    int shift = 0;
+    if (*end == 'K' || *end == 'k') shift = 10;
+    else if (*end == 'M' || *end == 'm') shift = 20;
+    else if (*end == 'G' || *end == 'g') shift = 30;
+    if ((shift && end[1]) || (!shift && *end) || v == 0 || v > (~0ULL >> shift))
+    {
+        errno = ERANGE;
+        return -1;
+    }
+    if (!strcmp(name, "split-threshold"))
+        q->split_min = v << shift;
+    else
+        q->split_chunk = v << shift;
+    return 0;
+}
+
+// Function to parse the list of --bytes into the set st, frees the list
+static int parse_bytes(char *bytes_string, struct scan_state *st)
+{
+    if (!bytes_string)
+        return 0;
+
+    // Initialize variables for byte parsing
+    char *saveptr = NULL;
+    char *tok = strtok_r(bytes_string, ",", &saveptr);
+    while (tok != NULL) {
+        // Parse binary format bytes
+        if (strlen(tok) > 2 && tok[0] == '0' && tok[1] == 'b') {
+            if (strlen(tok) > 10) {
+                errno = ERANGE;
+                free(bytes_string);
+                return -1;
+            }
+            unsigned char byte = 0;
+            for (size_t i = strlen(tok) - 1; i > 1; i--) {
+                if (tok[i] == '1') {
+                    byte |= (1 << (strlen(tok) - i - 1));
+                }
+            }
+            scan_add(st, byte);
+        }
+        // Parse hexadecimal format bytes
+        else if (strlen(tok) > 2 && tok[0] == '0' && tok[1] == 'x') {
+            if(strlen(tok) > 4){
+                errno = ERANGE;
+                free(bytes_string);
+                return -1;
+            }
+            unsigned char byte = 0;
+            sscanf(tok+2, "%02hhx", &byte);
+            scan_add(st, byte);
+        }
+        // Parse decimal format bytes
+        else
+        {
+            if(tok != NULL && tok[0] == '0' && strcmp(tok, "0")!= 0){
+                errno = EINVAL;
+                free(bytes_string);
+                return -1;
+            }
+            char *endptr;
+            long num = strtol(tok, &endptr, 10);
+            if(num == 0 && endptr == tok && strcmp(tok, "0") != 0){
+                errno = EINVAL;
+                free(bytes_string);
+                return -1;
+            }
+            if(num > 255){
+                errno = ERANGE;
+                free(bytes_string);
+                return -1;
+            }
+            scan_add(st, (unsigned char)num);
+        }
+        tok = strtok_r(NULL, ",", &saveptr);
+    }
+    free(bytes_string);
+    return 0;
+}
+
+// Function to prepare the scan of one file
+static int run_init(const struct bytes_query *q, struct query_run *r)
+{
+    r->st = q->st;
+    r->cnt = NULL;
+    r->cnt_heap = 0;
+    if (seq_run_init(q->seq, &r->seq) < 0)
+        return -1;
+    if (!q->count && !q->offsets)
+        return 0;
+
+    size_t size = sizeof(struct count_run) + (size_t)q->ntargets * q->offsets * sizeof(uint64_t);
+    if (!(r->cnt = scratch_zalloc(size)))
+    {
+        if (!(r->cnt = calloc(1, size)))
+        {
+            seq_run_free(&r->seq);
+            return -1;
+        }
+        r->cnt_heap = 1;
+    }
+    if (q->offsets)
+        r->cnt->pending = q->st;
+    return 0;
+}
+
+// Function to release the scan state of one file
+static void run_free(struct query_run *r)
+{
+    seq_run_free(&r->seq);
+    if (r->cnt_heap)
+        free(r->cnt);
+    r->cnt = NULL;
+    r->cnt_heap = 0;
+}
+
+// Function to check whether a target is still missing
+static inline int run_missing(const struct query_run *r)
+{
+    return r->st.left > 0 || r->seq.left > 0;
+}
+
+// Function to check whether the rest of the file still has to be scanned
+static inline int run_left(const struct bytes_query *q, const struct query_run *r)
+{
+    return run_missing(r) || (r->cnt && (q->count || r->cnt->pending.left > 0));
+}
+
+// Function to count the target bytes of a block and note their first offsets
+static void count_block(const struct bytes_query *q, struct count_run *c, const unsigned char *p, size_t n)
+{
+    struct scan_state *st = &c->pending;
+    size_t i = 0;
+    while (st->left > 0 && i < n)
+    {
+        i += find_any(p + i, n - i, st);
+        if (i >= n)
+            break;
+        unsigned char b = p[i];
+        c->off[(size_t)q->slot[b] * q->offsets + c->noff[b]] = c->pos + i;
+        if (++c->noff[b] == q->offsets)
+            scan_del(st, b);
+        i++;
+    }
+    if (q->count && q->ntargets > 0)
+    {
+        if (count_eq && q->ntargets <= COUNT_SIMD_MAX)
+            count_eq(q->targets, q->ntargets, c->total, p, n);
+        else
+            count_hist(q->targets, q->ntargets, c->total, p, n);
+    }
+    c->pos += n;
+}
+
+// Function to scan a block for everything still missing
+static void run_block(const struct bytes_query *q, struct query_run *r, const unsigned char *p, size_t n)
+{
+    if (r->st.left > 0)
+        scan_block(&r->st, p, n);
+    if (r->seq.left > 0)
+        seq_block(q->seq, &r->seq, p, n);
+    if (r->cnt)
+        count_block(q, r->cnt, p, n);
+}
+
+// Function to give the counts and offsets of a file to the host as JSON
+static void count_report(const struct bytes_query *q, const struct count_run *c)
+{
+    if (!g_host || tl_plugin_thread ||
+        g_host->size < offsetof(struct plugin_host, report) + sizeof(g_host->report) ||
+        !g_host->report)
+        return;
+
+    // "0xff": 18446744073709551615, takes less than 32 characters
+    size_t cap = 64 + (size_t)q->ntargets * (64 + (size_t)q->offsets * 22);
+    char *text = malloc(cap);
+    if (!text)
+        return;
+    size_t len = 0;
+    len += snprintf(text + len, cap - len, "{");
+    if (q->count)
+    {
+        len += snprintf(text + len, cap - len, "\"counts\": {");
+        for (int t = 0; t < q->ntargets; t++)
+        {
+            unsigned char b = q->targets[t];
+            len += snprintf(text + len, cap - len, "%s\"0x%02x\": %llu",
+                            t ? ", " : "", b, (unsigned long long)c->total[b]);
+        }
+        len += snprintf(text + len, cap - len, "}");
+    }
+    if (q->offsets)
+    {
+        len += snprintf(text + len, cap - len, "%s\"offsets\": {", q->count ? ", " : "");
+        for (int t = 0; t < q->ntargets; t++)
+        {
+            unsigned char b = q->targets[t];
+            len += snprintf(text + len, cap - len, "%s\"0x%02x\": [", t ? ", " : "", b);
+            for (uint32_t k = 0; k < c->noff[b]; k++)
+                len += snprintf(text + len, cap - len, "%s%llu", k ? ", " : "",
+                                (unsigned long long)c->off[(size_t)t * q->offsets + k]);
+            len += snprintf(text + len, cap - len, "]");
+        }
+        len += snprintf(text + len, cap - len, "}");
+    }
+    snprintf(text + len, cap - len, "}");
+    g_host->report(tl_report_file, text);
+    free(text);
+}
+
+// Function to turn the scan result into the plugin verdict
+static int run_verdict(const struct bytes_query *q,
+                       struct query_run *r,
+                       const char *fname)
+{
+    // Check if all bytes and sequences are found in the file
+    int ret = run_missing(r) ? 1 : 0;
+    if (r->cnt)
+        count_report(q, r->cnt);
+    run_free(r);
+    // Print debug information if LAB1DEBUG environment variable is set
+    if(g_debug && ret == 0){
+        fprintf(stderr,"Debug mode: Target bytes (");
+        for(int b = 0; b < 256; b++)
+            if ((q->st.set[b >> 6] >> (b & 63)) & 1) fprintf(stderr, "%d,", b);
+        if (q->seq)
+            fprintf(stderr, ") and sequences (%s", q->seq->spec ? q->seq->spec : "");
+        fprintf(stderr, ") found in file %s!\n", fname);
+    }
+    return ret;
+}
+
+static int run_file(const struct bytes_query *q, const char *fname);
+static int run_fd(const struct bytes_query *q, struct query_run *r, int fd, unsigned char *buf, size_t buf_len);
+static int run_split(const struct bytes_query *q, const unsigned char *data, int fd,
+                     uint64_t size, const char *fname);
+
+// Function to check whether a file is large enough to be split between threads
+static inline int split_wanted(const struct bytes_query *q, uint64_t size)
+{
+    // Counts and offsets need the whole file in order
+    return q->split_threads > 1 && !q->count && !q->offsets &&
+           size >= q->split_min && size > q->split_chunk;
+}
+
+// Function to process a file for specified bytes
+int plugin_process_file(const char *fname,
+                        struct option in_opts[],
+                        size_t in_opts_len)
+{
+    // Check for valid arguments
+    if (!fname)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Build the set of bytes and the sequences that have to be found
+    struct bytes_query q;
+    if (parse_opts(in_opts, in_opts_len, &q) < 0)
+        return -1;
+    int ret = run_file(&q, fname);
+    int saved = errno;
+    query_free(&q);
+    errno = saved;
+    return ret;
+}
+
+// Function to scan a file for the bytes and sequences of q
+static int run_file(const struct bytes_query *q, const char *fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if(fd < 0){
+        fprintf(stderr, "open() failed:%s\n", strerror(errno));
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == 0 && S_ISREG(sb.st_mode) && split_wanted(q, (uint64_t)sb.st_size))
+    {
+        int ret = run_split(q, NULL, fd, (uint64_t)sb.st_size, fname);
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return ret;
+    }
+    struct query_run r;
+    unsigned char buf[SCAN_BLOCK_SIZE];
+    if (run_init(q, &r) < 0 || run_fd(q, &r, fd, buf, sizeof(buf)) < 0)
+    {
+        int saved = errno;
+        run_free(&r);
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    close(fd);
+    return run_verdict(q, &r, fname);
+}
+
+// Function to read an open file block by block until everything was seen
+static int run_fd(const struct bytes_query *q, struct query_run *r, int fd, unsigned char *buf, size_t buf_len)
+{
+    while(run_left(q, r)){
+        ssize_t t = read(fd, buf, buf_len);
+        if(t < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        } else if (t == 0) break;
+        run_block(q, r, buf, (size_t)t);
+    }
+    return 0;
+}
+
+// Function to scan file contents that are already in memory
+static int run_buffer(const struct bytes_query *q, const void *data, size_t len)
+{
+    if (split_wanted(q, len))
+        return run_split(q, data, -1, len, "buffer");
+    struct query_run r;
+    if (run_init(q, &r) < 0)
+        return -1;
+    run_block(q, &r, data, len);
+    return run_verdict(q, &r, "buffer");
+}
+
+/*
+    Split scanning of large files.
+
+    A file of at least split-threshold bytes is cut into split-chunk ranges
+    that split-threads threads take one after another, reading them with
+    pread() or straight from the buffer the host has mapped. Every thread
+    scans its range with a private query_run, then ORs what it has seen into
+    the shared bitmaps of bytes and sequences after every block and takes
+    what the others have seen out of its own search. Once nothing is missing
+    all threads stop. A range is scanned max_len - 1 bytes past its end so
+    that sequences starting in it are seen whole.
+*/
+struct split_job {
+    const struct bytes_query *q;
+    const unsigned char *data;  // Contents in memory, NULL to read fd
+    int fd;
+    uint64_t size;
+    uint64_t next;              // Start of the next range to take
+    uint64_t found[4];          // Target bytes some thread has seen
+    uint64_t *seen;             // Sequences some thread has seen
+    long left;                  // Bytes and sequences nobody has seen yet
+    int err;                    // errno of a failed read, 0 if none
+};
+
+// Function to start a range with what the other threads have already seen
+static int split_run_init(struct split_job *j, struct query_run *r)
+{
+    if (run_init(j->q, r) < 0)
+        return -1;
+    for (int b = 0; b < 256; b++)
+    {
+        if (scan_has(&r->st, (unsigned char)b) &&
+            ((__atomic_load_n(&j->found[b >> 6], __ATOMIC_RELAXED) >> (b & 63)) & 1))
+            scan_del(&r->st, (unsigned char)b);
+    }
+    size_t words = j->q->seq ? (j->q->seq->n_term + 63) / 64 : 0;
+    for (size_t w = 0; w < words; w++)
+    {
+        uint64_t bits = __atomic_load_n(&j->seen[w], __ATOMIC_RELAXED);
+        for (; bits; bits &= bits - 1)
+            seq_mark(&r->seq, (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+    }
+    return 0;
+}
+
+// Function to share what a range has seen, returns 1 once nothing is missing
+static int split_publish(struct split_job *j, struct query_run *r)
+{
+    const struct bytes_query *q = j->q;
+    long fresh = 0;
+    for (int w = 0; w < 4; w++)
+    {
+        uint64_t mine = q->st.set[w] & ~r->st.set[w];
+        uint64_t old = mine ? __atomic_fetch_or(&j->found[w], mine, __ATOMIC_RELAXED)
+                            : __atomic_load_n(&j->found[w], __ATOMIC_RELAXED);
+        fresh += __builtin_popcountll(mine & ~old);
+        // Bytes found by others are not searched for any more
+        for (uint64_t bits = old & r->st.set[w]; bits; bits &= bits - 1)
+            scan_del(&r->st, (unsigned char)(w * 64 + __builtin_ctzll(bits)));
+    }
+    size_t words = q->seq ? (q->seq->n_term + 63) / 64 : 0;
+    for (size_t w = 0; w < words; w++)
+    {
+        uint64_t mine = r->seq.seen[w];
+        uint64_t old = mine ? __atomic_fetch_or(&j->seen[w], mine, __ATOMIC_RELAXED)
+                            : __atomic_load_n(&j->seen[w], __ATOMIC_RELAXED);
+        fresh += __builtin_popcountll(mine & ~old);
+        for (uint64_t bits = old & ~mine; bits; bits &= bits - 1)
+            seq_mark(&r->seq, (uint32_t)(w * 64 + __builtin_ctzll(bits)));
+    }
+    if (fresh)
+        return __atomic_sub_fetch(&j->left, fresh, __ATOMIC_SEQ_CST) <= 0;
+    return __atomic_load_n(&j->left, __ATOMIC_SEQ_CST) <= 0;
+}
+
+// Thread that takes ranges of a split file until it is done
+static void *split_worker(void *arg)
+{
+    struct split_job *j = arg;
+    const struct bytes_query *q = j->q;
+    const uint64_t chunk = q->split_chunk;
+    const uint64_t overlap = q->seq ? q->seq->max_len - 1 : 0;
+    unsigned char *buf = NULL;
+    if (!j->data && !(buf = malloc(SCAN_BLOCK_SIZE)))
+    {
+        __atomic_store_n(&j->err, ENOMEM, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+
+    int done = 0;
+    while (!done && !__atomic_load_n(&j->err, __ATOMIC_SEQ_CST) &&
+           __atomic_load_n(&j->left, __ATOMIC_SEQ_CST) > 0)
+    {
+        uint64_t start = __atomic_fetch_add(&j->next, chunk, __ATOMIC_SEQ_CST);
+        if (start >= j->size)
+            break;
+        uint64_t stop = start + chunk + overlap < j->size ? start + chunk + overlap : j->size;
+
+        struct query_run r;
+        if (split_run_init(j, &r) < 0)
+        {
+            __atomic_store_n(&j->err, ENOMEM, __ATOMIC_SEQ_CST);
+            break;
+        }
+        for (uint64_t off = start; off < stop && run_left(q, &r); )
+        {
+            size_t n = stop - off < SCAN_BLOCK_SIZE ? (size_t)(stop - off) : SCAN_BLOCK_SIZE;
+            const unsigned char *p = j->data ? j->data + off : buf;
+            if (!j->data)
+            {
+                ssize_t t = pread(j->fd, buf, n, (off_t)off);
+                if (t < 0 && errno == EINTR)
+                    continue;
+                if (t < 0)
+                {
+                    __atomic_store_n(&j->err, errno, __ATOMIC_SEQ_CST);
+                    break;
+                }
+                if (t == 0)
+                    break;      // The file was truncated meanwhile
+                n = (size_t)t;
+            }
+            run_block(q, &r, p, n);
+            off += n;
+            if ((done = split_publish(j, &r)) != 0 || __atomic_load_n(&j->err, __ATOMIC_SEQ_CST))
+                break;
+        }
+        run_free(&r);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Entry of the threads that run_split() starts
+static void *split_thread(void *arg)
+{
+    tl_plugin_thread = 1;
+    return split_worker(arg);
+}
+
+// Function to scan a large file with several threads
+static int run_split(const struct bytes_query *q, const unsigned char *data, int fd,
+                     uint64_t size, const char *fname)
+{
+    struct split_job j;
+    memset(&j, 0, sizeof(j));
+    j.q = q;
+    j.data = data;
+    j.fd = fd;
+    j.size = size;
+    j.left = q->st.left + (long)(q->seq ? q->seq->n_term : 0);
+    uint64_t seen_small[8] = {0};
+    size_t words = q->seq ? (q->seq->n_term + 63) / 64 : 0;
+    int seen_heap = 0;
+    j.seen = seen_small;
+    if (words > sizeof(seen_small) / sizeof(seen_small[0]) && !(j.seen = scratch_zalloc(words * sizeof(uint64_t))))
+    {
+        if (!(j.seen = calloc(words, sizeof(uint64_t))))
+            return -1;
+        seen_heap = 1;
+    }
+
+    // The calling thread scans too, a thread that cannot start leaves more for the rest
+    uint64_t ranges = (size + q->split_chunk - 1) / q->split_chunk;
+    int n = ranges < (uint64_t)q->split_threads ? (int)ranges : q->split_threads;
+    pthread_t threads[SPLIT_MAX_THREADS];
+    int started = 0;
+    for (; started < n - 1; started++)
+    {
+        if (pthread_create(&threads[started], NULL, split_thread, &j) != 0)
+            break;
+    }
+    split_worker(&j);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (seen_heap)
+        free(j.seen);
+
+    if (j.err)
+    {
+        errno = j.err;
+        return -1;
+    }
+    struct query_run r;
+    memset(&r, 0, sizeof(r));
+    r.seq.seen = r.seq.seen_small;
+    r.st.left = j.left > 0;
+    return run_verdict(q, &r, fname);
+}
+
+// Function to process file contents that the host has already read
+int plugin_process_buffer(const void *data,
+                          size_t len,
+                          struct option in_opts[],
+                          size_t in_opts_len)
+{
+    // Check for valid arguments
+    if (!data && len > 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct bytes_query q;
+    if (parse_opts(in_opts, in_opts_len, &q) < 0)
+        return -1;
+    int ret = run_buffer(&q, data, len);
+    int saved = errno;
+    query_free(&q);
+    errno = saved;
+    return ret;
+}
+
+// Function to parse the options once before the walk
+int plugin_compile(struct option in_opts[],
+                   size_t in_opts_len,
+                   void **query)
+{
+    if (!query)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct bytes_query *q = malloc(sizeof(*q));
+    if (!q)
+        return -1;
+    if (parse_opts(in_opts, in_opts_len, q) < 0)
+    {
+        int saved = errno;
+        free(q);
+        errno = saved;
+        return -1;
+    }
+    *query = q;
+    return 0;
+}
+
+// Function to process a file with a compiled query
+int plugin_process_compiled(void *query, const char *fname)
+{
+    if (!query || !fname)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The query is shared by all threads, the scan state is private
+    return run_file(query, fname);
+}
+
+// Function to process file contents with a compiled query
+int plugin_process_compiled_buffer(void *query, const void *data, size_t len)
+{
+    if (!query || (!data && len > 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return run_buffer(query, data, len);
+}
+
+// Scan state of contents that the host passes in parts
+struct stream_run {
+    const struct bytes_query *q;
+    struct query_run r;
+};
+
+// Function to start checking contents that arrive in parts
+int plugin_stream_begin(void *query, void **state)
+{
+    if (!query || !state)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stream_run *s = malloc(sizeof(*s));
+    if (!s)
+        return -1;
+    s->q = query;
+    if (run_init(s->q, &s->r) < 0)
+    {
+        int saved = errno;
+        free(s);
+        errno = saved;
+        return -1;
+    }
+    *state = s;
+    return 0;
+}
+
+// Function to scan the next part, returns 0 once nothing more is needed
+int plugin_stream_update(void *state, const void *data, size_t len)
+{
+    if (!state || (!data && len > 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Sequences that cross the border of two parts are found, the scan state carries over
+    struct stream_run *s = state;
+    if (run_left(s->q, &s->r))
+        run_block(s->q, &s->r, data, len);
+    return run_left(s->q, &s->r) ? 1 : 0;
+}
+
+// Function to finish the check of the parts and free the state
+int plugin_stream_end(void *state)
+{
+    if (!state)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct stream_run *s = state;
+    int ret = run_verdict(s->q, &s->r, "stream");
+    free(s);
+    return ret;
+}
+
+// Function to get the descriptor of file i of a batch, opening it if needed
+static int batch_open(const char *const fnames[], const int fds[], size_t i)
+{
+    if (fds && fds[i] >= 0)
+        return fds[i];
+    if (!fnames || !fnames[i])
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(fnames[i], O_RDONLY);
+    // Ask the kernel to start reading the file while earlier ones are scanned
+    if (fd >= 0)
+        posix_fadvise(fd, 0, SCAN_BLOCK_SIZE * 4, POSIX_FADV_WILLNEED);
+    return fd;
+}
+
+// Function to process a batch of files with a compiled query
+int plugin_process_files(void *query,
+                         const char *const fnames[],
+                         const int fds[],
+                         size_t n,
+                         int results[])
+{
+    if (!query || (!fnames && !fds) || !results)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    const struct bytes_query *q = query;
+    unsigned char buf[SCAN_BLOCK_SIZE];     // Shared by all files of the batch
+
+    // Keep the next file open so its readahead overlaps the current scan
+    int next = n > 0 ? batch_open(fnames, fds, 0) : -1;
+    int next_err = errno;
+    for (size_t i = 0; i < n; i++)
+    {
+        int fd = next, fd_err = next_err;
+        if (i + 1 < n)
+        {
+            next = batch_open(fnames, fds, i + 1);
+            next_err = errno;
+        }
+        if (fd < 0)
+        {
+            results[i] = -fd_err;
+            continue;
+        }
+
+        struct query_run r;
+        if (run_init(q, &r) < 0 || run_fd(q, &r, fd, buf, sizeof(buf)) < 0)
+        {
+            results[i] = -errno;
+            run_free(&r);
+        }
+        else
+        {
+            tl_report_file = i;
+            results[i] = run_verdict(q, &r, fnames ? fnames[i] : "descriptor");
+            tl_report_file = 0;
+        }
+        if (!fds || fds[i] < 0)
+            close(fd);
+    }
+    return 0;
+}
+
+// Function to answer the query from the set of bytes occurring in a file
+int plugin_process_presence(void *query, const uint64_t presence[4])
+{
+    if (!query || !presence)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Every target byte and every byte of the sequences must occur in the file
+    const struct bytes_query *q = query;
+    for (int w = 0; w < 4; w++)
+    {
+        if (q->need[w] & ~presence[w])
+            return 1;
+    }
+    // The order of bytes is not in the set, sequences and counts need the file itself
+    if (q->seq || q->count || q->offsets)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to describe files that can match without reading them
+int plugin_get_meta_filter(void *query, struct plugin_meta_filter *mf)
+{
+    if (!query || !mf)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Every distinct target byte takes a byte of the file, a sequence takes its length
+    const struct bytes_query *q = query;
+    int64_t min_size = 0;
+    for (int w = 0; w < 4; w++)
+        min_size += __builtin_popcountll(q->need[w]);
+    if (q->seq && (int64_t)q->seq->max_len > min_size)
+        min_size = q->seq->max_len;
+    mf->min_size = min_size;
+
+    // Only regular files are searched, FIFOs and devices may block or never end
+    mf->mode_mask = S_IFMT;
+    mf->mode_value = S_IFREG;
+    return 0;
+}
+
+// Function to free a compiled query
+void plugin_free_query(void *query)
+{
+    if (query)
+        query_free(query);
+    free(query);
 }
@@ -2,8 +2,10 @@
 #define _PLUGIN_API_H
 
 #include <getopt.h>
+#include <stdint.h>
+#include <stddef.h>
 
-#define PLUGIN_API_VERSION  1
+#define PLUGIN_API_VERSION  2
 
 /*
     Структура, описывающая опцию, поддерживаемую плагином.
@@ -79,5 +81,286 @@ int plugin_process_file(const char *fname,
     В случае, если произошла ошибка, переменная errno должна устанавливаться 
     в соответствующее значение.
 */
-        
+
+
+
+int plugin_process_buffer(const void *data,
+        size_t len,
+        struct option in_opts[],
+        size_t in_opts_len);
+/*
+    plugin_process_buffer()
+
+    Необязательная функция (API версии 2). Делает то же, что и
+    plugin_process_file(), но получает уже прочитанное содержимое файла.
+    Программа читает (или отображает в память с помощью mmap) каждый файл
+    один раз и передает одно и то же содержимое всем плагинам, которые
+    экспортируют эту функцию. Плагины без нее вызываются через
+    plugin_process_file().
+
+    Аргументы:
+        data - адрес содержимого файла. Память доступна только для чтения и
+            действительна только до возврата из функции.
+
+        len - длина содержимого в байтах (может быть равна 0, тогда data
+            может быть NULL).
+
+        in_opts, in_opts_len - как в plugin_process_file().
+
+    Возвращаемое значение:
+        как в plugin_process_file().
+*/
+
+
+int plugin_compile(struct option in_opts[],
+        size_t in_opts_len,
+        void **query);
+/*
+    plugin_compile()
+
+    Необязательная функция (API версии 2). Разбирает опции один раз перед
+    обходом каталога, чтобы при проверке каждого файла не разбирать их заново
+    и не выделять память. Программа использует скомпилированный запрос, только
+    если плагин экспортирует также plugin_process_compiled() и
+    plugin_free_query().
+
+    Аргументы:
+        in_opts, in_opts_len - как в plugin_process_file().
+
+        query - адрес, по которому плагин записывает указатель на
+            скомпилированный запрос.
+
+    Возвращаемое значение:
+          0 - в случае успеха,
+        < 0 - опции неверны (errno устанавливается в соответствующее значение).
+*/
+
+
+int plugin_process_compiled(void *query, const char *fname);
+/*
+    plugin_process_compiled()
+
+    То же, что и plugin_process_file(), но критерии задаются запросом,
+    полученным от plugin_compile(). Запрос может одновременно использоваться
+    несколькими потоками, поэтому функция не должна его изменять.
+
+    Возвращаемое значение:
+        как в plugin_process_file().
+*/
+
+
+int plugin_process_compiled_buffer(void *query, const void *data, size_t len);
+/*
+    plugin_process_compiled_buffer()
+
+    Необязательная функция. То же, что и plugin_process_buffer(), но с
+    запросом, полученным от plugin_compile().
+*/
+
+
+void plugin_free_query(void *query);
+/*
+    plugin_free_query()
+
+    Освобождает запрос, полученный от plugin_compile().
+*/
+
+
+int plugin_process_presence(void *query, const uint64_t presence[4]);
+/*
+    plugin_process_presence()
+
+    Необязательная функция. Позволяет проверить файл без чтения, если
+    программа знает, какие значения байтов в нем встречаются (например, из
+    индекса, построенного ранее).
+
+    Аргументы:
+        query - запрос, полученный от plugin_compile().
+
+        presence - множество значений байтов, встречающихся в файле: байт b
+            встречается, если установлен бит (b % 64) в слове presence[b / 64].
+
+    Возвращаемое значение:
+          0 - файл отвечает заданным критериям,
+        > 0 - файл НЕ отвечает заданным критериям,
+        < 0 - по множеству байтов ответить нельзя (errno = ENOTSUP), файл
+              нужно проверить обычным образом.
+
+    Ответ > 0 должен оставаться верным для любого подмножества presence:
+    если файл с такими байтами не подходит, то не подходит и файл, в котором
+    встречается только часть из них.
+*/
+
+
+int plugin_process_files(void *query,
+        const char *const fnames[],
+        const int fds[],
+        size_t n,
+        int results[]);
+/*
+    plugin_process_files()
+
+    Необязательная функция. Проверяет сразу несколько файлов с запросом,
+    полученным от plugin_compile(). За один вызов плагин может заранее
+    запросить чтение следующих файлов, использовать одни и те же буферы и
+    обрабатывать небольшие файлы вместе.
+
+    Аргументы:
+        query - запрос, полученный от plugin_compile().
+
+        fnames - массив из n путей к файлам (может быть NULL, если задан fds).
+
+        fds - массив из n открытых дескрипторов файлов или NULL. Если fds[i]
+            не меньше 0, файл читается через этот дескриптор, иначе
+            открывается по пути fnames[i]. Плагин не закрывает переданные
+            дескрипторы.
+
+        n - число файлов.
+
+        results - массив из n элементов, в который записывается результат
+            проверки каждого файла: 0 - файл отвечает критериям, > 0 - НЕ
+            отвечает, < 0 - ошибка, значение равно -errno.
+
+    Возвращаемое значение:
+          0 - все элементы results заполнены,
+        < 0 - вызов не выполнен целиком (errno устанавливается в
+              соответствующее значение).
+*/
+
+
+/*
+    Условия на метаданные файла (см. plugin_get_meta_filter()).
+    Программа проверяет их по результату stat() до открытия файла.
+*/
+struct plugin_meta_filter {
+    /* Допустимый размер файла в байтах, -1 - без ограничения */
+    int64_t min_size;
+    int64_t max_size;
+    /* Допустимое время изменения (st_mtime) в секундах, -1 - без ограничения */
+    int64_t min_mtime;
+    int64_t max_mtime;
+    /* Владелец и группа файла, -1 - любые */
+    int64_t uid;
+    int64_t gid;
+    /* Файл подходит, если (st_mode & mode_mask) == mode_value */
+    uint32_t mode_mask;
+    uint32_t mode_value;
+    /* Окончание имени файла, например ".log", NULL - любое */
+    const char *ext;
+};
+
+
+int plugin_get_meta_filter(void *query, struct plugin_meta_filter *mf);
+/*
+    plugin_get_meta_filter()
+
+    Необязательная функция. Позволяет плагину сообщить условия на метаданные,
+    которым удовлетворяет любой подходящий под запрос файл. Программа
+    вызывает ее один раз после plugin_compile() и не вызывает функции
+    проверки для файлов, которые этим условиям не удовлетворяют: такие файлы
+    считаются НЕ отвечающими критериям.
+
+    Аргументы:
+        query - запрос, полученный от plugin_compile().
+
+        mf - структура, которую заполняет плагин. Перед вызовом программа
+            записывает в нее условия, пропускающие любой файл. Строка ext
+            должна оставаться доступной до вызова plugin_free_query().
+
+    Возвращаемое значение:
+          0 - условия записаны в mf,
+        < 0 - условий нет, файлы проверяются обычным образом.
+*/
+
+
+int plugin_stream_begin(void *query, void **state);
+/*
+    plugin_stream_begin()
+
+    Необязательная функция, экспортируется вместе с plugin_stream_update()
+    и plugin_stream_end(). Начинает проверку содержимого, которое программа
+    передает по частям (например, распакованного из сжатого файла), с
+    запросом, полученным от plugin_compile(). Все три функции для одного
+    state вызываются из одного потока. Ограничения на размер из
+    plugin_get_meta_filter() к сжатому файлу не применяются: они относятся
+    к содержимому, а не к файлу на диске.
+
+    Аргументы:
+        query - запрос, полученный от plugin_compile().
+
+        state - сюда записывается состояние проверки для
+            plugin_stream_update() и plugin_stream_end().
+
+    Возвращаемое значение:
+          0 - проверка начата,
+        < 0 - ошибка (errno устанавливается в соответствующее значение).
+*/
+
+
+int plugin_stream_update(void *state, const void *data, size_t len);
+/*
+    plugin_stream_update()
+
+    Передает плагину следующую часть содержимого. Части идут по порядку,
+    без пропусков и перекрытий, и могут быть любого размера. Данные
+    доступны только до возврата из функции.
+
+    Возвращаемое значение:
+        > 0 - плагину нужны следующие части,
+          0 - результат уже известен, остальные части можно не передавать,
+        < 0 - ошибка (errno устанавливается в соответствующее значение).
+*/
+
+
+int plugin_stream_end(void *state);
+/*
+    plugin_stream_end()
+
+    Завершает проверку по переданным частям и освобождает state.
+    Вызывается ровно один раз после успешного plugin_stream_begin(), в том
+    числе после ошибки plugin_stream_update().
+
+    Возвращаемое значение:
+        как в plugin_process_file().
+*/
+
+
+/*
+    Услуги, которые программа предоставляет плагинам (см. plugin_set_host()).
+*/
+struct plugin_host {
+    /* Размер структуры у программы, поля за его пределами отсутствуют */
+    size_t size;
+    /*
+        Выделяет size байт временной памяти, выровненной на 16 байт.
+        Память принадлежит потоку программы, вызвавшему функцию плагина, и
+        освобождается целиком после проверки очередного файла, поэтому
+        освобождать ее не нужно и нельзя. Вызывать только из этого потока.
+        Возвращает NULL, если память исчерпана (см. --mem-limit): тогда
+        плагин может выделить память сам.
+    */
+    void *(*scratch_alloc)(size_t size);
+    /*
+        Передает программе отчет о проверяемом файле (например, сколько раз
+        в нем встречается каждый байт): text - объект JSON в одну строку.
+        file - номер файла в fnames[] при вызове plugin_process_files(), 0
+        при остальных вызовах. Программа копирует текст и выводит его вместе
+        с файлом, если файл будет выведен. Вызывать только из потока,
+        вызвавшего функцию плагина, до возврата из нее.
+    */
+    void (*report)(size_t file, const char *text);
+};
+
+
+void plugin_set_host(const struct plugin_host *host);
+/*
+    plugin_set_host()
+
+    Необязательная функция. Программа вызывает ее сразу после загрузки
+    плагина, до plugin_compile() и функций проверки.
+
+    Аргументы:
+        host - услуги программы, структура доступна до выгрузки плагина.
+*/
+
 #endif